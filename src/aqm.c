@@ -0,0 +1,255 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aqm.h"
+
+#define LIST_NONE 0
+#define LIST_NEW 1
+#define LIST_OLD 2
+
+static uint64_t isqrt(uint64_t x) {
+  uint64_t r = x, y = (x + 1) / 2;
+
+  while (y < r) {
+    r = y;
+    y = (r + x / r) / 2;
+  }
+  return r;
+}
+
+// next drop time: the interval shrinks with the square root of the drops
+static uint64_t control_law(const struct aqm *aqm, uint64_t t,
+                            uint32_t count) {
+  return t + aqm->interval * 1024 / isqrt((uint64_t)count << 20);
+}
+
+int aqm_init(struct aqm *aqm, unsigned nflows, size_t limit, uint64_t target,
+             uint64_t interval) {
+  memset(aqm, 0, sizeof(*aqm));
+  aqm->flows = calloc(nflows, sizeof(*aqm->flows));
+  if (aqm->flows == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  aqm->nflows = nflows;
+  aqm->limit = limit;
+  aqm->target = target;
+  aqm->interval = interval;
+  aqm->new_head = aqm->new_tail = -1;
+  aqm->old_head = aqm->old_tail = -1;
+  return 0;
+}
+
+void aqm_free(struct aqm *aqm) {
+  unsigned i;
+
+  for (i = 0; i < aqm->nflows; i++) {
+    struct aqm_packet *pkt = aqm->flows[i].head;
+    while (pkt != NULL) {
+      struct aqm_packet *next = pkt->next;
+      free(pkt);
+      pkt = next;
+    }
+  }
+  free(aqm->flows);
+  memset(aqm, 0, sizeof(*aqm));
+}
+
+static void list_push(struct aqm *aqm, int list, int index) {
+  int *head = list == LIST_NEW ? &aqm->new_head : &aqm->old_head;
+  int *tail = list == LIST_NEW ? &aqm->new_tail : &aqm->old_tail;
+
+  aqm->flows[index].next = -1;
+  aqm->flows[index].list = list;
+  if (*tail == -1) {
+    *head = index;
+  } else {
+    aqm->flows[*tail].next = index;
+  }
+  *tail = index;
+}
+
+static int list_pop(struct aqm *aqm, int list) {
+  int *head = list == LIST_NEW ? &aqm->new_head : &aqm->old_head;
+  int *tail = list == LIST_NEW ? &aqm->new_tail : &aqm->old_tail;
+  const int index = *head;
+
+  *head = aqm->flows[index].next;
+  if (*head == -1)
+    *tail = -1;
+  aqm->flows[index].list = LIST_NONE;
+  return index;
+}
+
+static struct aqm_packet *flow_pop(struct aqm *aqm, struct aqm_flow *flow) {
+  struct aqm_packet *pkt = flow->head;
+
+  if (pkt != NULL) {
+    flow->head = pkt->next;
+    if (flow->head == NULL)
+      flow->tail = NULL;
+    flow->backlog -= pkt->size;
+    aqm->backlog -= pkt->size;
+  }
+  return pkt;
+}
+
+// make room by dropping the oldest packet of the longest queue
+static void drop_overlimit(struct aqm *aqm) {
+  struct aqm_flow *fat = &aqm->flows[0];
+  unsigned i;
+
+  for (i = 1; i < aqm->nflows; i++) {
+    if (aqm->flows[i].backlog > fat->backlog)
+      fat = &aqm->flows[i];
+  }
+  free(flow_pop(aqm, fat));
+  aqm->drops++;
+  aqm->overlimits++;
+}
+
+int aqm_enqueue(struct aqm *aqm, uint32_t hash, const char *frame,
+                size_t size, uint64_t now) {
+  const unsigned index = hash % aqm->nflows;
+  struct aqm_flow *flow = &aqm->flows[index];
+
+  while (aqm->backlog > 0 && aqm->backlog + size > aqm->limit)
+    drop_overlimit(aqm);
+
+  struct aqm_packet *pkt = malloc(sizeof(*pkt) + size);
+  if (pkt == NULL) {
+    aqm->drops++;
+    return -1;
+  }
+  pkt->next = NULL;
+  pkt->time = now;
+  pkt->size = size;
+  memcpy(pkt->frame, frame, size);
+
+  if (flow->tail == NULL) {
+    flow->head = pkt;
+  } else {
+    flow->tail->next = pkt;
+  }
+  flow->tail = pkt;
+  flow->backlog += size;
+  aqm->backlog += size;
+
+  if (flow->list == LIST_NONE) {
+    flow->deficit = AQM_QUANTUM;
+    list_push(aqm, LIST_NEW, index);
+  }
+  return 0;
+}
+
+// whether the sojourn time of the head packet has been above the target
+// for an interval; a queue of at most one packet is never above
+static int codel_ok_to_drop(struct aqm *aqm, struct aqm_flow *flow,
+                            const struct aqm_packet *pkt, uint64_t now) {
+  struct codel *c = &flow->codel;
+
+  if (now - pkt->time < aqm->target ||
+      flow->backlog + pkt->size <= AQM_QUANTUM) {
+    c->first_above_time = 0;
+    return 0;
+  }
+  if (c->first_above_time == 0) {
+    c->first_above_time = now + aqm->interval;
+    return 0;
+  }
+  return now >= c->first_above_time;
+}
+
+// CoDel dequeue of one flow: drops (or marks and sends) heads as long as
+// the control law says so
+static struct aqm_packet *codel_dequeue(struct aqm *aqm, struct aqm_flow *flow,
+                                        uint64_t now) {
+  struct codel *c = &flow->codel;
+
+  for (;;) {
+    struct aqm_packet *pkt = flow_pop(aqm, flow);
+    if (pkt == NULL) {
+      c->first_above_time = 0;
+      c->dropping = 0;
+      return NULL;
+    }
+
+    const int ok_to_drop = codel_ok_to_drop(aqm, flow, pkt, now);
+    int drop = 0;
+
+    if (c->dropping) {
+      if (!ok_to_drop) {
+        c->dropping = 0;
+      } else if (now >= c->drop_next) {
+        c->count++;
+        c->drop_next = control_law(aqm, c->drop_next, c->count);
+        drop = 1;
+      }
+    } else if (ok_to_drop) {
+      // start dropping, at the rate of the last episode if it was recent
+      const uint32_t delta = c->count - c->lastcount;
+      c->dropping = 1;
+      c->count = delta > 1 && now - c->drop_next < 16 * aqm->interval
+                     ? delta
+                     : 1;
+      c->drop_next = control_law(aqm, now, c->count);
+      c->lastcount = c->count;
+      drop = 1;
+    }
+
+    if (!drop)
+      return pkt;
+    if (aqm->mark != NULL && aqm->mark(aqm->mark_arg, pkt->frame, pkt->size)) {
+      aqm->marks++;
+      return pkt;
+    }
+    aqm->drops++;
+    free(pkt);
+  }
+}
+
+struct aqm_packet *aqm_dequeue(struct aqm *aqm, uint64_t now) {
+  for (;;) {
+    const int list = aqm->new_head != -1   ? LIST_NEW
+                     : aqm->old_head != -1 ? LIST_OLD
+                                           : LIST_NONE;
+    if (list == LIST_NONE)
+      return NULL;
+
+    const int index = list == LIST_NEW ? aqm->new_head : aqm->old_head;
+    struct aqm_flow *flow = &aqm->flows[index];
+
+    // a flow that used up its quantum goes to the end of the old flows
+    if (flow->deficit <= 0) {
+      flow->deficit += AQM_QUANTUM;
+      list_pop(aqm, list);
+      list_push(aqm, LIST_OLD, index);
+      continue;
+    }
+
+    struct aqm_packet *pkt = codel_dequeue(aqm, flow, now);
+    if (pkt == NULL) {
+      // an emptied new flow gets one more round as an old flow, so that a
+      // flow cannot stay new by sending in bursts
+      list_pop(aqm, list);
+      if (list == LIST_NEW && aqm->old_head != -1)
+        list_push(aqm, LIST_OLD, index);
+      continue;
+    }
+
+    flow->deficit -= pkt->size;
+    aqm->packets++;
+    aqm->bytes += pkt->size;
+    return pkt;
+  }
+}
+
+void aqm_release(struct aqm *aqm, struct aqm_packet *pkt) {
+  (void)aqm;
+  free(pkt);
+}
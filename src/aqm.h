@@ -0,0 +1,89 @@
+#ifndef __AQM_H__
+#define __AQM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Active queue management of the packets waiting for the transfer: CoDel
+ * (RFC 8289) on one queue, or FQ-CoDel (RFC 8290) on per-flow queues that
+ * are served by deficit round robin, flows that just became active first.
+ *
+ * Packets are timestamped when they are queued; at dequeue CoDel drops, or
+ * ECN marks, the head of a queue whose sojourn time stayed above the
+ * target for an interval, at a rate that grows until the standing queue
+ * is gone. The total backlog is bounded as well: beyond the limit the
+ * head of the longest queue is dropped.
+ */
+
+#define AQM_TARGET_DEF 5000
+#define AQM_INTERVAL_DEF 100000
+#define AQM_FLOWS_DEF 1024
+#define AQM_QUANTUM 1514
+
+struct aqm_packet {
+  struct aqm_packet *next;
+  uint64_t time;
+  size_t size;
+  char frame[];
+};
+
+struct codel {
+  uint64_t first_above_time;
+  uint64_t drop_next;
+  uint32_t count;
+  uint32_t lastcount;
+  int dropping;
+};
+
+struct aqm_flow {
+  struct aqm_packet *head;
+  struct aqm_packet *tail;
+  size_t backlog;
+  long deficit;
+  struct codel codel;
+  // next flow on the new or old list, and which list it is on
+  int next;
+  int list;
+};
+
+struct aqm {
+  struct aqm_flow *flows;
+  unsigned nflows;
+  size_t limit;
+  uint64_t target;
+  uint64_t interval;
+  size_t backlog;
+
+  // lists of active flows, by index (-1: empty)
+  int new_head, new_tail;
+  int old_head, old_tail;
+
+  // turns a packet to be dropped into an ECN marked one, if it is capable
+  int (*mark)(void *arg, char *frame, size_t size);
+  void *mark_arg;
+
+  unsigned long packets;
+  unsigned long bytes;
+  unsigned long drops;
+  unsigned long marks;
+  unsigned long overlimits;
+};
+
+// nflows 1 is plain CoDel; times are in microseconds, limit in bytes;
+// returns 0 or -1 if out of memory
+int aqm_init(struct aqm *aqm, unsigned nflows, size_t limit, uint64_t target,
+             uint64_t interval);
+void aqm_free(struct aqm *aqm);
+
+// queue a copy of a frame of the flow with the given hash; returns 0, or -1
+// if out of memory (the frame is dropped)
+int aqm_enqueue(struct aqm *aqm, uint32_t hash, const char *frame,
+                size_t size, uint64_t now);
+
+// the next packet to send, or NULL; release it with aqm_release()
+struct aqm_packet *aqm_dequeue(struct aqm *aqm, uint64_t now);
+
+void aqm_release(struct aqm *aqm, struct aqm_packet *pkt);
+
+#endif
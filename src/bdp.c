@@ -0,0 +1,48 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "bdp.h"
+
+int bdp_sample(int sock, struct bdp_sample *s) {
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+
+  memset(&ti, 0, sizeof(ti));
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1)
+    return -1;
+
+  memset(s, 0, sizeof(*s));
+  s->rtt = ti.tcpi_rtt;
+  s->cwnd = ti.tcpi_snd_cwnd;
+  s->mss = ti.tcpi_snd_mss;
+  // older kernels fill in less
+  if (len >= offsetof(struct tcp_info, tcpi_delivery_rate) +
+                 sizeof(ti.tcpi_delivery_rate)) {
+    s->rate = ti.tcpi_delivery_rate;
+    s->app_limited = ti.tcpi_delivery_rate_app_limited;
+  }
+
+  if (s->rate > 0 && s->rtt > 0) {
+    s->send = s->rate * s->rtt / 1000000;
+  } else {
+    s->send = (size_t)s->cwnd * s->mss;
+  }
+  s->recv = ti.tcpi_rcv_space;
+  return 0;
+}
+
+size_t bdp_buffer_size(size_t bdp, unsigned headroom, size_t min,
+                       size_t max) {
+  size_t size = min;
+
+  while (size < bdp * headroom && size < max)
+    size <<= 1;
+  return size < max ? size : max;
+}
@@ -0,0 +1,34 @@
+#ifndef __BDP_H__
+#define __BDP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bandwidth-delay product of a TCP connection, from TCP_INFO. The send
+ * side is the delivery rate times the smoothed RTT, or the congestion
+ * window where the kernel has no delivery rate. The receive side is what
+ * the kernel's receive buffer autotuning measured arriving in an RTT.
+ */
+
+struct bdp_sample {
+  // smoothed RTT in usec, delivery rate in bytes per second
+  uint32_t rtt;
+  uint64_t rate;
+  uint32_t cwnd;
+  uint32_t mss;
+  // the sender had no more to send, so the rate is a lower bound
+  int app_limited;
+
+  size_t send;
+  size_t recv;
+};
+
+// returns 0, or -1 with errno set
+int bdp_sample(int sock, struct bdp_sample *s);
+
+// the first of min, 2 min, 4 min, ... that holds <headroom> times bdp,
+// at most max
+size_t bdp_buffer_size(size_t bdp, unsigned headroom, size_t min, size_t max);
+
+#endif
@@ -0,0 +1,375 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <limits.h>
+#include <snappy-c.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+
+// ---------------------------------------------------
+// snappy
+// ---------------------------------------------------
+static size_t snappy_codec_max_compressed_length(size_t len) {
+  return snappy_max_compressed_length(len);
+}
+
+static int snappy_codec_compress(struct codec *codec, const char *in,
+                                 size_t len, char *out, size_t *outlen) {
+  (void)codec;
+  return snappy_compress(in, len, out, outlen) == SNAPPY_OK ? 0 : -1;
+}
+
+static int snappy_codec_uncompressed_length(struct codec *codec,
+                                            const char *in, size_t len,
+                                            size_t *result) {
+  (void)codec;
+  return snappy_uncompressed_length(in, len, result) == SNAPPY_OK ? 0 : -1;
+}
+
+static int snappy_codec_uncompress(struct codec *codec, const char *in,
+                                   size_t len, char *out, size_t *outlen) {
+  (void)codec;
+  return snappy_uncompress(in, len, out, outlen) == SNAPPY_OK ? 0 : -1;
+}
+
+static const struct codec_ops snappy_codec_ops = {
+    .id = CODEC_SNAPPY,
+    .name = CODEC_SNAPPY_OPT,
+    .max_compressed_length = snappy_codec_max_compressed_length,
+    .compress = snappy_codec_compress,
+    .uncompressed_length = snappy_codec_uncompressed_length,
+    .uncompress = snappy_codec_uncompress,
+};
+
+// ---------------------------------------------------
+// LZ4
+// ---------------------------------------------------
+#ifdef HAVE_LZ4
+
+// an LZ4 block does not know its size; like snappy, prefix it as a varint
+#define VARINT_MAX_LEN 5
+
+static size_t put_varint(char *p, size_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+static size_t get_varint(const char *p, size_t len, size_t *v) {
+  size_t n, shift = 0;
+  *v = 0;
+  for (n = 0; n < len && n < VARINT_MAX_LEN; n++, shift += 7) {
+    *v |= (size_t)(p[n] & 0x7f) << shift;
+    if (!(p[n] & 0x80))
+      return n + 1;
+  }
+  return 0;
+}
+
+static size_t lz4_codec_max_compressed_length(size_t len) {
+  return VARINT_MAX_LEN + LZ4_COMPRESSBOUND(len);
+}
+
+static int lz4_codec_compress(struct codec *codec, const char *in, size_t len,
+                              char *out, size_t *outlen) {
+  if (*outlen < VARINT_MAX_LEN || len > LZ4_MAX_INPUT_SIZE)
+    return -1;
+  const size_t n = put_varint(out, len);
+  const size_t cap = *outlen - n;
+  const int r = LZ4_compress_fast(in, &out[n], len,
+                                  cap > INT_MAX ? INT_MAX : (int)cap,
+                                  codec->level);
+  if (r <= 0)
+    return -1;
+  *outlen = n + r;
+  return 0;
+}
+
+static int lz4_codec_uncompressed_length(struct codec *codec, const char *in,
+                                         size_t len, size_t *result) {
+  (void)codec;
+  return get_varint(in, len, result) > 0 ? 0 : -1;
+}
+
+static int lz4_codec_uncompress(struct codec *codec, const char *in,
+                                size_t len, char *out, size_t *outlen) {
+  size_t size;
+  const size_t n = get_varint(in, len, &size);
+  (void)codec;
+  if (n == 0 || size > *outlen || size > INT_MAX)
+    return -1;
+  const int r = LZ4_decompress_safe(&in[n], out, len - n, size);
+  if (r < 0 || (size_t)r != size)
+    return -1;
+  *outlen = size;
+  return 0;
+}
+
+// the level is LZ4's acceleration: higher is faster and compresses less
+static const struct codec_ops lz4_codec_ops = {
+    .id = CODEC_LZ4,
+    .name = CODEC_LZ4_OPT,
+    .level_min = 1,
+    .level_max = 65537,
+    .level_def = 1,
+    .max_compressed_length = lz4_codec_max_compressed_length,
+    .compress = lz4_codec_compress,
+    .uncompressed_length = lz4_codec_uncompressed_length,
+    .uncompress = lz4_codec_uncompress,
+};
+#endif
+
+// ---------------------------------------------------
+// zstd
+// ---------------------------------------------------
+#ifdef HAVE_ZSTD
+static int zstd_codec_init(struct codec *codec) {
+  codec->cctx = ZSTD_createCCtx();
+  codec->dctx = ZSTD_createDCtx();
+  if (codec->cctx == NULL || codec->dctx == NULL) {
+    fprintf(stderr, "Fatal: Cannot create zstd context\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void zstd_codec_free(struct codec *codec) {
+  ZSTD_freeCDict(codec->cdict);
+  ZSTD_freeDDict(codec->ddict);
+  ZSTD_freeCCtx(codec->cctx);
+  ZSTD_freeDCtx(codec->dctx);
+}
+
+static size_t zstd_codec_max_compressed_length(size_t len) {
+  return ZSTD_compressBound(len);
+}
+
+static int zstd_codec_compress(struct codec *codec, const char *in, size_t len,
+                               char *out, size_t *outlen) {
+  const size_t r =
+      codec->cdict != NULL
+          ? ZSTD_compress_usingCDict(codec->cctx, out, *outlen, in, len,
+                                     codec->cdict)
+          : ZSTD_compressCCtx(codec->cctx, out, *outlen, in, len,
+                              codec->level);
+  if (ZSTD_isError(r))
+    return -1;
+  *outlen = r;
+  return 0;
+}
+
+static int zstd_codec_uncompressed_length(struct codec *codec, const char *in,
+                                          size_t len, size_t *result) {
+  const unsigned long long size = ZSTD_getFrameContentSize(in, len);
+  (void)codec;
+  if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR ||
+      size > (size_t)-1)
+    return -1;
+  *result = size;
+  return 0;
+}
+
+static int zstd_codec_uncompress(struct codec *codec, const char *in,
+                                 size_t len, char *out, size_t *outlen) {
+  const size_t r =
+      codec->ddict != NULL
+          ? ZSTD_decompress_usingDDict(codec->dctx, out, *outlen, in, len,
+                                       codec->ddict)
+          : ZSTD_decompressDCtx(codec->dctx, out, *outlen, in, len);
+  if (ZSTD_isError(r))
+    return -1;
+  *outlen = r;
+  return 0;
+}
+
+// the digested dictionaries are built once per context, which saves
+// loading the dictionary for every packet
+static int zstd_codec_set_dictionary(struct codec *codec, const void *dict,
+                                     size_t len) {
+  ZSTD_freeCDict(codec->cdict);
+  ZSTD_freeDDict(codec->ddict);
+  codec->cdict = ZSTD_createCDict(dict, len, codec->level);
+  codec->ddict = ZSTD_createDDict(dict, len);
+  if (codec->cdict == NULL || codec->ddict == NULL) {
+    fprintf(stderr, "Fatal: Cannot load zstd dictionary\n");
+    return -1;
+  }
+  return 0;
+}
+
+static unsigned zstd_codec_dictionary_id(const void *dict, size_t len) {
+  return ZSTD_getDictID_fromDict(dict, len);
+}
+
+static unsigned zstd_codec_frame_dictionary_id(const char *in, size_t len) {
+  return ZSTD_getDictID_fromFrame(in, len);
+}
+
+static int zstd_codec_train_dictionary(void *dict, size_t capacity,
+                                       const void *samples,
+                                       const size_t *sizes, unsigned nsamples,
+                                       size_t *dictlen) {
+  const size_t r =
+      ZDICT_trainFromBuffer(dict, capacity, samples, sizes, nsamples);
+  if (ZDICT_isError(r)) {
+    fprintf(stderr, "Cannot train dictionary: %s\n", ZDICT_getErrorName(r));
+    return -1;
+  }
+  *dictlen = r;
+  return 0;
+}
+
+static const struct codec_ops zstd_codec_ops = {
+    .id = CODEC_ZSTD,
+    .name = CODEC_ZSTD_OPT,
+    .level_min = 1,
+    .level_max = 22,
+    .level_def = 3,
+    .init = zstd_codec_init,
+    .free = zstd_codec_free,
+    .max_compressed_length = zstd_codec_max_compressed_length,
+    .compress = zstd_codec_compress,
+    .uncompressed_length = zstd_codec_uncompressed_length,
+    .uncompress = zstd_codec_uncompress,
+    .set_dictionary = zstd_codec_set_dictionary,
+    .dictionary_id = zstd_codec_dictionary_id,
+    .frame_dictionary_id = zstd_codec_frame_dictionary_id,
+    .train_dictionary = zstd_codec_train_dictionary,
+};
+#endif
+
+// ---------------------------------------------------
+// Codec table
+// ---------------------------------------------------
+static const struct codec_ops *const codecs[] = {
+    &snappy_codec_ops,
+#ifdef HAVE_LZ4
+    &lz4_codec_ops,
+#endif
+#ifdef HAVE_ZSTD
+    &zstd_codec_ops,
+#endif
+};
+
+const struct codec_ops *codec_lookup(enum codec_id id) {
+  size_t i;
+  for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+    if (codecs[i]->id == id)
+      return codecs[i];
+  }
+  return NULL;
+}
+
+int codec_parse(const char *arg, enum codec_id *id, int *level) {
+  const char *sep = strchr(arg, ':');
+  const size_t namelen = sep != NULL ? (size_t)(sep - arg) : strlen(arg);
+  const struct codec_ops *ops = NULL;
+  size_t i;
+
+  for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+    if (strlen(codecs[i]->name) == namelen &&
+        strncmp(codecs[i]->name, arg, namelen) == 0) {
+      ops = codecs[i];
+      break;
+    }
+  }
+  if (ops == NULL) {
+    if ((namelen == strlen(CODEC_LZ4_OPT) &&
+         strncmp(arg, CODEC_LZ4_OPT, namelen) == 0) ||
+        (namelen == strlen(CODEC_ZSTD_OPT) &&
+         strncmp(arg, CODEC_ZSTD_OPT, namelen) == 0)) {
+      fprintf(stderr, "Codec \"%.*s\" is not supported by this build\n",
+              (int)namelen, arg);
+    } else {
+      fprintf(stderr, "Invalid codec \"%.*s\"\n", (int)namelen, arg);
+    }
+    return -1;
+  }
+
+  *id = ops->id;
+  *level = ops->level_def;
+  if (sep == NULL)
+    return 0;
+
+  char *p;
+  const long l = strtol(sep + 1, &p, 0);
+  if (ops->level_def == 0 || p == sep + 1 || *p != '\0' ||
+      l < ops->level_min || l > ops->level_max) {
+    fprintf(stderr, "Invalid level for codec \"%s\"\n", ops->name);
+    return -1;
+  }
+  *level = l;
+  return 0;
+}
+
+int codec_init(struct codec *codec, enum codec_id id, int level) {
+  memset(codec, 0, sizeof(*codec));
+  codec->ops = codec_lookup(id);
+  if (codec->ops == NULL) {
+    fprintf(stderr, "Fatal: Codec %d is not supported by this build\n", id);
+    return -1;
+  }
+  codec->level = level ?: codec->ops->level_def;
+  if (codec->ops->init != NULL && codec->ops->init(codec) == -1) {
+    codec_free(codec);
+    return -1;
+  }
+  return 0;
+}
+
+void codec_free(struct codec *codec) {
+  if (codec->ops != NULL && codec->ops->free != NULL) {
+    codec->ops->free(codec);
+  }
+  memset(codec, 0, sizeof(*codec));
+}
+
+int codec_set_dictionary(struct codec *codec, const void *dict, size_t len) {
+  if (codec->ops->set_dictionary == NULL) {
+    fprintf(stderr, "Fatal: Codec %s does not support dictionaries\n",
+            codec->ops->name);
+    return -1;
+  }
+  return codec->ops->set_dictionary(codec, dict, len);
+}
+
+unsigned codec_dictionary_id(enum codec_id id, const void *dict, size_t len) {
+  const struct codec_ops *ops = codec_lookup(id);
+  if (ops == NULL || ops->dictionary_id == NULL) {
+    fprintf(stderr, "Codec %d does not support dictionaries\n", id);
+    return 0;
+  }
+  const unsigned dict_id = ops->dictionary_id(dict, len);
+  if (dict_id == 0) {
+    fprintf(stderr, "Not a %s dictionary\n", ops->name);
+  }
+  return dict_id;
+}
+
+int codec_train_dictionary(enum codec_id id, void *dict, size_t capacity,
+                           const void *samples, const size_t *sizes,
+                           unsigned nsamples, size_t *dictlen) {
+  const struct codec_ops *ops = codec_lookup(id);
+  if (ops == NULL || ops->train_dictionary == NULL) {
+    fprintf(stderr, "Codec %d does not support dictionaries\n", id);
+    return -1;
+  }
+  return ops->train_dictionary(dict, capacity, samples, sizes, nsamples,
+                               dictlen);
+}
@@ -0,0 +1,112 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stddef.h>
+
+// codec ids are carried in the transfer information, keep them stable
+enum codec_id {
+  CODEC_UNSPEC = 0,
+  CODEC_SNAPPY = 1,
+  CODEC_LZ4 = 2,
+  CODEC_ZSTD = 3,
+  CODEC_DEFAULT = CODEC_SNAPPY,
+};
+
+#define CODEC_SNAPPY_OPT "snappy"
+#define CODEC_LZ4_OPT "lz4"
+#define CODEC_ZSTD_OPT "zstd"
+#define CODEC_DEFAULT_OPT CODEC_SNAPPY_OPT
+
+struct codec;
+
+/*
+ * One compression library. All sizes are in and out parameters the way
+ * snappy-c has them: *outlen is the capacity of out on entry and the
+ * produced size on return. Functions return 0 on success and -1 if the
+ * input is invalid or the output does not fit.
+ */
+struct codec_ops {
+  enum codec_id id;
+  const char *name;
+
+  // level range, and the level used if none is given (0: no levels)
+  int level_min;
+  int level_max;
+  int level_def;
+
+  int (*init)(struct codec *codec);
+  void (*free)(struct codec *codec);
+  size_t (*max_compressed_length)(size_t len);
+  int (*compress)(struct codec *codec, const char *in, size_t len, char *out,
+                  size_t *outlen);
+  int (*uncompressed_length)(struct codec *codec, const char *in, size_t len,
+                             size_t *result);
+  int (*uncompress)(struct codec *codec, const char *in, size_t len,
+                    char *out, size_t *outlen);
+
+  // optional: preset dictionary, its id (0 if invalid), the id a
+  // compressed frame was made with (0 for none) and training
+  int (*set_dictionary)(struct codec *codec, const void *dict, size_t len);
+  unsigned (*dictionary_id)(const void *dict, size_t len);
+  unsigned (*frame_dictionary_id)(const char *in, size_t len);
+  int (*train_dictionary)(void *dict, size_t capacity, const void *samples,
+                          const size_t *sizes, unsigned nsamples,
+                          size_t *dictlen);
+};
+
+// per forward context state, the library contexts are not thread safe
+struct codec {
+  const struct codec_ops *ops;
+  int level;
+  void *cctx;
+  void *dctx;
+  void *cdict;
+  void *ddict;
+};
+
+// ops of a codec built into this binary, or NULL
+const struct codec_ops *codec_lookup(enum codec_id id);
+
+// parse "<name>[:<level>]"; prints the reason and returns -1 if invalid
+int codec_parse(const char *arg, enum codec_id *id, int *level);
+
+int codec_init(struct codec *codec, enum codec_id id, int level);
+void codec_free(struct codec *codec);
+
+// dictionary support of a codec; these print the reason and return -1 or
+// 0 (for the id) if the codec has none or the dictionary is invalid
+int codec_set_dictionary(struct codec *codec, const void *dict, size_t len);
+unsigned codec_dictionary_id(enum codec_id id, const void *dict, size_t len);
+int codec_train_dictionary(enum codec_id id, void *dict, size_t capacity,
+                           const void *samples, const size_t *sizes,
+                           unsigned nsamples, size_t *dictlen);
+
+static inline size_t codec_max_compressed_length(const struct codec *codec,
+                                                 size_t len) {
+  return codec->ops->max_compressed_length(len);
+}
+
+static inline int codec_compress(struct codec *codec, const char *in,
+                                 size_t len, char *out, size_t *outlen) {
+  return codec->ops->compress(codec, in, len, out, outlen);
+}
+
+static inline int codec_uncompressed_length(struct codec *codec,
+                                            const char *in, size_t len,
+                                            size_t *result) {
+  return codec->ops->uncompressed_length(codec, in, len, result);
+}
+
+static inline unsigned codec_frame_dictionary_id(const struct codec *codec,
+                                                 const char *in, size_t len) {
+  return codec->ops->frame_dictionary_id != NULL
+             ? codec->ops->frame_dictionary_id(in, len)
+             : 0;
+}
+
+static inline int codec_uncompress(struct codec *codec, const char *in,
+                                   size_t len, char *out, size_t *outlen) {
+  return codec->ops->uncompress(codec, in, len, out, outlen);
+}
+
+#endif
@@ -0,0 +1,113 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fdb.h"
+
+int fdb_init(struct fdb *fdb, size_t size, uint64_t aging) {
+  size_t n = 16;
+
+  while (n < size)
+    n *= 2;
+
+  memset(fdb, 0, sizeof(*fdb));
+  fdb->entries = calloc(n, sizeof(*fdb->entries));
+  if (fdb->entries == NULL) {
+    perror("calloc");
+    return -1;
+  }
+  fdb->mask = n - 1;
+  fdb->aging = aging;
+  return 0;
+}
+
+void fdb_free(struct fdb *fdb) {
+  free(fdb->entries);
+  memset(fdb, 0, sizeof(*fdb));
+}
+
+// empty slot i and move back the entries of its probe sequence behind it
+static void fdb_delete_at(struct fdb *fdb, size_t i) {
+  size_t j = i;
+
+  for (;;) {
+    fdb->entries[i].port = 0;
+    for (;;) {
+      j = (j + 1) & fdb->mask;
+      if (fdb->entries[j].port == 0)
+        return;
+      // an entry whose home slot lies cyclically in (i, j] stays
+      const size_t k = fdb_index(fdb, fdb->entries[j].mac);
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+        continue;
+      break;
+    }
+    fdb->entries[i] = fdb->entries[j];
+    i = j;
+  }
+}
+
+// delete the entries of port, or the aged out ones if port is 0
+static void fdb_delete(struct fdb *fdb, uint32_t port, uint64_t now) {
+  size_t i = 0;
+
+  // an entry moved back into slot i is checked again
+  while (i <= fdb->mask) {
+    const struct fdb_entry *e = &fdb->entries[i];
+    if (e->port != 0 &&
+        (port != 0 ? e->port == port : !fdb_live(fdb, e, now))) {
+      fdb_delete_at(fdb, i);
+      fdb->used--;
+    } else {
+      i++;
+    }
+  }
+}
+
+int fdb_learn(struct fdb *fdb, const uint8_t *mac, uint32_t port,
+              uint64_t now) {
+  struct fdb_entry *stale = NULL;
+  size_t i;
+  int retry;
+
+  for (retry = 0; retry < 2; retry++) {
+    for (i = fdb_index(fdb, mac); fdb->entries[i].port != 0;
+         i = (i + 1) & fdb->mask) {
+      struct fdb_entry *e = &fdb->entries[i];
+      if (memcmp(e->mac, mac, FDB_MAC_LEN) == 0) {
+        // also moves an address that shows up behind another port
+        e->port = port;
+        e->seen = now;
+        return 0;
+      }
+      if (stale == NULL && !fdb_live(fdb, e, now))
+        stale = e;
+    }
+
+    if (stale != NULL) {
+      memcpy(stale->mac, mac, FDB_MAC_LEN);
+      stale->port = port;
+      stale->seen = now;
+      return 0;
+    }
+
+    // keep a quarter of the slots empty to bound the probe sequences
+    if (fdb->used < (fdb->mask + 1) / 4 * 3) {
+      struct fdb_entry *e = &fdb->entries[i];
+      memcpy(e->mac, mac, FDB_MAC_LEN);
+      e->port = port;
+      e->seen = now;
+      fdb->used++;
+      return 0;
+    }
+
+    fdb_delete(fdb, 0, now);
+  }
+  return -1;
+}
+
+void fdb_remove(struct fdb *fdb, uint32_t port) { fdb_delete(fdb, port, 0); }
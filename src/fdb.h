@@ -0,0 +1,75 @@
+#ifndef __FDB_H__
+#define __FDB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Forwarding database of a learning switch: MAC address to a non-zero port
+ * (the hub's client id, or its interface).
+ *
+ * Open addressing with linear probing in a power of two table. An entry
+ * not refreshed for the aging time counts as absent and its slot is reused
+ * by the next address probing over it; deletion shifts the following
+ * entries back, so there are no tombstones and lookups stop at the first
+ * empty slot.
+ */
+
+#define FDB_MAC_LEN 6
+
+struct fdb_entry {
+  uint8_t mac[FDB_MAC_LEN];
+  // 0: empty slot
+  uint32_t port;
+  // time of the last frame from the address, in milliseconds
+  uint64_t seen;
+};
+
+struct fdb {
+  struct fdb_entry *entries;
+  size_t mask;
+  size_t used;
+  uint64_t aging;
+};
+
+// size is rounded up to a power of two, aging is in milliseconds; returns
+// 0 or -1 if out of memory
+int fdb_init(struct fdb *fdb, size_t size, uint64_t aging);
+void fdb_free(struct fdb *fdb);
+
+// map a source address to port; returns 0, or -1 if the table is full of
+// live entries and the address is not learned
+int fdb_learn(struct fdb *fdb, const uint8_t *mac, uint32_t port,
+              uint64_t now);
+
+// forget all addresses of port
+void fdb_remove(struct fdb *fdb, uint32_t port);
+
+static inline size_t fdb_index(const struct fdb *fdb, const uint8_t *mac) {
+  uint64_t h = 0;
+  memcpy(&h, mac, FDB_MAC_LEN);
+  h *= 0x9e3779b97f4a7c15ULL;
+  return (h >> 32) & fdb->mask;
+}
+
+static inline int fdb_live(const struct fdb *fdb, const struct fdb_entry *e,
+                           uint64_t now) {
+  return now - e->seen < fdb->aging;
+}
+
+// port of a destination address, or 0 if unknown or aged out
+static inline uint32_t fdb_lookup(const struct fdb *fdb, const uint8_t *mac,
+                                  uint64_t now) {
+  size_t i;
+
+  for (i = fdb_index(fdb, mac); fdb->entries[i].port != 0;
+       i = (i + 1) & fdb->mask) {
+    const struct fdb_entry *e = &fdb->entries[i];
+    if (memcmp(e->mac, mac, FDB_MAC_LEN) == 0)
+      return fdb_live(fdb, e, now) ? e->port : 0;
+  }
+  return 0;
+}
+
+#endif
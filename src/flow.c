@@ -0,0 +1,253 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "flow.h"
+
+#ifndef ETHERTYPE_8021AD
+#define ETHERTYPE_8021AD 0x88a8
+#endif
+
+static uint16_t get16(const unsigned char *p) { return (p[0] << 8) | p[1]; }
+
+static uint32_t mix(uint32_t h, uint32_t k) {
+  k *= 0xcc9e2d51;
+  k = (k << 15) | (k >> 17);
+  k *= 0x1b873593;
+  h ^= k;
+  h = (h << 13) | (h >> 19);
+  return h * 5 + 0xe6546b64;
+}
+
+static uint32_t mix_bytes(uint32_t h, const unsigned char *p, size_t len) {
+  size_t i;
+  for (i = 0; i + 4 <= len; i += 4) {
+    h = mix(h, (uint32_t)p[i] << 24 | p[i + 1] << 16 | p[i + 2] << 8 |
+                   p[i + 3]);
+  }
+  return h;
+}
+
+static uint32_t finish(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  // 0 is reserved for "no flow"
+  return h ?: 1;
+}
+
+static int is_port_protocol(int proto) {
+  return proto == IPPROTO_TCP || proto == IPPROTO_UDP ||
+         proto == IPPROTO_UDPLITE || proto == IPPROTO_SCTP ||
+         proto == IPPROTO_DCCP;
+}
+
+// the IP header of a packet, behind the Ethernet header in L2 mode, or
+// NULL if there is none
+static const unsigned char *ip_header(enum ifmode ifmode, const char *pkt,
+                                      size_t *len) {
+  const unsigned char *p = (const unsigned char *)pkt;
+
+  if (ifmode == IFMODE_L2) {
+    size_t off = 2 * ETHER_ADDR_LEN;
+    uint16_t type;
+
+    // skip (stacked) VLAN tags
+    while (1) {
+      if (*len < off + 2)
+        return NULL;
+      type = get16(&p[off]);
+      off += 2;
+      if (type != ETHERTYPE_VLAN && type != ETHERTYPE_8021AD)
+        break;
+      off += 2;
+    }
+    if (type != ETHERTYPE_IP && type != ETHERTYPE_IPV6)
+      return NULL;
+    p += off;
+    *len -= off;
+  }
+
+  return *len >= 1 ? p : NULL;
+}
+
+uint32_t flow_hash(enum ifmode ifmode, const char *pkt, size_t len) {
+  const unsigned char *p = ip_header(ifmode, pkt, &len);
+  uint32_t h = 0;
+  int proto;
+
+  if (p == NULL)
+    return 0;
+
+  switch (p[0] >> 4) {
+  case 4: {
+    const size_t ihl = (p[0] & 0x0f) * 4;
+    if (ihl < 20 || len < ihl)
+      return 0;
+    proto = p[9];
+    h = mix_bytes(mix(h, proto), &p[12], 8);
+
+    // only the first fragment carries the ports
+    if ((get16(&p[6]) & 0x1fff) != 0)
+      return finish(h);
+    p += ihl;
+    len -= ihl;
+    break;
+  }
+  case 6: {
+    if (len < 40)
+      return 0;
+    proto = p[6];
+    h = mix_bytes(mix(h, proto), &p[8], 32);
+    p += 40;
+    len -= 40;
+
+    // walk the extension headers that may precede the transport header
+    while (proto == IPPROTO_HOPOPTS || proto == IPPROTO_ROUTING ||
+           proto == IPPROTO_DSTOPTS || proto == IPPROTO_FRAGMENT) {
+      size_t extlen;
+      if (len < 8)
+        return finish(h);
+      if (proto == IPPROTO_FRAGMENT) {
+        if ((get16(&p[2]) & 0xfff8) != 0)
+          return finish(h);
+        extlen = 8;
+      } else {
+        extlen = (p[1] + 1) * 8;
+      }
+      if (len < extlen)
+        return finish(h);
+      proto = p[0];
+      p += extlen;
+      len -= extlen;
+    }
+    h = mix(h, proto);
+    break;
+  }
+  default:
+    return 0;
+  }
+
+  if (is_port_protocol(proto) && len >= 4) {
+    h = mix_bytes(h, p, 4);
+  }
+
+  return finish(h);
+}
+
+enum flow_class flow_classify(enum ifmode ifmode, const char *pkt,
+                              size_t len) {
+  const unsigned char *p = ip_header(ifmode, pkt, &len);
+  size_t hlen, plen;
+  int dscp, proto;
+
+  // ARP and other link control traffic is small
+  if (p == NULL)
+    return len <= FLOW_CLASS_SMALL_SIZE ? FLOW_CLASS_INTERACTIVE
+                                        : FLOW_CLASS_DEFAULT;
+
+  switch (p[0] >> 4) {
+  case 4:
+    hlen = (p[0] & 0x0f) * 4;
+    if (hlen < 20 || len < hlen)
+      return FLOW_CLASS_DEFAULT;
+    dscp = p[1] >> 2;
+    proto = p[9];
+    plen = get16(&p[2]);
+    // only the first fragment has the TCP header
+    if ((get16(&p[6]) & 0x1fff) != 0)
+      proto = -1;
+    break;
+  case 6:
+    // extension headers are not walked, such packets are classified by
+    // DSCP and size only
+    hlen = 40;
+    if (len < hlen)
+      return FLOW_CLASS_DEFAULT;
+    dscp = (get16(p) >> 6) & 0x3f;
+    proto = p[6];
+    plen = hlen + get16(&p[4]);
+    break;
+  default:
+    return FLOW_CLASS_DEFAULT;
+  }
+
+  // CS5 and above: voice, video, network control
+  if (dscp >= 40)
+    return FLOW_CLASS_INTERACTIVE;
+  // CS1 and lower effort
+  if (dscp == 8 || dscp == 1)
+    return FLOW_CLASS_BULK;
+
+  if (plen > len)
+    plen = len;
+
+  if (proto == IPPROTO_TCP) {
+    if (plen < hlen + 20)
+      return FLOW_CLASS_DEFAULT;
+    const unsigned char *th = &p[hlen];
+    const size_t doff = (th[12] >> 4) * 4;
+    const int flags = th[13];
+    // an ACK or SYN without payload, no FIN or RST
+    if ((flags & 0x05) == 0 && plen <= hlen + doff)
+      return FLOW_CLASS_INTERACTIVE;
+    return FLOW_CLASS_DEFAULT;
+  }
+  // a TCP header behind IPv6 extension headers is not seen
+  if (proto == IPPROTO_HOPOPTS || proto == IPPROTO_ROUTING ||
+      proto == IPPROTO_DSTOPTS || proto == IPPROTO_FRAGMENT)
+    return FLOW_CLASS_DEFAULT;
+
+  if (plen <= FLOW_CLASS_SMALL_SIZE)
+    return FLOW_CLASS_INTERACTIVE;
+
+  return FLOW_CLASS_DEFAULT;
+}
+
+int flow_set_ce(enum ifmode ifmode, char *pkt, size_t len) {
+  unsigned char *p = (unsigned char *)ip_header(ifmode, pkt, &len);
+
+  if (p == NULL)
+    return 0;
+
+  switch (p[0] >> 4) {
+  case 4: {
+    if (len < 20 || (p[1] & 0x03) == 0)
+      return 0;
+    // incremental checksum update (RFC 1624) for the changed ECN bits
+    const uint16_t old = get16(p);
+    const uint16_t new = old | 0x03;
+    uint32_t sum = (uint16_t)~get16(&p[10]) + (uint16_t)~old + new;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    p[1] |= 0x03;
+    p[10] = ~sum >> 8;
+    p[11] = ~sum;
+    return 1;
+  }
+  case 6:
+    if (len < 40 || (p[1] & 0x30) == 0)
+      return 0;
+    p[1] |= 0x30;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+struct flow_cache_entry *flow_cache_new(void) {
+  struct flow_cache_entry *cache = calloc(FLOW_CACHE_SIZE, sizeof(*cache));
+  if (cache == NULL) {
+    perror("calloc");
+  }
+  return cache;
+}
+
+void flow_cache_free(struct flow_cache_entry *cache) { free(cache); }
@@ -0,0 +1,58 @@
+#ifndef __FLOW_H__
+#define __FLOW_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tuncat.h"
+
+// hash of the 5-tuple (addresses, protocol and ports) of a packet read from
+// the interface, Ethernet framed in L2 mode; 0 if it carries no IP header
+uint32_t flow_hash(enum ifmode ifmode, const char *pkt, size_t len);
+
+// packets up to this size (from the IP header) are interactive
+#define FLOW_CLASS_SMALL_SIZE 128
+
+// class of a packet read from the interface: by DSCP first (CS5 and above
+// interactive, CS1 and LE bulk), then TCP ACKs and SYNs without payload,
+// and small packets of other protocols are interactive. TCP segments that
+// carry sequence space (data, FIN) or end the flow (RST) stay with the
+// flow's data, so they cannot overtake it.
+enum flow_class flow_classify(enum ifmode ifmode, const char *pkt,
+                              size_t len);
+
+// mark a packet read from the interface Congestion Experienced if it is
+// ECN capable (the IPv4 header checksum is updated); returns 1 if marked
+int flow_set_ce(enum ifmode ifmode, char *pkt, size_t len);
+
+#define FLOW_CACHE_SIZE 4096
+
+/*
+ * Direct mapped table of flows, indexed by the low bits of the flow hash.
+ * A slot holds the full hash of the last flow stored in it and a deadline
+ * in milliseconds; colliding flows simply evict each other.
+ */
+struct flow_cache_entry {
+  uint32_t hash;
+  uint64_t until;
+};
+
+struct flow_cache_entry *flow_cache_new(void);
+void flow_cache_free(struct flow_cache_entry *cache);
+
+static inline int flow_cache_hit(const struct flow_cache_entry *cache,
+                                 uint32_t hash, uint64_t now) {
+  const struct flow_cache_entry *e = &cache[hash & (FLOW_CACHE_SIZE - 1)];
+  return hash != 0 && e->hash == hash && now < e->until;
+}
+
+static inline void flow_cache_set(struct flow_cache_entry *cache,
+                                  uint32_t hash, uint64_t until) {
+  struct flow_cache_entry *e = &cache[hash & (FLOW_CACHE_SIZE - 1)];
+  if (hash != 0) {
+    e->hash = hash;
+    e->until = until;
+  }
+}
+
+#endif
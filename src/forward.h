@@ -0,0 +1,261 @@
+#ifndef __FORWARD_H__
+#define __FORWARD_H__
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "aqm.h"
+#include "codec.h"
+#include "flow.h"
+#include "ringbuf.h"
+#include "route.h"
+#include "tuncat.h"
+
+/*
+ * The forward context moves frames between the interface and one
+ * transfer connection. tuncat.c has the framing, the I/O steps and the
+ * event loops; the hub (hub.c) drives the same steps for its clients.
+ */
+
+static inline size_t read_packet_size(const char *buf) {
+  return ntohs(*(uint16_t *)buf);
+}
+
+static inline void write_packet_size(char *buf, size_t size) {
+  assert(size <= 65535);
+  *(uint16_t *)buf = htons(size);
+}
+
+static inline uint64_t now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t now_msec(void) { return now_usec() / 1000; }
+
+// token bucket: rate in bytes per second, tokens in bytes times
+// microseconds, and when the bucket will have a quantum again (0: it has)
+struct pacer {
+  uint64_t rate;
+  int64_t burst;
+  int64_t tokens;
+  uint64_t fill_time;
+  uint64_t last;
+  uint64_t deadline;
+};
+
+struct forward_ctx {
+  struct tuncat_commandline_options *optsp;
+  enum compflag compflag;
+  size_t max_frame_size;
+
+  // each side compresses with its own codec and announces it
+  struct codec tx_codec;
+  struct codec rx_codec;
+
+  // length prefix plus the virtio header in offload mode; on the wire
+  // the flags byte of adaptive compression sits in between
+  size_t vnet_hdr_len;
+  size_t frame_hdr_size;
+  size_t frame_flags_len;
+  size_t tr_frame_hdr_size;
+
+  // adaptive compression: flows that did not compress recently, or NULL
+  struct flow_cache_entry *incompressible;
+
+  // hub server: routes announced by or learned from this client go to the
+  // shared table under route_id; learned routes are refreshed from the
+  // traffic of the client once routes_refresh passes
+  struct route_table *routes;
+  uint32_t route_id;
+  int routes_announced;
+  int routes_learned;
+  uint64_t routes_refresh;
+
+  // batch mode: block size (0: disabled), arrival of the oldest waiting
+  // frame and when the pending block has to be flushed (0: none)
+  size_t batch_size;
+  uint64_t batch_since;
+  uint64_t batch_deadline;
+
+  // priority mode: each class waits in a queue of its own, the default
+  // class in the interface read buffer; the queues are served into the
+  // transfer send buffer only as it drains
+  enum priomode prio;
+  struct ringbuf prio_bufs[FLOW_CLASSES];
+  struct ringbuf *prio_queue[FLOW_CLASSES];
+  long prio_deficit[FLOW_CLASSES];
+  int prio_next;
+  struct {
+    unsigned long packets;
+    unsigned long bytes;
+    unsigned long drops;
+  } prio_stats[FLOW_CLASSES];
+
+  // AQM mode: packets wait in CoDel managed queues instead of the
+  // interface read buffer; the pending packet did not fit into the
+  // transfer send buffer yet
+  enum aqmmode aqm;
+  struct aqm aqm_queue;
+  struct aqm_packet *aqm_pending;
+  unsigned stats_seen;
+
+  // userspace pacer of the transfer writes, NULL if off or TCP paces;
+  // striped streams share the hub's
+  struct pacer pacer;
+  struct pacer *pace;
+
+  // what the peer announced in its transfer information
+  struct {
+    int received;
+    int checked;
+    size_t vnet_hdr_len;
+    enum codec_id codec;
+    size_t batch_size;
+    unsigned dict_id;
+    int streams;
+    uint64_t session;
+  } peer;
+
+  int if_read_fd;
+  int if_write_fd;
+  int tr_ifd;
+  int tr_ofd;
+
+  struct ringbuf if_read_buf;
+  struct ringbuf if_write_buf;
+  struct ringbuf tr_recv_buf;
+  struct ringbuf tr_send_buf;
+
+  // pass-through: nothing is encoded, so the frames go out straight from
+  // the interface read buffer and in from the transfer receive buffer; the
+  // transfer send buffer only carries the transfer information. pass_left
+  // is what a short write left of the frame at the read buffer's head,
+  // pass_off how far the frames went out while still held (zero copy).
+  int passthrough;
+  size_t pass_left;
+  size_t pass_off;
+
+  // zero copy sends: the pages of a send with MSG_ZEROCOPY stay the
+  // kernel's until it reports the send done on the error queue, which for
+  // TCP is once the peer acknowledged it. zc_off bytes at the head of the
+  // transfer send buffer, and pass_off at the interface read buffer's, are
+  // sent but not released yet; zc_sends says in order which sends they are
+  // (copied ones are done right away, but released in turn).
+  size_t zerocopy;
+  int zc_copied;
+  size_t zc_off;
+  uint32_t zc_next;
+  struct zc_send {
+    uint32_t id;
+    int zerocopy;
+    int done;
+    size_t info;
+    size_t frames;
+  } zc_sends[ZEROCOPY_SENDS_MAX];
+  unsigned zc_head;
+  unsigned zc_tail;
+
+  // a corked transfer socket holds partial segments back; the cork is
+  // pulled once a batch of writes is done and cork_pending says there are
+  int cork;
+  int cork_pending;
+
+  // adaptive transfer buffers: when TCP_INFO is sampled next, and the
+  // bounds of the buffer sizes
+  int autosize;
+  uint64_t autosize_next;
+  size_t autosize_min;
+  size_t autosize_max;
+
+  // datagram transport: one frame per datagram, UDP_BATCH_SIZE receive
+  // slots; frames too large for a datagram are dropped and counted
+  int datagram;
+  char *dgram_buf;
+  size_t dgram_slot_size;
+  unsigned long dgram_oversize;
+
+  // UDP GSO: largest frame that may be a segment (0: disabled), and GRO
+  size_t udp_gso_size_max;
+  int udp_gro;
+};
+
+enum fwio {
+  FWIO_OK = 0,
+  FWIO_AGAIN = 1,
+  FWIO_EOF = 2,
+  FWIO_ERROR = -1,
+};
+
+static inline int is_temporary_error(int err) {
+  return err == EAGAIN || err == EINTR || err == EWOULDBLOCK ||
+         err == EINPROGRESS;
+}
+
+// readiness bits, latched from edge-triggered epoll events
+#define FWREADY_TR_IN 0x01
+#define FWREADY_TR_OUT 0x02
+#define FWREADY_IF_IN 0x04
+#define FWREADY_IF_OUT 0x08
+
+extern volatile sig_atomic_t stats_requests;
+
+// set up a forward context between the interface and a transport; a hub
+// passes -1 for the transport of the context that only reads the interface
+int forward_init(struct forward_ctx *fw,
+                 struct tuncat_commandline_options *optsp, int tunfd,
+                 int tr_ifd, int tr_ofd);
+void forward_free(struct forward_ctx *fw);
+void forward_stats(struct forward_ctx *fw, const char *name);
+void put_trinfo(struct forward_ctx *fw);
+
+// interface -> transfer: returns -1 on error, else whether anything moved
+int forward_packet_to_tr(struct forward_ctx *fw, const char *if_frame,
+                         uint64_t now);
+int forward_if_to_tr(struct forward_ctx *fw);
+int queue_pending(const struct forward_ctx *fw);
+int queue_enqueue(struct forward_ctx *fw, const char *frame);
+int forward_queue_to_tr(struct forward_ctx *fw);
+
+// transfer -> interface
+int forward_tr_to_if(struct forward_ctx *fw);
+
+int want_tr_read(const struct forward_ctx *fw);
+int want_tr_write(const struct forward_ctx *fw);
+int want_if_read(const struct forward_ctx *fw);
+int want_if_write(const struct forward_ctx *fw);
+
+void pace_init(struct pacer *pace, uint64_t rate, size_t burst);
+size_t pace_burst(const struct forward_ctx *fw, uint64_t rate);
+int pace_throttled(const struct pacer *pace);
+size_t pace_allowance(struct pacer *pace);
+void pace_charge(struct pacer *pace, size_t len);
+
+// the I/O steps of the loops
+enum fwio do_tr_read(struct forward_ctx *fw);
+enum fwio do_if_read(struct forward_ctx *fw);
+enum fwio do_if_write(struct forward_ctx *fw);
+void forward_uncork(struct forward_ctx *fw);
+uint64_t forward_deadline(const struct forward_ctx *fw);
+
+int epoll_add(int epfd, int fd, uint32_t events, uint32_t ready);
+int epoll_wait_until(int epfd, struct epoll_event *events, int maxevents,
+                     uint64_t deadline);
+enum fwio forward_drain(struct forward_ctx *fw, unsigned *ready, unsigned bit,
+                        int (*want)(const struct forward_ctx *),
+                        enum fwio (*io)(struct forward_ctx *));
+
+// hub.c: a hub, or with streams the end of a striped tunnel: listening on
+// sock (server), or serving the connected socks (client, sock is -1)
+int serve_hub(struct tuncat_commandline_options *optsp, int sock, int tunfd,
+              const int *socks);
+
+#endif
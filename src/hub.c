@@ -0,0 +1,1015 @@
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/ip.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fdb.h"
+#include "forward.h"
+#include "tls.h"
+
+/*
+ * One process and one interface queue for all clients. Packets read from
+ * the interface are steered to a client by a longest prefix match on the
+ * destination address; the prefixes come from the routes clients announce
+ * (-R), or else from the source addresses of the packets they send. Each
+ * client has a complete forward context of its own, so compression and
+ * batching work per client, and a slow client only drops its own packets.
+ *
+ * In L2 mode the hub is a learning switch instead: the interface and the
+ * clients are its ports, source addresses are learned per port, and frames
+ * between clients go from one client's context to the other's without
+ * passing the interface.
+ *
+ * Flooded frames are encoded for the transfer once, and the clients queue
+ * a reference to the shared copy, placed at the position of their send
+ * stream it was queued at; writev sends it from there.
+ *
+ * Striped streams (-s) run the same loop on both ends of one tunnel: the
+ * "clients" are the parallel connections to the peer, and packets are
+ * spread over them by the hash of their flow, so every flow stays in
+ * order on one connection. The tunnel goes down with any of them. The
+ * client sends a random session id on each stream, and the server groups
+ * the streams that carry the id of the first one; others are refused.
+ */
+struct hub_frame {
+  int refs;
+  size_t size;
+  char data[];
+};
+
+struct hub_fanout {
+  struct hub_frame *frame;
+  // tr_send_buf position the frame is sent at
+  size_t pos;
+};
+
+struct hub_client {
+  // first member, the transfer write gets back to the client from it
+  struct forward_ctx fw;
+  unsigned ready;
+  int queued;
+  // striped streams: counted in the set of the tunnel
+  int joined;
+
+  // shared frames, free running indexes, and the bytes of the first one
+  // that are already sent
+  struct hub_fanout fanout[HUB_FANOUT_MAX];
+  unsigned fanout_head;
+  unsigned fanout_tail;
+  size_t fanout_sent;
+};
+
+struct hub {
+  struct tuncat_commandline_options *optsp;
+  int sock;
+  int tunfd;
+  int epfd;
+
+  // reads the interface, only its if_read_buf is used
+  struct forward_ctx tun;
+  unsigned ready;
+
+  struct route_table routes;
+  // next check for expired learned routes
+  uint64_t route_sweep;
+  struct fdb fdb;
+
+  // a client's route value is its index + 1
+  struct hub_client **clients;
+  int nclients;
+
+  // clients with work left, run before waiting again; while the queue
+  // is run, those kept and those woken by it go to requeue, each at most
+  // once as queued tells
+  int *queue;
+  int nqueue;
+  int *requeue;
+  int nrequeue;
+  int running;
+
+  // striped streams: connections of the tunnel (0: hub), those that joined
+  // it, the session they belong to, and whether it ended by the peer
+  // closing one
+  int streams;
+  int nstreams;
+  uint64_t session;
+  int eof;
+
+  // striped streams: one pacer for the tunnel, as a flow sticks to one
+  // stream
+  struct pacer pacer;
+
+  // TLS handshakes of accepted connections, run by the loop until they
+  // complete or their time is up
+  struct hub_handshake {
+    int sock;
+    struct tls_handshake *tls;
+    uint64_t until;
+  } handshakes[HUB_HANDSHAKES_MAX];
+
+  // frames dropped for lack of a route, or as a client fell behind, and
+  // the last SIGUSR1 they were printed for
+  unsigned long no_route;
+  unsigned long overflow;
+  unsigned stats_seen;
+};
+
+// epoll data of the listening socket, the interface and the handshakes;
+// clients use their index shifted above the readiness bits
+#define HUB_EV_LISTEN 0xffffffffU
+#define HUB_EV_TUN 0xfffffffeU
+#define HUB_EV_HANDSHAKE 0xfff00000U
+#define HUB_EV_SHIFT 4
+
+// switch port of the interface, clients use their route id
+#define HUB_PORT_IF 0xffffffffU
+
+static void hub_frame_put(struct hub_frame *frame) {
+  if (--frame->refs == 0)
+    free(frame);
+}
+
+// encode a frame read from an interface buffer for the transfer, once for
+// all clients; the hub's own context does it, configured like theirs
+static struct hub_frame *hub_frame_encode(struct hub *hub, const char *frame) {
+  struct forward_ctx *fw = &hub->tun;
+  struct hub_frame *shared;
+
+  if (forward_packet_to_tr(fw, frame, fw->incompressible != NULL ? now_msec()
+                                                                 : 0) != 1) {
+    return NULL;
+  }
+  const size_t size = ringbuf_used(&fw->tr_send_buf);
+  shared = malloc(sizeof(*shared) + size);
+  if (shared != NULL) {
+    shared->refs = 1;
+    shared->size = size;
+    memcpy(shared->data, ringbuf_data(&fw->tr_send_buf), size);
+  }
+  ringbuf_consume(&fw->tr_send_buf, size);
+  return shared;
+}
+
+static int want_hub_tr_write(const struct forward_ctx *fw) {
+  const struct hub_client *c = (const struct hub_client *)fw;
+  if (pace_throttled(fw->pace))
+    return 0;
+  return want_tr_write(fw) || c->fanout_head != c->fanout_tail;
+}
+
+// the transfer write of a client: its send buffer up to the next shared
+// frame, the shared frame, and so on
+static enum fwio do_hub_tr_write(struct forward_ctx *fw) {
+  struct hub_client *c = (struct hub_client *)fw;
+  struct ringbuf *rb = &fw->tr_send_buf;
+
+  if (forward_queue_to_tr(fw) == -1) {
+    return FWIO_ERROR;
+  }
+
+  const char *data = ringbuf_data(rb);
+  struct iovec iov[HUB_IOV_MAX];
+  size_t pos = rb->head, skip = c->fanout_sent;
+  unsigned i = c->fanout_head;
+  int n = 0;
+
+  while (n < HUB_IOV_MAX - 1) {
+    const struct hub_fanout *f = &c->fanout[i % HUB_FANOUT_MAX];
+    const size_t until = i != c->fanout_tail ? f->pos : rb->tail;
+    if (until > pos) {
+      iov[n].iov_base = (char *)&data[pos - rb->head];
+      iov[n].iov_len = until - pos;
+      n++;
+      pos = until;
+    }
+    if (i == c->fanout_tail)
+      break;
+    iov[n].iov_base = &f->frame->data[skip];
+    iov[n].iov_len = f->frame->size - skip;
+    n++;
+    skip = 0;
+    i++;
+  }
+
+  if (fw->pace != NULL) {
+    size_t allowance = pace_allowance(fw->pace);
+    int k;
+    if (allowance == 0)
+      return FWIO_OK;
+    for (k = 0; k < n && allowance > 0; k++) {
+      if (iov[k].iov_len > allowance)
+        iov[k].iov_len = allowance;
+      allowance -= iov[k].iov_len;
+    }
+    n = k;
+  }
+
+  ssize_t wsiz = writev(fw->tr_ofd, iov, n);
+  if (wsiz == -1) {
+    if (is_temporary_error(errno)) {
+      return FWIO_AGAIN;
+    }
+    perror("writev");
+    return FWIO_ERROR;
+  }
+  if (fw->pace != NULL)
+    pace_charge(fw->pace, wsiz);
+  if (fw->cork)
+    fw->cork_pending = 1;
+
+  // account the written bytes to the send buffer and the shared frames
+  size_t left = wsiz;
+  while (left > 0) {
+    struct hub_fanout *f = &c->fanout[c->fanout_head % HUB_FANOUT_MAX];
+    if (c->fanout_head != c->fanout_tail && rb->head == f->pos) {
+      const size_t rest = f->frame->size - c->fanout_sent;
+      if (left < rest) {
+        c->fanout_sent += left;
+        break;
+      }
+      left -= rest;
+      c->fanout_sent = 0;
+      hub_frame_put(f->frame);
+      c->fanout_head++;
+    } else {
+      const size_t until = c->fanout_head != c->fanout_tail ? f->pos : rb->tail;
+      const size_t chunk = left < until - rb->head ? left : until - rb->head;
+      ringbuf_consume(rb, chunk);
+      left -= chunk;
+    }
+  }
+  return FWIO_OK;
+}
+
+static void hub_queue(struct hub *hub, int index) {
+  struct hub_client *c = hub->clients[index];
+  if (!c->queued) {
+    c->queued = 1;
+    if (hub->running)
+      hub->requeue[hub->nrequeue++] = index;
+    else
+      hub->queue[hub->nqueue++] = index;
+  }
+}
+
+// destination (or source) address of an L3 packet, and whether it is IPv6
+static const uint8_t *hub_packet_addr(const char *packet, size_t len, int src,
+                                      int *v6) {
+  const uint8_t *p = (const uint8_t *)packet;
+
+  if (len >= sizeof(struct iphdr) && (p[0] >> 4) == 4) {
+    *v6 = 0;
+    return &p[src ? offsetof(struct iphdr, saddr)
+                  : offsetof(struct iphdr, daddr)];
+  }
+  if (len >= sizeof(struct ip6_hdr) && (p[0] >> 4) == 6) {
+    *v6 = 1;
+    return &p[src ? offsetof(struct ip6_hdr, ip6_src)
+                  : offsetof(struct ip6_hdr, ip6_dst)];
+  }
+  return NULL;
+}
+
+// the interface write of a client; a client that announced no routes is
+// reachable at the source addresses it uses, as long as nobody else is,
+// until they expire without traffic
+static enum fwio do_hub_if_write(struct forward_ctx *fw) {
+  const char *frame = ringbuf_data(&fw->if_write_buf);
+  const uint8_t *addr = NULL;
+  int v6;
+
+  if (fw->routes_announced == 0) {
+    addr = hub_packet_addr(&frame[fw->frame_hdr_size],
+                           read_packet_size(frame), 1, &v6);
+  }
+  if (addr != NULL) {
+    const uint32_t value = route_lookup(fw->routes, v6, addr);
+    if (value == 0 && fw->routes_learned < HUB_LEARN_MAX) {
+      const uint64_t until = now_msec() + HUB_ROUTE_AGING;
+      if (route_add(fw->routes, v6 ? AF_INET6 : AF_INET, addr, v6 ? 128 : 32,
+                    fw->route_id, until) == -1) {
+        return FWIO_ERROR;
+      }
+      if (fw->routes_learned++ == 0)
+        fw->routes_refresh = until - HUB_ROUTE_REFRESH;
+    } else if (value == fw->route_id) {
+      const uint64_t now = now_msec();
+      if (now >= fw->routes_refresh) {
+        // added again, the later expiry holds; look again when the next
+        // route of the client comes close to expiring
+        if (route_add(fw->routes, v6 ? AF_INET6 : AF_INET, addr,
+                      v6 ? 128 : 32, fw->route_id,
+                      now + HUB_ROUTE_AGING) == -1) {
+          return FWIO_ERROR;
+        }
+        const uint64_t until = route_expiry(fw->routes, fw->route_id);
+        fw->routes_refresh = until > now + 1000 + HUB_ROUTE_REFRESH
+                                 ? until - HUB_ROUTE_REFRESH
+                                 : now + 1000;
+      }
+    }
+  }
+  return do_if_write(fw);
+}
+
+// take over a connection; it is closed if it cannot be served
+static void hub_add(struct hub *hub, int csock) {
+  int index;
+
+  for (index = 0; index < hub->nclients; index++) {
+    if (hub->clients[index] == NULL)
+      break;
+  }
+  if (index == hub->nclients) {
+    fprintf(stderr, "Warn: Too many clients\n");
+    close(csock);
+    return;
+  }
+
+  struct hub_client *c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    perror("calloc");
+    close(csock);
+    return;
+  }
+  if (forward_init(&c->fw, hub->optsp, hub->tunfd, csock, csock) == -1) {
+    free(c);
+    close(csock);
+    return;
+  }
+  if (hub->optsp->ifmode == IFMODE_L3 && hub->streams == 0) {
+    c->fw.routes = &hub->routes;
+  }
+  if (hub->streams > 0 && hub->optsp->rate > 0) {
+    c->fw.pace = &hub->pacer;
+  }
+  c->fw.route_id = index + 1;
+  c->ready = FWREADY_TR_IN | FWREADY_TR_OUT;
+
+  if (epoll_add(hub->epfd, csock, EPOLLIN | EPOLLOUT,
+                index << HUB_EV_SHIFT) == -1) {
+    perror("epoll_ctl");
+    forward_free(&c->fw);
+    free(c);
+    close(csock);
+    return;
+  }
+
+  put_trinfo(&c->fw);
+  hub->clients[index] = c;
+  hub_queue(hub, index);
+  if (hub->streams > 0) {
+    // the client's own streams belong to its session
+    if (hub->sock == -1) {
+      c->joined = 1;
+      hub->nstreams++;
+    }
+  } else {
+    fprintf(stderr, "Client %d connected\n", index);
+  }
+}
+
+// a stream of the server joins the set once its session is known: the
+// first one sets the session, the others have to match it
+static int hub_join(struct hub *hub, struct hub_client *c) {
+  if (c->fw.peer.session == 0) {
+    fprintf(stderr, "Warn: Refused a stream without a session\n");
+    return -1;
+  }
+  if (hub->nstreams == 0) {
+    hub->session = c->fw.peer.session;
+  } else if (c->fw.peer.session != hub->session) {
+    fprintf(stderr, "Warn: Refused a stream of another tunnel\n");
+    return -1;
+  }
+  c->joined = 1;
+  hub->nstreams++;
+  return 0;
+}
+
+static void hub_handshake_end(struct hub *hub, int i, int done) {
+  struct hub_handshake *h = &hub->handshakes[i];
+
+  tls_handshake_free(h->tls);
+  h->tls = NULL;
+  epoll_ctl(hub->epfd, EPOLL_CTL_DEL, h->sock, NULL);
+  if (done) {
+    hub_add(hub, h->sock);
+  } else {
+    close(h->sock);
+  }
+}
+
+static void hub_handshake_run(struct hub *hub, int i) {
+  const int r = tls_handshake_step(hub->handshakes[i].tls);
+
+  if (r != 0)
+    hub_handshake_end(hub, i, r == 1);
+}
+
+// the TLS handshake of an accepted connection runs in the loop, so a
+// silent peer does not hold up the clients; it is added once done
+static void hub_handshake_start(struct hub *hub, int csock) {
+  int i;
+
+  for (i = 0; i < HUB_HANDSHAKES_MAX; i++) {
+    if (hub->handshakes[i].tls == NULL)
+      break;
+  }
+  if (i == HUB_HANDSHAKES_MAX) {
+    fprintf(stderr, "Warn: Too many TLS handshakes\n");
+    close(csock);
+    return;
+  }
+
+  struct hub_handshake *h = &hub->handshakes[i];
+  if (fcntl(csock, F_SETFL, O_NONBLOCK) == -1) {
+    perror("fcntl");
+    close(csock);
+    return;
+  }
+  h->tls = tls_handshake_new(hub->optsp->tls_ctx, csock, NULL);
+  if (h->tls == NULL) {
+    close(csock);
+    return;
+  }
+  h->sock = csock;
+  h->until = now_usec() + (uint64_t)TLS_HANDSHAKE_TIMEOUT * 1000;
+  if (epoll_add(hub->epfd, csock, EPOLLIN | EPOLLOUT, HUB_EV_HANDSHAKE + i) ==
+      -1) {
+    perror("epoll_ctl");
+    tls_handshake_free(h->tls);
+    h->tls = NULL;
+    close(csock);
+    return;
+  }
+  hub_handshake_run(hub, i);
+}
+
+// give up the handshakes past their time; returns the next deadline, 0 if
+// there is none
+static uint64_t hub_handshake_expire(struct hub *hub) {
+  const uint64_t now = now_usec();
+  uint64_t deadline = 0;
+  int i;
+
+  for (i = 0; i < HUB_HANDSHAKES_MAX; i++) {
+    const struct hub_handshake *h = &hub->handshakes[i];
+    if (h->tls == NULL)
+      continue;
+    if (h->until <= now) {
+      fprintf(stderr, "TLS handshake: %s\n", strerror(ETIMEDOUT));
+      hub_handshake_end(hub, i, 0);
+    } else if (deadline == 0 || h->until < deadline) {
+      deadline = h->until;
+    }
+  }
+  return deadline;
+}
+
+static int hub_accept(struct hub *hub) {
+  for (;;) {
+    int csock = accept(hub->sock, NULL, NULL);
+    if (csock == -1) {
+      if (is_temporary_error(errno) || errno == ECONNABORTED) {
+        return 0;
+      }
+      perror("accept");
+      return -1;
+    }
+    if (hub->optsp->tls_ctx != NULL) {
+      hub_handshake_start(hub, csock);
+    } else {
+      hub_add(hub, csock);
+    }
+  }
+}
+
+static void hub_close(struct hub *hub, int index) {
+  struct hub_client *c = hub->clients[index];
+
+  route_remove(&hub->routes, c->fw.route_id);
+  if (hub->optsp->ifmode == IFMODE_L2)
+    fdb_remove(&hub->fdb, c->fw.route_id);
+  while (c->fanout_head != c->fanout_tail)
+    hub_frame_put(c->fanout[c->fanout_head++ % HUB_FANOUT_MAX].frame);
+  close(c->fw.tr_ifd);
+  if (c->joined) {
+    hub->nstreams--;
+  }
+  forward_free(&c->fw);
+  free(c);
+  hub->clients[index] = NULL;
+  if (hub->streams == 0) {
+    fprintf(stderr, "Client %d disconnected\n", index);
+  }
+}
+
+// queue a frame for sending to a client, dropping it if the client is
+// behind
+static void hub_deliver(struct hub *hub, int index, const char *frame,
+                        size_t size) {
+  struct hub_client *c = hub->clients[index];
+  struct ringbuf *rb = &c->fw.if_read_buf;
+
+  if (ringbuf_space(rb) < size) {
+    hub->overflow++;
+    return;
+  }
+  if (c->fw.batch_size > 0 && ringbuf_used(rb) == 0) {
+    c->fw.batch_since = now_usec();
+  }
+  memcpy(ringbuf_tail(rb), frame, size);
+  if (!queue_enqueue(&c->fw, ringbuf_tail(rb))) {
+    ringbuf_produce(rb, size);
+  }
+  hub_queue(hub, index);
+}
+
+// send a frame to every client but the one it came from. A client with
+// packets waiting to be encoded gets a copy behind them to keep the order,
+// the others share one encoded frame.
+static void hub_flood(struct hub *hub, int except, const char *frame,
+                      size_t size) {
+  struct hub_frame *shared = NULL;
+  int i;
+
+  for (i = 0; i < hub->nclients; i++) {
+    struct hub_client *c = hub->clients[i];
+    if (c == NULL || i == except)
+      continue;
+    if (ringbuf_used(&c->fw.if_read_buf) > 0 || queue_pending(&c->fw)) {
+      hub_deliver(hub, i, frame, size);
+      continue;
+    }
+    if (c->fanout_tail - c->fanout_head == HUB_FANOUT_MAX) {
+      hub->overflow++;
+      continue;
+    }
+    if (shared == NULL && (shared = hub_frame_encode(hub, frame)) == NULL) {
+      hub_deliver(hub, i, frame, size);
+      continue;
+    }
+
+    struct hub_fanout *f = &c->fanout[c->fanout_tail++ % HUB_FANOUT_MAX];
+    f->frame = shared;
+    f->pos = c->fw.tr_send_buf.tail;
+    shared->refs++;
+    hub_queue(hub, i);
+  }
+
+  if (shared != NULL)
+    hub_frame_put(shared);
+}
+
+// learn the source of an Ethernet frame from port, and look up the port
+// of its destination (0: flood)
+static uint32_t hub_switch_port(struct hub *hub, const char *packet,
+                                size_t len, uint32_t port, uint64_t now) {
+  const struct ether_header *eh = (const struct ether_header *)packet;
+
+  if (len < sizeof(*eh))
+    return port;
+  if (!(eh->ether_shost[0] & 0x01)) {
+    fdb_learn(&hub->fdb, eh->ether_shost, port, now);
+  }
+  if (eh->ether_dhost[0] & 0x01)
+    return 0;
+  return fdb_lookup(&hub->fdb, eh->ether_dhost, now);
+}
+
+// steer the packets read from the interface to the clients' read buffers
+static void hub_dispatch(struct hub *hub) {
+  struct forward_ctx *tun = &hub->tun;
+  const size_t hdr_size = tun->frame_hdr_size;
+  const uint64_t now =
+      hub->streams == 0 && hub->optsp->ifmode == IFMODE_L2 ? now_msec() : 0;
+
+  while (ringbuf_used(&tun->if_read_buf) >= hdr_size) {
+    const char *frame = ringbuf_data(&tun->if_read_buf);
+    const size_t size = hdr_size + read_packet_size(frame);
+    uint32_t id;
+
+    if (hub->streams > 0) {
+      // a full set is needed, a partial one would move flows later
+      id = hub->nstreams == hub->streams
+               ? flow_hash(hub->optsp->ifmode, &frame[hdr_size],
+                           size - hdr_size) %
+                         hub->streams +
+                     1
+               : 0;
+      if (id == 0) {
+        hub->no_route++;
+      }
+    } else if (hub->optsp->ifmode == IFMODE_L2) {
+      id = hub_switch_port(hub, &frame[hdr_size], size - hdr_size,
+                           HUB_PORT_IF, now);
+      if (id == 0) {
+        hub_flood(hub, -1, frame, size);
+      }
+    } else {
+      int v6;
+      const uint8_t *addr =
+          hub_packet_addr(&frame[hdr_size], size - hdr_size, 0, &v6);
+      id = addr != NULL ? route_lookup(&hub->routes, v6, addr) : 0;
+      if (id == 0) {
+        hub->no_route++;
+      }
+    }
+
+    if (id != 0 && id != HUB_PORT_IF) {
+      hub_deliver(hub, id - 1, frame, size);
+    }
+    ringbuf_consume(&tun->if_read_buf, size);
+  }
+}
+
+// the interface write of a client in L2 mode: frames to other clients are
+// switched directly, only those for the interface or flooded wait for it;
+// returns 1 if the budget ran out, 0 if done or waiting, or -1 on errors
+static int hub_switch(struct hub *hub, struct hub_client *c) {
+  struct forward_ctx *fw = &c->fw;
+  const int index = fw->route_id - 1;
+  const uint64_t now = now_msec();
+  int budget;
+
+  for (budget = EPOLL_IO_BUDGET; want_if_write(fw); budget--) {
+    if (budget == 0)
+      return 1;
+
+    const char *frame = ringbuf_data(&fw->if_write_buf);
+    const size_t size = fw->frame_hdr_size + read_packet_size(frame);
+    const uint32_t port =
+        hub_switch_port(hub, &frame[fw->frame_hdr_size],
+                        size - fw->frame_hdr_size, fw->route_id, now);
+
+    if (port == 0 || port == HUB_PORT_IF) {
+      if (!(hub->ready & FWREADY_IF_OUT))
+        return 0;
+      ssize_t wsiz = write(hub->tunfd, &frame[IF_FRAME_SIZE_LEN],
+                           size - IF_FRAME_SIZE_LEN);
+      if (wsiz == -1) {
+        if (is_temporary_error(errno)) {
+          hub->ready &= ~FWREADY_IF_OUT;
+          return 0;
+        }
+        perror("write");
+        return -1;
+      }
+    }
+    if (port == 0) {
+      hub_flood(hub, index, frame, size);
+    } else if (port != HUB_PORT_IF && port != fw->route_id) {
+      hub_deliver(hub, port - 1, frame, size);
+    }
+    ringbuf_consume(&fw->if_write_buf, size);
+  }
+  return 0;
+}
+
+// returns 1 if the client has work left, 0 if it waits for the kernel, or
+// -1 if it is gone
+static int hub_run_client(struct hub *hub, struct hub_client *c) {
+  struct forward_ctx *fw = &c->fw;
+  enum fwio r;
+  int more = 0;
+
+  // client -> interface
+  if ((r = forward_drain(fw, &c->ready, FWREADY_TR_IN, want_tr_read,
+                         do_tr_read)) != FWIO_OK) {
+    hub->eof = r == FWIO_EOF;
+    return -1;
+  }
+  if (forward_tr_to_if(fw) == -1) {
+    return -1;
+  }
+  // the session is the last option, data is only written once it joined
+  if (hub->streams > 0 && !c->joined &&
+      (fw->peer.session != 0 || fw->peer.checked) && hub_join(hub, c) == -1) {
+    return -1;
+  }
+  if (hub->streams > 0) {
+    if ((r = forward_drain(fw, &hub->ready, FWREADY_IF_OUT, want_if_write,
+                           do_if_write)) != FWIO_OK)
+      return -1;
+  } else if (hub->optsp->ifmode == IFMODE_L2) {
+    if ((more = hub_switch(hub, c)) == -1)
+      return -1;
+  } else if ((r = forward_drain(fw, &hub->ready, FWREADY_IF_OUT,
+                                want_if_write, do_hub_if_write)) != FWIO_OK) {
+    return -1;
+  }
+
+  // interface -> client
+  if (forward_if_to_tr(fw) == -1) {
+    return -1;
+  }
+  if ((r = forward_drain(fw, &c->ready, FWREADY_TR_OUT, want_hub_tr_write,
+                         do_hub_tr_write)) != FWIO_OK) {
+    return -1;
+  }
+
+  return more || ((c->ready & FWREADY_TR_IN) && want_tr_read(fw)) ||
+         ((c->ready & FWREADY_TR_OUT) && want_hub_tr_write(fw)) ||
+         ((hub->ready & FWREADY_IF_OUT) && want_if_write(fw));
+}
+
+static void hub_stats(struct hub *hub) {
+  int i;
+
+  if (hub->stats_seen != (unsigned)stats_requests) {
+    hub->stats_seen = stats_requests;
+    if (hub->streams > 0) {
+      fprintf(stderr, "Tunnel: %lu frames before the streams were up, %lu "
+                      "dropped for a full stream\n",
+              hub->no_route, hub->overflow);
+    } else {
+      fprintf(stderr, "Hub: %lu frames without a route, %lu dropped for a "
+                      "full client\n",
+              hub->no_route, hub->overflow);
+    }
+  }
+  if (hub->optsp->prio || hub->optsp->aqm) {
+    for (i = 0; i < hub->nclients; i++) {
+      char name[32];
+      if (hub->clients[i] == NULL)
+        continue;
+      snprintf(name, sizeof(name), "%s %d",
+               hub->streams > 0 ? "Stream" : "Client", i);
+      forward_stats(&hub->clients[i]->fw, name);
+    }
+  }
+}
+
+// forget the learned routes that expired, about once a second
+static int hub_route_expire(struct hub *hub) {
+  const uint64_t now = now_msec();
+  int i;
+
+  if (now < hub->route_sweep)
+    return 0;
+  hub->route_sweep = now + 1000;
+
+  const int removed = route_expire(&hub->routes, now);
+  if (removed <= 0)
+    return removed;
+
+  // count what the clients still have learned
+  for (i = 0; i < hub->nclients; i++) {
+    if (hub->clients[i] != NULL)
+      hub->clients[i]->fw.routes_learned = 0;
+  }
+  for (i = 0; i < (int)hub->routes.nroutes; i++) {
+    const struct route *r = &hub->routes.routes[i];
+    if (r->until != 0 && hub->clients[r->value - 1] != NULL)
+      hub->clients[r->value - 1]->fw.routes_learned++;
+  }
+  return 0;
+}
+
+static int hub_loop(struct hub *hub) {
+  struct epoll_event events[64];
+  int i;
+
+  for (;;) {
+    hub_stats(hub);
+
+    if (hub->optsp->ifmode == IFMODE_L3 && hub->streams == 0 &&
+        hub_route_expire(hub) == -1) {
+      return EXIT_FAILURE;
+    }
+
+    // interface -> clients
+    if (forward_drain(&hub->tun, &hub->ready, FWREADY_IF_IN, want_if_read,
+                      do_if_read) != FWIO_OK) {
+      return EXIT_FAILURE;
+    }
+    hub_dispatch(hub);
+
+    // run the clients with work, keep those that have more
+    int nclosed = 0;
+    hub->nrequeue = 0;
+    hub->running = 1;
+    for (i = 0; i < hub->nqueue; i++) {
+      const int index = hub->queue[i];
+      struct hub_client *c = hub->clients[index];
+      const int r = hub_run_client(hub, c);
+      if (r == -1) {
+        // a refused stream does not belong to the tunnel
+        nclosed += c->joined;
+        hub_close(hub, index);
+      } else if (r == 1) {
+        hub->requeue[hub->nrequeue++] = index;
+      } else {
+        forward_uncork(&c->fw);
+        c->queued = 0;
+      }
+    }
+    hub->running = 0;
+    memcpy(hub->queue, hub->requeue, hub->nrequeue * sizeof(*hub->queue));
+    hub->nqueue = hub->nrequeue;
+
+    // a stream lost takes the tunnel down; the client exits, the server
+    // waits for the next set
+    if (hub->streams > 0 && nclosed > 0) {
+      for (i = 0; i < hub->nclients; i++) {
+        if (hub->clients[i] != NULL)
+          hub_close(hub, i);
+      }
+      hub->nqueue = 0;
+      if (hub->sock == -1) {
+        return hub->eof ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+    }
+
+    // blocks waiting for the batch latency, paced clients for tokens
+    uint64_t deadline = 0;
+    if (hub->optsp->batch_latency > 0 || hub->optsp->rate > 0) {
+      const uint64_t now = now_usec();
+      for (i = 0; i < hub->nclients; i++) {
+        struct hub_client *c = hub->clients[i];
+        if (c == NULL)
+          continue;
+        // a pacer whose deadline passed lets its clients write again
+        if (c->fw.pace != NULL && c->fw.pace->deadline != 0 &&
+            c->fw.pace->deadline <= now) {
+          hub_queue(hub, i);
+        }
+        const uint64_t d = forward_deadline(&c->fw);
+        if (d == 0)
+          continue;
+        if (d <= now) {
+          hub_queue(hub, i);
+        } else if (deadline == 0 || d < deadline) {
+          deadline = d;
+        }
+      }
+      for (i = 0; i < hub->nclients; i++) {
+        struct hub_client *c = hub->clients[i];
+        if (c != NULL && c->fw.pace != NULL && c->fw.pace->deadline <= now)
+          c->fw.pace->deadline = 0;
+      }
+    }
+
+    if (hub->optsp->tls_ctx != NULL) {
+      const uint64_t d = hub_handshake_expire(hub);
+      if (d != 0 && (deadline == 0 || d < deadline))
+        deadline = d;
+    }
+
+    const int busy = hub->nqueue > 0 || ((hub->ready & FWREADY_IF_IN) &&
+                                         want_if_read(&hub->tun));
+    int n = epoll_wait_until(hub->epfd, events,
+                             sizeof(events) / sizeof(events[0]),
+                             busy ? 1 : deadline);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < n; i++) {
+      const uint32_t data = events[i].data.u32;
+      uint32_t ev = events[i].events;
+
+      // errors and hangups are reported by the next read or write
+      if (ev & (EPOLLERR | EPOLLHUP))
+        ev |= EPOLLIN | EPOLLOUT;
+
+      if (data == HUB_EV_LISTEN) {
+        if (hub_accept(hub) == -1) {
+          return EXIT_FAILURE;
+        }
+      } else if (data >= HUB_EV_HANDSHAKE &&
+                 data < HUB_EV_HANDSHAKE + HUB_HANDSHAKES_MAX) {
+        if (hub->handshakes[data - HUB_EV_HANDSHAKE].tls != NULL)
+          hub_handshake_run(hub, data - HUB_EV_HANDSHAKE);
+      } else if (data == HUB_EV_TUN) {
+        if (ev & EPOLLIN)
+          hub->ready |= FWREADY_IF_IN;
+        if ((ev & EPOLLOUT) && !(hub->ready & FWREADY_IF_OUT)) {
+          // clients may have been waiting for the interface
+          int j;
+          hub->ready |= FWREADY_IF_OUT;
+          for (j = 0; j < hub->nclients; j++) {
+            if (hub->clients[j] != NULL && want_if_write(&hub->clients[j]->fw))
+              hub_queue(hub, j);
+          }
+        }
+      } else {
+        const int index = data >> HUB_EV_SHIFT;
+        struct hub_client *c = hub->clients[index];
+        if (c == NULL)
+          continue;
+        if (ev & EPOLLIN)
+          c->ready |= FWREADY_TR_IN;
+        if (ev & EPOLLOUT)
+          c->ready |= FWREADY_TR_OUT;
+        hub_queue(hub, index);
+      }
+    }
+  }
+}
+
+int serve_hub(struct tuncat_commandline_options *optsp, int sock, int tunfd,
+              const int *socks) {
+  struct hub hub;
+  int ret = EXIT_FAILURE;
+  int i;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&hub, 0, sizeof(hub));
+  hub.optsp = optsp;
+  hub.sock = sock;
+  hub.tunfd = tunfd;
+  hub.epfd = -1;
+  hub.streams = optsp->streams;
+  hub.nclients = hub.streams > 0 ? hub.streams : HUB_CLIENTS_MAX;
+  hub.ready = FWREADY_IF_IN | FWREADY_IF_OUT;
+  route_init(&hub.routes);
+  if (optsp->ifmode == IFMODE_L2 &&
+      fdb_init(&hub.fdb, HUB_FDB_SIZE, HUB_FDB_AGING) == -1) {
+    return EXIT_FAILURE;
+  }
+
+  hub.clients = calloc(hub.nclients, sizeof(*hub.clients));
+  hub.queue = calloc(hub.nclients, sizeof(*hub.queue));
+  hub.requeue = calloc(hub.nclients, sizeof(*hub.requeue));
+  if (hub.clients == NULL || hub.queue == NULL || hub.requeue == NULL) {
+    perror("calloc");
+    goto end;
+  }
+
+  if (forward_init(&hub.tun, optsp, tunfd, -1, -1) == -1) {
+    goto end;
+  }
+  if (hub.streams > 0 && optsp->rate > 0) {
+    pace_init(&hub.pacer, optsp->rate / 8,
+              pace_burst(&hub.tun, optsp->rate / 8));
+  }
+  if (sock != -1 && fcntl(sock, F_SETFL, O_NONBLOCK) == -1) {
+    perror("fcntl");
+    goto end;
+  }
+
+  hub.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (hub.epfd == -1 ||
+      (sock != -1 && epoll_add(hub.epfd, sock, EPOLLIN, HUB_EV_LISTEN) == -1) ||
+      epoll_add(hub.epfd, tunfd, EPOLLIN | EPOLLOUT, HUB_EV_TUN) == -1) {
+    perror("epoll");
+    goto end;
+  }
+
+  if (socks != NULL) {
+    for (i = 0; i < hub.streams; i++) {
+      // the connections of this end, before the loop runs
+      if (optsp->tls_ctx != NULL &&
+          tls_start(optsp->tls_ctx, socks[i], optsp->node) == -1) {
+        close(socks[i]);
+        continue;
+      }
+      hub_add(&hub, socks[i]);
+    }
+    if (hub.nstreams < hub.streams) {
+      goto end;
+    }
+  }
+
+  ret = hub_loop(&hub);
+
+end:
+  for (i = 0; i < HUB_HANDSHAKES_MAX; i++) {
+    if (hub.handshakes[i].tls != NULL) {
+      tls_handshake_free(hub.handshakes[i].tls);
+      close(hub.handshakes[i].sock);
+    }
+  }
+  if (hub.epfd != -1)
+    close(hub.epfd);
+  forward_free(&hub.tun);
+  route_free(&hub.routes);
+  fdb_free(&hub.fdb);
+  free(hub.clients);
+  free(hub.queue);
+  free(hub.requeue);
+  return ret;
+}
+
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ringbuf.h"
+
+#ifndef HAVE_MEMFD_CREATE
+static int memfd_create(const char *name, unsigned int flags) {
+  return syscall(SYS_memfd_create, name, flags);
+}
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+#define HUGEPAGE_SIZE_DEF (2 * 1024 * 1024)
+
+// the default huge page size, which is what MFD_HUGETLB uses
+static size_t hugepage_size(void) {
+  static size_t size;
+  char line[128];
+  FILE *fp;
+
+  if (size != 0)
+    return size;
+  size = HUGEPAGE_SIZE_DEF;
+  if ((fp = fopen("/proc/meminfo", "r")) == NULL)
+    return size;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    unsigned long kb;
+    if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+      size = kb * 1024;
+      break;
+    }
+  }
+  fclose(fp);
+  return size;
+}
+
+// reserve address space for both views and a guard page or more on
+// either side, then map the file over it twice
+static int ringbuf_map(struct ringbuf *rb, int fd, size_t rsize,
+                       size_t align) {
+  const size_t pagesize = sysconf(_SC_PAGESIZE);
+  const size_t map_size = 2 * rsize + 2 * align + pagesize;
+
+  char *map = mmap(NULL, map_size, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  char *base = (char *)(((uintptr_t)map + pagesize + align - 1) &
+                        ~(uintptr_t)(align - 1));
+  if (mmap(base, rsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd,
+           0) == MAP_FAILED ||
+      mmap(base + rsize, rsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+           fd, 0) == MAP_FAILED) {
+    const int err = errno;
+    munmap(map, map_size);
+    errno = err;
+    return -1;
+  }
+
+  rb->base = base;
+  rb->size = rsize;
+  rb->mask = rsize - 1;
+  rb->map = map;
+  rb->map_size = map_size;
+  return 0;
+}
+
+// a hugetlbfs backed buffer, which needs huge pages reserved by the
+// administrator; their size is the alignment of the file and its views
+static int ringbuf_map_hugetlb(struct ringbuf *rb, size_t rsize) {
+  int fd = memfd_create("tuncat-ring", MFD_CLOEXEC | MFD_HUGETLB);
+  if (fd == -1) {
+    return -1;
+  }
+  if (ftruncate(fd, rsize) == -1 ||
+      ringbuf_map(rb, fd, rsize, hugepage_size()) == -1) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+int ringbuf_init(struct ringbuf *rb, size_t size, int flags) {
+  const size_t pagesize = sysconf(_SC_PAGESIZE);
+  size_t rsize = pagesize;
+
+  memset(rb, 0, sizeof(*rb));
+
+  // the double mapping needs page granularity, the index mask a power of 2
+  while (rsize < size) {
+    rsize <<= 1;
+  }
+
+  if ((flags & RINGBUF_HUGEPAGES) && rsize >= hugepage_size() &&
+      ringbuf_map_hugetlb(rb, rsize) == 0) {
+    return 0;
+  }
+
+  int fd = memfd_create("tuncat-ring", MFD_CLOEXEC);
+  if (fd == -1) {
+    perror("memfd_create");
+    return -1;
+  }
+  if (ftruncate(fd, rsize) == -1) {
+    perror("ftruncate");
+    close(fd);
+    return -1;
+  }
+  if (ringbuf_map(rb, fd, rsize, pagesize) == -1) {
+    perror("mmap");
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  // best effort, up to /sys/kernel/mm/transparent_hugepage/shmem_enabled
+  if (flags & RINGBUF_HUGEPAGES) {
+    madvise(rb->base, 2 * rsize, MADV_HUGEPAGE);
+  }
+  return 0;
+}
+
+int ringbuf_resize(struct ringbuf *rb, size_t size, int flags) {
+  const size_t used = ringbuf_used(rb);
+  struct ringbuf nrb;
+
+  if (ringbuf_init(&nrb, size, flags) == -1) {
+    return -1;
+  }
+  if (used > nrb.size) {
+    ringbuf_free(&nrb);
+    errno = ENOSPC;
+    return -1;
+  }
+
+  // the same counters index the new buffer at another offset
+  nrb.head = rb->head;
+  nrb.tail = rb->tail;
+  memcpy(ringbuf_data(&nrb), ringbuf_data(rb), used);
+  ringbuf_free(rb);
+  *rb = nrb;
+  return 0;
+}
+
+void ringbuf_free(struct ringbuf *rb) {
+  if (rb->map != NULL) {
+    munmap(rb->map, rb->map_size);
+  }
+  memset(rb, 0, sizeof(*rb));
+}
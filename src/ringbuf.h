@@ -0,0 +1,68 @@
+#ifndef __RINGBUF_H__
+#define __RINGBUF_H__
+
+#include <stddef.h>
+
+/*
+ * Byte ring buffer backed by a memfd that is mapped twice, back to back.
+ * Any run of up to <size> bytes starting at the head or the tail is
+ * therefore contiguous in memory, so frames that wrap can be handed to
+ * read(), write() and the compressor as a single pointer.
+ *
+ * head and tail are free running counters; the byte offset is taken
+ * with <mask>, which is why the capacity is rounded up to a power of two.
+ *
+ * The two views sit between inaccessible guard pages, so an overrun
+ * faults instead of corrupting a neighbour. Pages are only allocated as
+ * they are first touched.
+ */
+struct ringbuf {
+  char *base;
+  size_t size;
+  size_t mask;
+  size_t head;
+  size_t tail;
+
+  // the whole reservation, guard pages included
+  char *map;
+  size_t map_size;
+};
+
+// back the buffer with huge pages: hugetlbfs if some are reserved and the
+// buffer is at least one, else transparent huge pages where shmem allows
+#define RINGBUF_HUGEPAGES 0x1
+
+int ringbuf_init(struct ringbuf *rb, size_t size, int flags);
+void ringbuf_free(struct ringbuf *rb);
+
+// move the contents into a new buffer of size, keeping head and tail;
+// returns -1 and leaves rb as it was if it cannot (ENOSPC: they do not fit)
+int ringbuf_resize(struct ringbuf *rb, size_t size, int flags);
+
+static inline size_t ringbuf_used(const struct ringbuf *rb) {
+  return rb->tail - rb->head;
+}
+
+static inline size_t ringbuf_space(const struct ringbuf *rb) {
+  return rb->size - (rb->tail - rb->head);
+}
+
+// pointer to the first stored byte (valid for ringbuf_used() bytes)
+static inline char *ringbuf_data(const struct ringbuf *rb) {
+  return rb->base + (rb->head & rb->mask);
+}
+
+// pointer to the first free byte (valid for ringbuf_space() bytes)
+static inline char *ringbuf_tail(const struct ringbuf *rb) {
+  return rb->base + (rb->tail & rb->mask);
+}
+
+static inline void ringbuf_produce(struct ringbuf *rb, size_t len) {
+  rb->tail += len;
+}
+
+static inline void ringbuf_consume(struct ringbuf *rb, size_t len) {
+  rb->head += len;
+}
+
+#endif
@@ -0,0 +1,244 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "route.h"
+
+static int trie_new_node(struct route_trie *trie, uint32_t value,
+                         uint8_t plen) {
+  if (trie->nnodes == trie->cap) {
+    const size_t cap = trie->cap ? trie->cap * 2 : 16;
+    struct route_node *nodes = realloc(trie->nodes, cap * sizeof(*nodes));
+    if (nodes == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    trie->nodes = nodes;
+    trie->cap = cap;
+  }
+
+  // a new node inherits the route of the slot it is hung below
+  struct route_node *node = &trie->nodes[trie->nnodes];
+  int i;
+  for (i = 0; i < ROUTE_FANOUT; i++) {
+    node->slot[i] = value;
+    node->plen[i] = plen;
+  }
+  return trie->nnodes++;
+}
+
+// store value into a slot and everything below it that is not more
+// specific; an equal prefix is the same route, route_add() keeps other
+// values off it
+static void trie_fill(struct route_trie *trie, uint32_t node, int i,
+                      uint32_t value, int plen) {
+  struct route_node *n = &trie->nodes[node];
+
+  if (n->slot[i] & ROUTE_CHILD) {
+    const uint32_t child = n->slot[i] & ~ROUTE_CHILD;
+    int j;
+    for (j = 0; j < ROUTE_FANOUT; j++) {
+      trie_fill(trie, child, j, value, plen);
+    }
+  } else if (n->plen[i] <= plen) {
+    n->slot[i] = value;
+    n->plen[i] = plen;
+  }
+}
+
+static int trie_add(struct route_trie *trie, const uint8_t *addr, int plen,
+                    uint32_t value) {
+  uint32_t node = 0;
+  int level;
+
+  if (trie->nnodes == 0 && trie_new_node(trie, 0, 0) == -1)
+    return -1;
+
+  for (level = 0;; level++) {
+    const int bits = plen - level * ROUTE_STRIDE;
+
+    // the prefix ends within this node: it covers a range of slots
+    if (bits <= ROUTE_STRIDE) {
+      const int first = bits > 0 ? addr[level] & (0xff << (8 - bits)) : 0;
+      const int count = 1 << (ROUTE_STRIDE - bits);
+      int i;
+      for (i = first; i < first + count; i++) {
+        trie_fill(trie, node, i, value, plen);
+      }
+      return 0;
+    }
+
+    uint32_t slot = trie->nodes[node].slot[addr[level]];
+    if (!(slot & ROUTE_CHILD)) {
+      const int child =
+          trie_new_node(trie, slot, trie->nodes[node].plen[addr[level]]);
+      if (child == -1)
+        return -1;
+      slot = ROUTE_CHILD | child;
+      trie->nodes[node].slot[addr[level]] = slot;
+    }
+    node = slot & ~ROUTE_CHILD;
+  }
+}
+
+int route_init(struct route_table *rt) {
+  memset(rt, 0, sizeof(*rt));
+  return 0;
+}
+
+void route_free(struct route_table *rt) {
+  free(rt->routes);
+  free(rt->v4.nodes);
+  free(rt->v6.nodes);
+  memset(rt, 0, sizeof(*rt));
+}
+
+// clear the address bits beyond the prefix length
+static void route_mask(uint8_t *addr, int alen, int plen) {
+  int i;
+
+  for (i = 0; i < alen; i++) {
+    const int bits = plen - i * 8;
+    if (bits <= 0)
+      addr[i] = 0;
+    else if (bits < 8)
+      addr[i] &= 0xff << (8 - bits);
+  }
+}
+
+int route_add(struct route_table *rt, int family, const void *addr, int plen,
+              uint32_t value, uint64_t until) {
+  const int alen = family == AF_INET6 ? 16 : 4;
+  uint8_t prefix[16];
+  size_t i;
+
+  memcpy(prefix, addr, alen);
+  route_mask(prefix, alen, plen);
+  for (i = 0; i < rt->nroutes; i++) {
+    struct route *r = &rt->routes[i];
+    if (r->family == family && r->plen == plen &&
+        memcmp(r->addr, prefix, alen) == 0) {
+      if (r->value != value)
+        return 1;
+      // added again, the later expiry holds
+      if (r->until != 0 && (until == 0 || until > r->until))
+        r->until = until;
+      return 0;
+    }
+  }
+
+  if (rt->nroutes == rt->cap) {
+    const size_t cap = rt->cap ? rt->cap * 2 : 16;
+    struct route *routes = realloc(rt->routes, cap * sizeof(*routes));
+    if (routes == NULL) {
+      perror("realloc");
+      return -1;
+    }
+    rt->routes = routes;
+    rt->cap = cap;
+  }
+
+  struct route *r = &rt->routes[rt->nroutes++];
+  memset(r, 0, sizeof(*r));
+  r->family = family;
+  memcpy(r->addr, prefix, alen);
+  r->plen = plen;
+  r->value = value;
+  r->until = until;
+
+  return trie_add(family == AF_INET6 ? &rt->v6 : &rt->v4, r->addr, plen,
+                  value);
+}
+
+// rebuild both tries from the remaining routes
+static int route_rebuild(struct route_table *rt) {
+  size_t i;
+
+  rt->v4.nnodes = 0;
+  rt->v6.nnodes = 0;
+  for (i = 0; i < rt->nroutes; i++) {
+    const struct route *r = &rt->routes[i];
+    if (trie_add(r->family == AF_INET6 ? &rt->v6 : &rt->v4, r->addr, r->plen,
+                 r->value) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+int route_remove(struct route_table *rt, uint32_t value) {
+  size_t i, n = 0;
+
+  for (i = 0; i < rt->nroutes; i++) {
+    if (rt->routes[i].value != value) {
+      rt->routes[n++] = rt->routes[i];
+    }
+  }
+  if (n == rt->nroutes)
+    return 0;
+  rt->nroutes = n;
+  return route_rebuild(rt);
+}
+
+int route_expire(struct route_table *rt, uint64_t now) {
+  size_t i, n = 0;
+
+  for (i = 0; i < rt->nroutes; i++) {
+    if (rt->routes[i].until == 0 || rt->routes[i].until > now) {
+      rt->routes[n++] = rt->routes[i];
+    }
+  }
+  const int removed = rt->nroutes - n;
+  if (removed == 0)
+    return 0;
+  rt->nroutes = n;
+  return route_rebuild(rt) == -1 ? -1 : removed;
+}
+
+uint64_t route_expiry(const struct route_table *rt, uint32_t value) {
+  uint64_t until = 0;
+  size_t i;
+
+  for (i = 0; i < rt->nroutes; i++) {
+    const struct route *r = &rt->routes[i];
+    if (r->value == value && r->until != 0 && (until == 0 || r->until < until))
+      until = r->until;
+  }
+  return until;
+}
+
+int route_parse(const char *str, int *family, void *addr, int *plen) {
+  char buf[INET6_ADDRSTRLEN + sizeof("/128")];
+  char *sep;
+
+  if (strlen(str) >= sizeof(buf))
+    return -1;
+  strcpy(buf, str);
+  sep = strchr(buf, '/');
+  if (sep != NULL)
+    *sep++ = '\0';
+
+  if (inet_pton(AF_INET, buf, addr) == 1) {
+    *family = AF_INET;
+    *plen = 32;
+  } else if (inet_pton(AF_INET6, buf, addr) == 1) {
+    *family = AF_INET6;
+    *plen = 128;
+  } else {
+    return -1;
+  }
+
+  if (sep != NULL) {
+    char *p;
+    const long l = strtol(sep, &p, 10);
+    if (p == sep || *p != '\0' || l < 0 || l > *plen)
+      return -1;
+    *plen = l;
+  }
+  return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef __ROUTE_H__
+#define __ROUTE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Longest prefix match table for IPv4 and IPv6, mapping prefixes to a
+ * non-zero value (the hub's client id).
+ *
+ * The routes are kept in a list and compiled into one multibit trie per
+ * family with a stride of 8 bits and leaf pushing: every slot of a node
+ * holds either the value of the longest prefix covering it or a child
+ * node, so a lookup is one indexed load per address byte and stops at the
+ * first leaf. Adding a route updates the trie in place; removing routes
+ * rebuilds it from the list, which only happens when a client leaves or
+ * learned routes expire. A prefix belongs to one value, the first to add
+ * it.
+ */
+
+#define ROUTE_STRIDE 8
+#define ROUTE_FANOUT (1 << ROUTE_STRIDE)
+
+struct route_node {
+  // 0: no route, ROUTE_CHILD | n: child node n, otherwise the value
+  uint32_t slot[ROUTE_FANOUT];
+  // prefix length of the route stored in a value slot
+  uint8_t plen[ROUTE_FANOUT];
+};
+
+struct route_trie {
+  struct route_node *nodes;
+  size_t nnodes;
+  size_t cap;
+};
+
+struct route {
+  int family;
+  uint8_t addr[16];
+  int plen;
+  uint32_t value;
+  // when the route expires, 0: never
+  uint64_t until;
+};
+
+struct route_table {
+  struct route *routes;
+  size_t nroutes;
+  size_t cap;
+  struct route_trie v4;
+  struct route_trie v6;
+};
+
+int route_init(struct route_table *rt);
+void route_free(struct route_table *rt);
+
+// add a route that expires at until (0: never); returns 0, 1 if the
+// prefix belongs to another value, or -1 if out of memory
+int route_add(struct route_table *rt, int family, const void *addr, int plen,
+              uint32_t value, uint64_t until);
+
+// remove all routes to value
+int route_remove(struct route_table *rt, uint32_t value);
+
+// remove the routes that expired by now; returns the number removed, or
+// -1 if out of memory
+int route_expire(struct route_table *rt, uint64_t now);
+
+// earliest expiry of the routes to value that expire, 0: none
+uint64_t route_expiry(const struct route_table *rt, uint32_t value);
+
+// parse "<addr>[/<plen>]" of either family; returns 0 or -1
+int route_parse(const char *str, int *family, void *addr, int *plen);
+
+#define ROUTE_CHILD 0x80000000U
+
+static inline uint32_t route_lookup(const struct route_table *rt, int v6,
+                                    const uint8_t *addr) {
+  const struct route_trie *trie = v6 ? &rt->v6 : &rt->v4;
+  const int depth = v6 ? 16 : 4;
+  uint32_t node = 0;
+  int i;
+
+  if (trie->nnodes == 0)
+    return 0;
+  for (i = 0; i < depth; i++) {
+    const uint32_t slot = trie->nodes[node].slot[addr[i]];
+    if (!(slot & ROUTE_CHILD))
+      return slot;
+    node = slot & ~ROUTE_CHILD;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,447 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "tls.h"
+
+#if defined(HAVE_OPENSSL) && defined(HAVE_LINUX_TLS_H)
+
+#include <linux/tls.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <openssl/x509_vfy.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+// the cipher suites the kernel has record ciphers for
+#define TLS_CIPHERSUITES                                                       \
+  "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:"                             \
+  "TLS_CHACHA20_POLY1305_SHA256"
+
+// the application traffic secrets of a connection, from the key log
+struct tls_secrets {
+  unsigned char client[EVP_MAX_MD_SIZE];
+  unsigned char server[EVP_MAX_MD_SIZE];
+  size_t client_len;
+  size_t server_len;
+};
+
+union crypto_info {
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+  struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+  struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+};
+
+static void print_ssl_error(const char *s) {
+  char buf[256];
+  unsigned long err = ERR_get_error();
+
+  if (err != 0) {
+    ERR_error_string_n(err, buf, sizeof(buf));
+    fprintf(stderr, "%s: %s\n", s, buf);
+  } else {
+    fprintf(stderr, "%s: Failed\n", s);
+  }
+  ERR_clear_error();
+}
+
+static void print_handshake_error(SSL *ssl, int r) {
+  switch (SSL_get_error(ssl, r)) {
+  case SSL_ERROR_SYSCALL:
+    if (errno != 0) {
+      perror("TLS handshake");
+    } else {
+      fprintf(stderr, "TLS handshake: Connection closed\n");
+    }
+    ERR_clear_error();
+    break;
+  default:
+    if (SSL_get_verify_result(ssl) != X509_V_OK) {
+      fprintf(stderr, "TLS handshake: %s\n",
+              X509_verify_cert_error_string(SSL_get_verify_result(ssl)));
+      ERR_clear_error();
+    } else {
+      print_ssl_error("TLS handshake");
+    }
+    break;
+  }
+}
+
+// OpenSSL only lets the traffic secrets out through the key log
+static void keylog(const SSL *ssl, const char *line) {
+  static const char client_label[] = "CLIENT_TRAFFIC_SECRET_0 ";
+  static const char server_label[] = "SERVER_TRAFFIC_SECRET_0 ";
+  struct tls_secrets *secrets = SSL_get_app_data(ssl);
+  unsigned char *secret;
+  size_t *len;
+  const char *p;
+
+  if (strncmp(line, client_label, sizeof(client_label) - 1) == 0) {
+    secret = secrets->client;
+    len = &secrets->client_len;
+  } else if (strncmp(line, server_label, sizeof(server_label) - 1) == 0) {
+    secret = secrets->server;
+    len = &secrets->server_len;
+  } else {
+    return;
+  }
+
+  // the client random, then the secret
+  p = strchr(line + sizeof(client_label) - 1, ' ');
+  if (p == NULL ||
+      !OPENSSL_hexstr2buf_ex(secret, EVP_MAX_MD_SIZE, len, p + 1, '\0')) {
+    *len = 0;
+  }
+}
+
+// HKDF-Expand-Label (RFC 8446 7.1) with an empty context
+static int hkdf_expand_label(const EVP_MD *md, const unsigned char *secret,
+                             size_t secret_len, const char *label,
+                             unsigned char *out, size_t len) {
+  static const char prefix[] = "tls13 ";
+  const size_t label_len = sizeof(prefix) - 1 + strlen(label);
+  unsigned char info[32];
+  EVP_PKEY_CTX *pctx;
+  int ret = -1;
+
+  if (4 + label_len > sizeof(info))
+    return -1;
+  info[0] = len >> 8;
+  info[1] = len;
+  info[2] = label_len;
+  memcpy(&info[3], prefix, sizeof(prefix) - 1);
+  memcpy(&info[3 + sizeof(prefix) - 1], label, strlen(label));
+  info[3 + label_len] = 0;
+
+  pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+  if (pctx != NULL && EVP_PKEY_derive_init(pctx) > 0 &&
+      EVP_PKEY_CTX_set_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+      EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+      EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, secret_len) > 0 &&
+      EVP_PKEY_CTX_add1_hkdf_info(pctx, info, 4 + label_len) > 0 &&
+      EVP_PKEY_derive(pctx, out, &len) > 0) {
+    ret = 0;
+  }
+  EVP_PKEY_CTX_free(pctx);
+  return ret;
+}
+
+// the kernel's view of one direction: the key and IV of a traffic secret,
+// the IV split into salt and explicit part for GCM, and the record
+// sequence number, 0 as nothing was sent with the secret yet
+static int derive_crypto_info(const SSL_CIPHER *cipher,
+                              const unsigned char *secret, size_t secret_len,
+                              union crypto_info *ci, socklen_t *size) {
+  const EVP_MD *md = SSL_CIPHER_get_handshake_digest(cipher);
+  unsigned char key[32], iv[12];
+  size_t key_len;
+  int ret = -1;
+
+  memset(ci, 0, sizeof(*ci));
+  ci->info.version = TLS_1_3_VERSION;
+  switch (SSL_CIPHER_get_protocol_id(cipher)) {
+  case 0x1301:
+    ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+    key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+    *size = sizeof(ci->aes_gcm_128);
+    break;
+  case 0x1302:
+    ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+    *size = sizeof(ci->aes_gcm_256);
+    break;
+  case 0x1303:
+    ci->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+    key_len = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+    *size = sizeof(ci->chacha20_poly1305);
+    break;
+  default:
+    return -1;
+  }
+
+  if (md == NULL ||
+      hkdf_expand_label(md, secret, secret_len, "key", key, key_len) == -1 ||
+      hkdf_expand_label(md, secret, secret_len, "iv", iv, sizeof(iv)) == -1)
+    goto end;
+
+  switch (ci->info.cipher_type) {
+  case TLS_CIPHER_AES_GCM_128:
+    memcpy(ci->aes_gcm_128.key, key, key_len);
+    memcpy(ci->aes_gcm_128.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+    memcpy(ci->aes_gcm_128.iv, &iv[TLS_CIPHER_AES_GCM_128_SALT_SIZE],
+           TLS_CIPHER_AES_GCM_128_IV_SIZE);
+    break;
+  case TLS_CIPHER_AES_GCM_256:
+    memcpy(ci->aes_gcm_256.key, key, key_len);
+    memcpy(ci->aes_gcm_256.salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+    memcpy(ci->aes_gcm_256.iv, &iv[TLS_CIPHER_AES_GCM_256_SALT_SIZE],
+           TLS_CIPHER_AES_GCM_256_IV_SIZE);
+    break;
+  case TLS_CIPHER_CHACHA20_POLY1305:
+    memcpy(ci->chacha20_poly1305.key, key, key_len);
+    memcpy(ci->chacha20_poly1305.iv, iv,
+           TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+    break;
+  }
+  ret = 0;
+
+end:
+  OPENSSL_cleanse(key, sizeof(key));
+  OPENSSL_cleanse(iv, sizeof(iv));
+  return ret;
+}
+
+void *tls_context_new(const struct tls_config *config) {
+  SSL_CTX *ctx = SSL_CTX_new(config->server ? TLS_server_method()
+                                            : TLS_client_method());
+  if (ctx == NULL) {
+    print_ssl_error("SSL_CTX_new");
+    return NULL;
+  }
+
+  // TLS 1.3 only, and no session tickets: the server sends nothing after
+  // the handshake that the kernel would have to take for a record
+  if (!SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION) ||
+      !SSL_CTX_set_ciphersuites(ctx, TLS_CIPHERSUITES) ||
+      !SSL_CTX_set_num_tickets(ctx, 0)) {
+    print_ssl_error("SSL_CTX_new");
+    goto fail;
+  }
+  SSL_CTX_set_keylog_callback(ctx, keylog);
+
+  if (config->cert != NULL) {
+    const char *key = config->key ?: config->cert;
+    if (SSL_CTX_use_certificate_chain_file(ctx, config->cert) != 1) {
+      print_ssl_error(config->cert);
+      goto fail;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+      print_ssl_error(key);
+      goto fail;
+    }
+  }
+
+  // a server with CA certificates wants a certificate from every client
+  if (config->ca != NULL) {
+    if (SSL_CTX_load_verify_locations(ctx, config->ca, NULL) != 1) {
+      print_ssl_error(config->ca);
+      goto fail;
+    }
+    SSL_CTX_set_verify(ctx,
+                       SSL_VERIFY_PEER | (config->server
+                                              ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT
+                                              : 0),
+                       NULL);
+  }
+
+  return ctx;
+
+fail:
+  SSL_CTX_free(ctx);
+  return NULL;
+}
+
+void tls_context_free(void *ctx) { SSL_CTX_free(ctx); }
+
+static int set_timeout(int sock, long msec) {
+  struct timeval tv = {.tv_sec = msec / 1000, .tv_usec = msec % 1000 * 1000};
+
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+      setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+    perror("setsockopt");
+    return -1;
+  }
+  return 0;
+}
+
+struct tls_handshake {
+  SSL *ssl;
+  int sock;
+  int server;
+  struct tls_secrets secrets;
+};
+
+struct tls_handshake *tls_handshake_new(void *ctx, int sock,
+                                        const char *peer) {
+  struct tls_handshake *hs = calloc(1, sizeof(*hs));
+  int r;
+
+  if (hs == NULL) {
+    perror("calloc");
+    return NULL;
+  }
+  hs->sock = sock;
+  hs->ssl = SSL_new(ctx);
+  if (hs->ssl == NULL || !SSL_set_fd(hs->ssl, sock)) {
+    print_ssl_error("SSL_new");
+    goto fail;
+  }
+  SSL_set_app_data(hs->ssl, &hs->secrets);
+  hs->server = SSL_is_server(hs->ssl);
+
+  if (!hs->server && peer != NULL) {
+    struct in6_addr addr;
+    if (inet_pton(AF_INET, peer, &addr) == 1 ||
+        inet_pton(AF_INET6, peer, &addr) == 1) {
+      r = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(hs->ssl), peer);
+    } else {
+      r = SSL_set_tlsext_host_name(hs->ssl, peer) &&
+          SSL_set1_host(hs->ssl, peer);
+    }
+    if (!r) {
+      print_ssl_error(peer);
+      goto fail;
+    }
+  }
+  return hs;
+
+fail:
+  tls_handshake_free(hs);
+  return NULL;
+}
+
+// hand the traffic keys of the finished handshake to the kernel
+static int tls_to_kernel(struct tls_handshake *hs) {
+  const struct tls_secrets *secrets = &hs->secrets;
+  const SSL_CIPHER *cipher = SSL_get_current_cipher(hs->ssl);
+  union crypto_info tx, rx;
+  socklen_t tx_size, rx_size;
+  int ret = -1;
+
+  if (secrets->client_len == 0 || secrets->server_len == 0 ||
+      derive_crypto_info(
+          cipher, hs->server ? secrets->server : secrets->client,
+          hs->server ? secrets->server_len : secrets->client_len, &tx,
+          &tx_size) == -1 ||
+      derive_crypto_info(
+          cipher, hs->server ? secrets->client : secrets->server,
+          hs->server ? secrets->client_len : secrets->server_len, &rx,
+          &rx_size) == -1) {
+    fprintf(stderr, "Cannot derive the TLS keys for %s\n",
+            SSL_CIPHER_get_name(cipher));
+    goto end;
+  }
+
+  if (setsockopt(hs->sock, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) ==
+          -1 ||
+      setsockopt(hs->sock, SOL_TLS, TLS_TX, &tx, tx_size) == -1 ||
+      setsockopt(hs->sock, SOL_TLS, TLS_RX, &rx, rx_size) == -1) {
+    perror("Cannot set up kernel TLS");
+    goto end;
+  }
+  ret = 0;
+
+end:
+  OPENSSL_cleanse(&tx, sizeof(tx));
+  OPENSSL_cleanse(&rx, sizeof(rx));
+  return ret;
+}
+
+int tls_handshake_step(struct tls_handshake *hs) {
+  const int r = hs->server ? SSL_accept(hs->ssl) : SSL_connect(hs->ssl);
+
+  if (r != 1) {
+    switch (SSL_get_error(hs->ssl, r)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      return 0;
+    default:
+      print_handshake_error(hs->ssl, r);
+      return -1;
+    }
+  }
+
+  // records read past the handshake would be lost to the kernel
+  if (SSL_has_pending(hs->ssl)) {
+    fprintf(stderr, "TLS handshake: Unexpected data\n");
+    return -1;
+  }
+  return tls_to_kernel(hs) == -1 ? -1 : 1;
+}
+
+void tls_handshake_free(struct tls_handshake *hs) {
+  if (hs == NULL)
+    return;
+  SSL_free(hs->ssl);
+  OPENSSL_cleanse(&hs->secrets, sizeof(hs->secrets));
+  free(hs);
+}
+
+int tls_start(void *ctx, int sock, const char *peer) {
+  struct tls_handshake *hs;
+  int r;
+
+  if (set_timeout(sock, TLS_HANDSHAKE_TIMEOUT) == -1)
+    return -1;
+  hs = tls_handshake_new(ctx, sock, peer);
+  if (hs == NULL)
+    return -1;
+  // the socket blocks, so waiting for more means the timeout passed
+  r = tls_handshake_step(hs);
+  if (r == 0) {
+    errno = ETIMEDOUT;
+    perror("TLS handshake");
+  }
+  tls_handshake_free(hs);
+  if (r != 1 || set_timeout(sock, 0) == -1)
+    return -1;
+  return 0;
+}
+
+#else
+
+void *tls_context_new(const struct tls_config *config) {
+  (void)config;
+  fprintf(stderr, "TLS is not supported by this build\n");
+  return NULL;
+}
+
+void tls_context_free(void *ctx) { (void)ctx; }
+
+int tls_start(void *ctx, int sock, const char *peer) {
+  (void)ctx;
+  (void)sock;
+  (void)peer;
+  errno = ENOSYS;
+  return -1;
+}
+
+struct tls_handshake *tls_handshake_new(void *ctx, int sock,
+                                        const char *peer) {
+  (void)ctx;
+  (void)sock;
+  (void)peer;
+  errno = ENOSYS;
+  return NULL;
+}
+
+int tls_handshake_step(struct tls_handshake *hs) {
+  (void)hs;
+  errno = ENOSYS;
+  return -1;
+}
+
+void tls_handshake_free(struct tls_handshake *hs) { (void)hs; }
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+/*
+ * Encrypted transfer with kernel TLS: the TLS 1.3 handshake runs in
+ * userspace, then the traffic keys are handed to the kernel, which seals
+ * and opens the records on plain reads and writes of the socket (and may
+ * pass the work on to the NIC).
+ */
+
+// a handshake that takes longer fails, so a silent peer cannot stall
+#define TLS_HANDSHAKE_TIMEOUT 10000
+
+// the certificate (and key) to present, and the CA certificates a peer
+// must be signed by, or NULL
+struct tls_config {
+  int server;
+  const char *cert;
+  const char *key;
+  const char *ca;
+};
+
+// returns the context shared by all connections, or NULL with the reason
+// printed (also if the build has no TLS support)
+void *tls_context_new(const struct tls_config *config);
+void tls_context_free(void *ctx);
+
+// handshake on a connected blocking socket and hand the records over to
+// the kernel; a client checks the server certificate against peer (host
+// name or address) if the context has CA certificates; returns 0, or -1
+// with the reason printed
+int tls_start(void *ctx, int sock, const char *peer);
+
+// the same on a non-blocking socket, driven by the caller's event loop,
+// which also enforces the timeout
+struct tls_handshake;
+
+// returns NULL with the reason printed
+struct tls_handshake *tls_handshake_new(void *ctx, int sock,
+                                        const char *peer);
+// run as far as the socket allows; returns 1 once the kernel has the
+// records, 0 while waiting for the peer, or -1 with the reason printed
+int tls_handshake_step(struct tls_handshake *hs);
+void tls_handshake_free(struct tls_handshake *hs);
+
+#endif
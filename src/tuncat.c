@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <alloca.h>
 #include <arpa/inet.h>
 #include <assert.h>
@@ -6,27 +8,48 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <linux/errqueue.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 #include <linux/sockios.h>
+#include <linux/virtio_net.h>
+#include <net/ethernet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
-#include <snappy-c.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/random.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "aqm.h"
+#include "bdp.h"
+#include "codec.h"
+#include "flow.h"
+#include "forward.h"
+#include "ringbuf.h"
+#include "route.h"
+#include "tls.h"
 #include "tuncat.h"
+#include "uring.h"
 
 static int inet6_net_pton(int af, const char *cp, void *buf, size_t len) {
   if (af != AF_INET6) {
@@ -106,6 +129,12 @@ void print_usage(FILE *fp, int argc, char *const argv[]) {
   fprintf(
       fp, "  -t,--transfer-mode=%-6s   TCP client mode%s\n", TRMODE_CLIENT_OPT,
       strcmp(TRMODE_DEFAULT_OPT, TRMODE_CLIENT_OPT) == 0 ? "  (default)" : "");
+  fprintf(fp, "  -t,--transfer-mode=%-10s UDP server mode, serves the first "
+              "client\n",
+          TRMODE_UDP_SERVER_OPT);
+  fprintf(fp, "                              (start it before the client)\n");
+  fprintf(fp, "  -t,--transfer-mode=%-10s UDP client mode\n",
+          TRMODE_UDP_CLIENT_OPT);
   fprintf(fp, "  -l,--address=<addr>         Listen Address   (default: any) "
               "  (TCP server)\n");
   fprintf(fp,
@@ -118,12 +147,164 @@ void print_usage(FILE *fp, int argc, char *const argv[]) {
           "  -p,--port=<port>            Connect Port     (default: %5s) (TCP "
           "client)\n",
           PORT_DEFAULT);
+  fprintf(fp, "  -U,--udp-offload            UDP GSO/GRO batching (UDP modes)\n");
   fprintf(fp, "  -4,--ipv4                   Force ipv4       (TCP server or "
               "TCP client)\n");
   fprintf(fp, "  -6,--ipv6                   Force ipv6       (TCP server or "
               "TCP client)\n");
+  fprintf(fp, "  -e,--tls                    Encrypt with TLS 1.3, the kernel "
+              "seals the\n");
+  fprintf(fp, "                              records (TCP server or TCP "
+              "client)\n");
+  fprintf(fp, "  -K,--tls-cert=<file>        Certificate chain (PEM, required "
+              "for server)\n");
+  fprintf(fp, "  -J,--tls-key=<file>         Private key (PEM, default: in "
+              "the -K file)\n");
+  fprintf(fp, "  -V,--tls-ca=<file>          CA certificates the peer must be "
+              "signed by;\n");
+  fprintf(fp, "                              the server certificate must "
+              "match -l, a\n");
+  fprintf(fp, "                              server requires a client "
+              "certificate\n");
+  fprintf(fp, "  -M,--profile=%-10s     Transfer socket without Nagle and "
+              "with a\n",
+          SOCKPROFILE_LATENCY_OPT);
+  fprintf(fp, "                              short unsent queue (%d "
+              "bytes)\n",
+          SOCK_NOTSENT_LOWAT_LATENCY);
+  fprintf(fp, "  -M,--profile=%-10s     Transfer socket corked between "
+              "batches of\n",
+          SOCKPROFILE_THROUGHPUT_OPT);
+  fprintf(fp, "                              writes, with %d MiB "
+              "buffers\n",
+          SOCK_BUFFER_THROUGHPUT / 1048576);
+  fprintf(fp, "  -W,--sockopt=<name>=<value>[,...]\n");
+  fprintf(fp, "                              Transfer socket setting, over "
+              "the profile\n");
+  fprintf(fp, "                              (repeatable): %s, %s (0 or "
+              "1),\n",
+          SOCKOPT_NODELAY_OPT, SOCKOPT_CORK_OPT);
+  fprintf(fp, "                              %s, %s, %s, %s\n",
+          SOCKOPT_NOTSENT_LOWAT_OPT, SOCKOPT_SNDBUF_OPT, SOCKOPT_RCVBUF_OPT,
+          SOCKOPT_RCVLOWAT_OPT);
+  fprintf(fp, "                              (bytes, k or m; UDP: %s and "
+              "%s only)\n",
+          SOCKOPT_SNDBUF_OPT, SOCKOPT_RCVBUF_OPT);
   fprintf(fp, "\n");
   fprintf(fp, "  -c,--compress               Compress mode\n");
+  fprintf(fp, "  -C,--adaptive-compress[=<percent>]\n");
+  fprintf(fp, "                              Adaptive compress mode, packets "
+              "that do not\n");
+  fprintf(fp, "                              compress to <percent> are sent "
+              "raw\n");
+  fprintf(fp, "                              (default: %d)\n",
+          COMPRESS_RATIO_DEF);
+  fprintf(fp, "  -Z,--codec=<codec>[:<level>]\n");
+  fprintf(fp, "                              Compression codec (default: "
+              "%s)\n",
+          CODEC_DEFAULT_OPT);
+  fprintf(fp, "                              %s", CODEC_SNAPPY_OPT);
+  if (codec_lookup(CODEC_LZ4) != NULL)
+    fprintf(fp, ", %s[:<acceleration>]", CODEC_LZ4_OPT);
+  if (codec_lookup(CODEC_ZSTD) != NULL)
+    fprintf(fp, ", %s[:<level>]", CODEC_ZSTD_OPT);
+  fprintf(fp, "\n");
+  fprintf(fp, "  -H,--incompressible-hold=<msec>\n");
+  fprintf(fp, "                              Skip compressing a flow for "
+              "<msec> after\n");
+  fprintf(fp, "                              a packet of it was sent raw "
+              "(with -C)\n");
+  fprintf(fp, "  -D,--dictionary=<file>      Preset dictionary (with -Z "
+              "%s)\n",
+          CODEC_ZSTD_OPT);
+  fprintf(fp, "  -B,--batch-size=<size>      Compress waiting packets "
+              "together in blocks\n");
+  fprintf(fp, "                              of up to <size> bytes (with "
+              "-c or -C)\n");
+  fprintf(fp, "  -L,--batch-latency=<usec>   Hold packets up to <usec> to "
+              "fill a block\n");
+  fprintf(fp, "                              (default: 0, only what is "
+              "waiting)\n");
+  fprintf(fp, "  -P,--priority[=%s]      Send interactive packets (DSCP "
+              "CS5+, pure\n",
+          PRIOMODE_STRICT_OPT);
+  fprintf(fp, "                              TCP ACKs, small non-TCP packets) "
+              "ahead of\n");
+  fprintf(fp, "                              bulk (CS1)\n");
+  fprintf(fp, "  -P,--priority=%s[:<i>,<d>,<b>]\n", PRIOMODE_WEIGHTED_OPT);
+  fprintf(fp, "                              Weighted instead of strict "
+              "(default: %d,%d,%d)\n",
+          PRIO_WEIGHT_INTERACTIVE_DEF, PRIO_WEIGHT_DEFAULT_DEF,
+          PRIO_WEIGHT_BULK_DEF);
+  fprintf(fp, "  -Q,--aqm=<mode>[:<target>[,<interval>]]\n");
+  fprintf(fp, "                              Active queue management of the "
+              "packets\n");
+  fprintf(fp, "                              waiting for the transfer, %s "
+              "or %s\n",
+          AQMMODE_CODEL_OPT, AQMMODE_FQ_CODEL_OPT);
+  fprintf(fp, "                              (per flow queues), times in "
+              "usec\n");
+  fprintf(fp, "                              (default: %d,%d)\n",
+          AQM_TARGET_DEF, AQM_INTERVAL_DEF);
+  fprintf(fp, "                              SIGUSR1 prints the queue "
+              "counters (-P, -Q)\n");
+  fprintf(fp, "\n");
+  fprintf(fp, "  -E,--event-backend=%-6s   epoll event loop%s\n",
+          EVMODE_EPOLL_OPT,
+          strcmp(EVMODE_DEFAULT_OPT, EVMODE_EPOLL_OPT) == 0 ? " (default)" : "");
+  fprintf(fp, "  -E,--event-backend=%-6s   select event loop%s\n",
+          EVMODE_SELECT_OPT,
+          strcmp(EVMODE_DEFAULT_OPT, EVMODE_SELECT_OPT) == 0 ? " (default)"
+                                                              : "");
+  fprintf(fp, "  -E,--event-backend=%-6s   io_uring loop%s\n",
+          EVMODE_URING_OPT,
+          strcmp(EVMODE_DEFAULT_OPT, EVMODE_URING_OPT) == 0 ? " (default)"
+                                                             : "");
+  fprintf(fp, "                              (stream transports, else or "
+              "without io_uring\n");
+  fprintf(fp, "                              the epoll loop)\n");
+  fprintf(fp, "\n");
+  fprintf(fp, "  -q,--queues=<n>             Multi-queue interface, one worker "
+              "per queue\n");
+  fprintf(fp, "                              (TCP server or TCP client), "
+              "one peer at a time\n");
+  fprintf(fp, "  -A,--cpu-affinity           Pin each queue worker to a CPU\n");
+  fprintf(fp, "  -s,--streams=<n>            Parallel connections, flows are "
+              "spread\n");
+  fprintf(fp, "                              over them by hash (TCP server "
+              "or TCP client)\n");
+  fprintf(fp, "                              SIGUSR1 prints the drop "
+              "counters\n");
+  fprintf(fp, "\n");
+  fprintf(fp, "  -x,--hub                    Serve all clients from one process, "
+              "routing\n");
+  fprintf(fp, "                              packets by destination, or "
+              "switching\n");
+  fprintf(fp, "                              frames in L2 mode (TCP "
+              "server)\n");
+  fprintf(fp, "                              SIGUSR1 prints the drop "
+              "counters\n");
+  fprintf(fp, "  -R,--route=<addr>[/<plen>]  Announce a route to the hub "
+              "(repeatable,\n");
+  fprintf(fp, "                              default: the source addresses "
+              "used)\n");
+  fprintf(fp, "  -d,--default-route          Let a client of the hub announce "
+              "the default\n");
+  fprintf(fp, "                              route (0.0.0.0/0 or ::/0)\n");
+  fprintf(fp, "\n");
+  fprintf(fp, "  -O,--offload                Pass GSO super frames through the "
+              "tunnel\n");
+  fprintf(fp, "                              (virtio header, TSO/USO/CSUM; TCP "
+              "or stdio)\n");
+  fprintf(fp, "\n");
+  fprintf(fp, "  -r,--rate=<rate>[k|m|g]     Cap the transfer at <rate> "
+              "bits/s, paced\n");
+  fprintf(fp, "                              by TCP or else in userspace\n");
+  fprintf(fp, "  -k,--burst=<size>           Token bucket size of the "
+              "userspace pacer\n");
+  fprintf(fp, "                              (default: %d usec of <rate>, at "
+              "least a frame)\n",
+          PACE_BURST_DEF_USEC);
   fprintf(fp, "\n");
   fprintf(fp, "  -F,--max-frame-size=<size>  Max frame size (default: %zu)\n",
           (size_t)IF_MAX_FRAME_SIZE_DEF);
@@ -131,6 +312,35 @@ void print_usage(FILE *fp, int argc, char *const argv[]) {
   fprintf(fp, "                   (default: <Max frame size> * 2)\n");
   fprintf(fp, "  -T,--trbuffer-size=<size>   Transfer buffer size\n");
   fprintf(fp, "                   (default: <Interface Buffersize>)\n");
+  fprintf(fp, "                   (stdio pipes are grown to it too)\n");
+  fprintf(fp, "  -T,--trbuffer-size=%s[:<min>,<max>]\n", TR_BUFFER_AUTO_OPT);
+  fprintf(fp, "                              Follow the bandwidth-delay "
+              "product, the\n");
+  fprintf(fp, "                              socket buffers too "
+              "(raised only, the\n");
+  fprintf(fp, "                              -M/-W sizes stay the least)\n");
+  fprintf(fp, "                   (default: <Interface Buffersize>,%d)\n",
+          TR_BUFFER_AUTO_MAX_DEF);
+  fprintf(fp, "                   (TCP server or TCP client only)\n");
+  fprintf(fp, "  -g,--hugepages              Back the buffers with huge "
+              "pages (reserved\n");
+  fprintf(fp, "                              ones if they fit, else "
+              "transparent)\n");
+  fprintf(fp, "  -z,--zerocopy[=<size>]      Send writes of at least <size> "
+              "bytes with\n");
+  fprintf(fp, "                              MSG_ZEROCOPY (default: %d, TCP "
+              "server or\n",
+          ZEROCOPY_SIZE_DEF);
+  fprintf(fp, "                              TCP client)\n");
+  fprintf(fp, "\n");
+  fprintf(fp, "  -Y,--train-dictionary=<file>\n");
+  fprintf(fp, "                              Sample packets sent to the "
+              "interface and\n");
+  fprintf(fp, "                              write a dictionary for -D, "
+              "then exit\n");
+  fprintf(fp, "  -S,--train-samples=<n>      Packets to sample (default: "
+              "%d)\n",
+          DICT_SAMPLES_DEF);
   fprintf(fp, "\n");
   fprintf(fp, "  -v,--version                Print version\n");
   fprintf(fp, "  -h,--help                   Print this usage\n");
@@ -159,33 +369,38 @@ int change_ifflags(int sock, const char *ifname, int flags_clear,
   return 0;
 }
 
-int create_tunif(int sock, char *ifname, enum ifmode ifmode) {
-  int fd;
-  struct ifreq ifr;
+static int set_tunoffload(int fd) {
+  int vnet_hdr_sz = sizeof(struct virtio_net_hdr);
+  unsigned offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
 
-  if ((fd = open("/dev/net/tun", O_RDWR)) < 0) {
-    perror("open");
+  if (ioctl(fd, TUNSETVNETHDRSZ, &vnet_hdr_sz) < 0) {
+    perror("Cannot set virtio header size");
     return -1;
   }
-  if (getuid() != geteuid()) {
-    if (ioctl(fd, TUNSETOWNER, getuid()) < 0) {
-      perror("Error while setting tunnel owner");
-      return -1;
-    }
+
+#if defined(TUN_F_USO4) && defined(TUN_F_USO6)
+  // UDP segmentation offload needs Linux 6.2 or later
+  if (ioctl(fd, TUNSETOFFLOAD, offload | TUN_F_USO4 | TUN_F_USO6) == 0) {
+    return 0;
   }
-  if (getgid() != getegid()) {
-    if (ioctl(fd, TUNSETGROUP, getgid()) < 0) {
-      perror("Error while setting tunnel group");
-      return -1;
-    }
-    if (setgid(getgid()) < 0) {
-      perror("Error while setting group id");
-      return -1;
-    }
+#endif
+  if (ioctl(fd, TUNSETOFFLOAD, offload) < 0) {
+    perror("Cannot set interface offload");
+    return -1;
   }
-  if (getuid() != geteuid()) {
-    if (setuid(getuid()) < 0) {
-      perror("Error while setting user id");
+
+  return 0;
+}
+
+int create_tunif(int sock, char *ifname, enum ifmode ifmode, int offload,
+                 int *fds, int nqueues) {
+  struct ifreq ifr;
+  int i;
+
+  // every queue has to be opened before dropping privileges
+  for (i = 0; i < nqueues; i++) {
+    if ((fds[i] = open("/dev/net/tun", O_RDWR)) < 0) {
+      perror("open");
       return -1;
     }
   }
@@ -206,19 +421,75 @@ int create_tunif(int sock, char *ifname, enum ifmode ifmode) {
   ifr.ifr_flags |= IFF_NO_PI;
 #endif
 
+  if (nqueues > 1) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+
+  if (offload) {
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
+
   if (ifname) {
     strncpy(ifr.ifr_name, ifname, IFNAMSIZ);
   }
-  if (ioctl(fd, TUNSETIFF, (void *)&ifr) < 0) {
-    perror("Error while creating tunnel interface");
-    return -1;
+  for (i = 0; i < nqueues; i++) {
+    // the kernel fills in the name, so later queues attach to the same device
+    if (ioctl(fds[i], TUNSETIFF, (void *)&ifr) < 0) {
+      perror("Error while creating tunnel interface");
+      return -1;
+    }
+    if (i == 0 && offload && set_tunoffload(fds[i]) < 0) {
+      return -1;
+    }
+    if (i == 0 && getuid() != geteuid()) {
+      if (ioctl(fds[i], TUNSETOWNER, getuid()) < 0) {
+        perror("Error while setting tunnel owner");
+        return -1;
+      }
+    }
+    if (i == 0 && getgid() != getegid()) {
+      if (ioctl(fds[i], TUNSETGROUP, getgid()) < 0) {
+        perror("Error while setting tunnel group");
+        return -1;
+      }
+    }
+  }
+
+  if (getgid() != getegid()) {
+    if (setgid(getgid()) < 0) {
+      perror("Error while setting group id");
+      return -1;
+    }
+  }
+  if (getuid() != geteuid()) {
+    if (setuid(getuid()) < 0) {
+      perror("Error while setting user id");
+      return -1;
+    }
   }
 
   if (change_ifflags(sock, ifr.ifr_name, 0, IFF_UP | IFF_RUNNING) < 0) {
     return -1;
   }
 
-  return fd;
+  if (ifname) {
+    strncpy(ifname, ifr.ifr_name, IFNAMSIZ);
+  }
+
+  return 0;
+}
+
+int set_tunqueue(int fd, int attach) {
+  struct ifreq ifr;
+
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+  if (ioctl(fd, TUNSETQUEUE, (void *)&ifr) < 0) {
+    perror(attach ? "Cannot attach tunnel queue" : "Cannot detach tunnel queue");
+    return -1;
+  }
+
+  return 0;
 }
 
 int get_ifindex(int sock, const char *ifname) {
@@ -498,23 +769,28 @@ int set_ifaddr(int sock, const char *ifname, const char *addrstr) {
   return 0;
 }
 
-int init_if(struct tuncat_commandline_options *optsp) {
+int init_if(struct tuncat_commandline_options *optsp, int *tunfds) {
   int sock = socket(PF_INET, SOCK_DGRAM, 0);
   if (sock == -1) {
     perror("socket");
-    return EXIT_FAILURE;
+    return -1;
   }
 
-  int tunfd = create_tunif(sock, optsp->ifname, optsp->ifmode);
-  if (tunfd == -1) {
-    return EXIT_FAILURE;
+  char tunname[IFNAMSIZ + 1];
+  memset(tunname, 0, sizeof(tunname));
+  if (optsp->ifname != NULL) {
+    strncpy(tunname, optsp->ifname, IFNAMSIZ);
+  }
+
+  if (create_tunif(sock, tunname, optsp->ifmode, optsp->offload, tunfds,
+                   optsp->queues ?: 1) == -1) {
+    return -1;
   }
-  const char *tunname = optsp->ifname;
 
   if (optsp->brname == NULL) {
     if (optsp->addr != NULL) {
-      if (set_ifaddr(sock, optsp->ifname, optsp->addr) < 0) {
-        return EXIT_FAILURE;
+      if (set_ifaddr(sock, tunname, optsp->addr) < 0) {
+        return -1;
       }
     }
 
@@ -525,7 +801,7 @@ int init_if(struct tuncat_commandline_options *optsp) {
     if (brindex == 0) {
       brindex = create_bridge(sock, optsp->brname);
       if (brindex == -1) {
-        return EXIT_FAILURE;
+        return -1;
       }
       brname = optsp->brname;
       atexit(cleanbr);
@@ -537,17 +813,17 @@ int init_if(struct tuncat_commandline_options *optsp) {
     }
 
     if (change_ifflags(sock, optsp->brname, 0, IFF_UP | IFF_RUNNING) < 0) {
-      return EXIT_FAILURE;
+      return -1;
     }
 
     if (optsp->addr != NULL) {
       if (set_ifaddr(sock, optsp->brname, optsp->addr) < 0) {
-        return EXIT_FAILURE;
+        return -1;
       }
     }
 
     if (add_bridge_member(sock, optsp->brname, tunname) < 0) {
-      return EXIT_FAILURE;
+      return -1;
     }
 
     if (optsp->braddifname) {
@@ -561,7 +837,7 @@ int init_if(struct tuncat_commandline_options *optsp) {
           *ifn = '\0';
         }
         if (add_bridge_member(sock, brname, ifname) < 0) {
-          return EXIT_FAILURE;
+          return -1;
         }
         if (!ifn) {
           break;
@@ -573,376 +849,3053 @@ int init_if(struct tuncat_commandline_options *optsp) {
     close(sock);
   }
 
-  return tunfd;
-}
-
-static size_t read_packet_size(const char *buf) {
-  return ntohs(*(uint16_t *)buf);
+  return 0;
 }
 
-static void write_packet_size(char *buf, size_t size) {
-  assert(size <= 65535);
-  *(uint16_t *)buf = htons(size);
-}
+// ---------------------------------------------------
+// Interface Read Buffer -> Transfer Send Buffer
+// ---------------------------------------------------
+
+// encode a payload (one packet, or a block of frames in batch mode) as a
+// frame into the transfer send buffer; returns 1 if it was written (or
+// dropped as too large for a datagram), 0 if the buffer cannot store it
+// yet, or -1 on fatal errors
+static int put_tr_frame(struct forward_ctx *fw, const char *payload,
+                        size_t payload_size, const char *vnet_hdr, int flags,
+                        int compress, uint32_t flow, uint64_t now) {
+  const size_t tr_hdr_size = fw->tr_frame_hdr_size;
+
+  // calculate writing capacity of transfer send buffer
+  const size_t tr_send_buf_writable_size = ringbuf_space(&fw->tr_send_buf);
+  char *tr_send_frame = ringbuf_tail(&fw->tr_send_buf);
+
+  // calculate required size of transfer send buffer
+  size_t tr_send_buf_required_size = tr_hdr_size + payload_size;
+  if (compress) {
+    // calculate MAX required size of transfer send buffer with compression
+    tr_send_buf_required_size =
+        tr_hdr_size + codec_max_compressed_length(&fw->tx_codec, payload_size);
+  }
 
-int forward_packets(int argc, char *const argv[],
-                    struct tuncat_commandline_options *optsp, int tunfd,
-                    int tr_ifd, int tr_ofd) {
-  (void)argc;
-  (void)argv;
+  // brake if the transfer send buffer cannot store the packet
+  if (tr_send_buf_writable_size < tr_send_buf_required_size)
+    return 0;
 
-  enum compflag compflag = optsp->compflag;
+  size_t tr_send_packet_size = payload_size;
 
-  size_t max_frame_size = optsp->max_frame_size ?: IF_MAX_FRAME_SIZE_DEF;
+  if (compress) {
+    // read from interface read buffer, compress and write packet
 
-  const size_t if_read_buf_size = optsp->ifbuffer_size ?: 2 * max_frame_size;
-  const size_t if_write_buf_size = optsp->ifbuffer_size ?: 2 * max_frame_size;
-  const size_t tr_recv_buf_size = optsp->trbuffer_size ?: if_write_buf_size;
-  const size_t tr_send_buf_size = optsp->trbuffer_size ?: if_read_buf_size;
+    size_t compressed_size = tr_send_buf_writable_size - tr_hdr_size;
 
-  char if_read_buf[if_read_buf_size];
-  char if_write_buf[if_write_buf_size];
-  char tr_recv_buf[tr_recv_buf_size];
-  char tr_send_buf[tr_send_buf_size];
+    // compressing the packet
+    if (codec_compress(&fw->tx_codec, payload, payload_size,
+                       &tr_send_frame[tr_hdr_size], &compressed_size) == -1) {
+      fprintf(stderr, "Fatal: %s compression failed\n",
+              fw->tx_codec.ops->name);
+      return -1;
+    }
 
-  const int if_read_fd = tunfd;
-  const int if_write_fd = tunfd;
+    // in adaptive mode, keep it only if it saves enough; with a flags byte
+    // it is stored as well if it grew beyond the frame size
+    if ((fw->compflag == COMPFLAG_COMPRESS && fw->frame_flags_len == 0) ||
+        ((fw->compflag == COMPFLAG_COMPRESS ||
+          compressed_size * 100 <= payload_size * fw->optsp->compress_ratio) &&
+         compressed_size <= IF_MAX_FRAME_SIZE_MAX)) {
+      tr_send_packet_size = compressed_size;
+      flags |= FRAME_FLAG_COMPRESSED;
+    } else if (fw->incompressible != NULL) {
+      flow_cache_set(fw->incompressible, flow,
+                     now + fw->optsp->incompressible_hold);
+    }
+  }
 
-  size_t if_read_buf_pos = 0;
-  size_t if_write_buf_pos = 0;
-  size_t tr_recv_buf_pos = 0;
-  size_t tr_send_buf_pos = 0;
+  // a frame that does not fit a datagram could never be sent; it is
+  // consumed without being written
+  if (fw->datagram && tr_hdr_size + tr_send_packet_size > UDP_PAYLOAD_MAX) {
+    fw->dgram_oversize++;
+    fprintf(stderr, "Warn: Dropped an oversize frame for a datagram (%zu "
+                    "bytes, %lu so far)\n",
+            tr_send_packet_size, fw->dgram_oversize);
+    return 1;
+  }
 
-  if (fcntl(tunfd, F_SETFL, O_NONBLOCK) == -1) {
-    perror("fcntl");
-    return EXIT_FAILURE;
+  if (!(flags & FRAME_FLAG_COMPRESSED)) {
+    // copy packet from interface read buffer to transfer send buffer
+    memcpy(&tr_send_frame[tr_hdr_size], payload, payload_size);
   }
-  if (fcntl(tr_ifd, F_SETFL, O_NONBLOCK) == -1) {
-    perror("fcntl");
-    return EXIT_FAILURE;
+
+  // write packet size, flags and copy the virtio header as is
+  write_packet_size(tr_send_frame, tr_send_packet_size);
+  if (fw->frame_flags_len > 0) {
+    tr_send_frame[IF_FRAME_SIZE_LEN] = flags;
   }
-  if (tr_ifd != tr_ofd && fcntl(tr_ofd, F_SETFL, O_NONBLOCK) == -1) {
-    perror("fcntl");
-    return EXIT_FAILURE;
+  if (vnet_hdr != NULL) {
+    memcpy(&tr_send_frame[IF_FRAME_SIZE_LEN + fw->frame_flags_len], vnet_hdr,
+           fw->vnet_hdr_len);
+  } else {
+    memset(&tr_send_frame[IF_FRAME_SIZE_LEN + fw->frame_flags_len], 0,
+           fw->vnet_hdr_len);
   }
 
-  // Transfer Information
-  write_packet_size(&tr_send_buf[tr_send_buf_pos], 0);
-  tr_send_buf_pos += IF_FRAME_SIZE_LEN;
-  tr_send_buf[tr_send_buf_pos++] = optsp->ifmode;
-  tr_send_buf[tr_send_buf_pos++] = optsp->compflag;
-  write_packet_size(&tr_send_buf[tr_send_buf_pos], optsp->max_frame_size);
-  tr_send_buf_pos += IF_FRAME_SIZE_LEN;
+  // move the tail of transfer send buffer
+  ringbuf_produce(&fw->tr_send_buf, tr_hdr_size + tr_send_packet_size);
+  return 1;
+}
 
-  for (;;) {
-    int nfds;
-    fd_set rfds, wfds;
-    nfds = 0;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
+int forward_packet_to_tr(struct forward_ctx *fw, const char *if_frame,
+                         uint64_t now) {
+  const size_t hdr_size = fw->frame_hdr_size;
+  const size_t packet_size = read_packet_size(if_frame);
+
+  // in adaptive mode, skip flows that recently did not compress
+  int compress = fw->compflag == COMPFLAG_COMPRESS ||
+                 fw->compflag == COMPFLAG_ADAPTIVE;
+  uint32_t flow = 0;
+  if (compress && fw->incompressible != NULL) {
+    flow = flow_hash(fw->optsp->ifmode, &if_frame[hdr_size], packet_size);
+    compress = !flow_cache_hit(fw->incompressible, flow, now);
+  }
 
-    // ---------------------------------------------------
-    // Interface Read Buffer -> Transfer Send Buffer
-    // ---------------------------------------------------
-    while (1) {
+  return put_tr_frame(fw, &if_frame[hdr_size], packet_size,
+                      &if_frame[IF_FRAME_SIZE_LEN], 0, compress, flow, now);
+}
 
-      // brake if the packet size cannot read from interface read buffer
-      if (if_read_buf_pos < IF_FRAME_SIZE_LEN)
+// batch mode: the frames waiting in the interface read buffer, up to the
+// batch size, are compressed together as one block. The block keeps the
+// framing of the interface buffers (size, virtio header, packet), so the
+// receiver decodes it straight into its interface write buffer.
+static int forward_batch_to_tr(struct forward_ctx *fw) {
+  const size_t hdr_size = fw->frame_hdr_size;
+  const size_t batch_size = fw->batch_size;
+  const uint64_t now = now_usec();
+
+  fw->batch_deadline = 0;
+
+  while (1) {
+    const size_t if_read_buf_used = ringbuf_used(&fw->if_read_buf);
+    const char *if_read_frame = ringbuf_data(&fw->if_read_buf);
+    size_t block_size = 0;
+    int nframes = 0;
+    int full = 0;
+
+    // collect the complete frames that fit the block
+    while (if_read_buf_used - block_size >= hdr_size) {
+      const size_t size =
+          hdr_size + read_packet_size(&if_read_frame[block_size]);
+      if (if_read_buf_used - block_size < size)
+        break;
+      if (nframes > 0 && block_size + size > batch_size) {
+        full = 1;
         break;
+      }
+      block_size += size;
+      nframes++;
+    }
 
-      // read packet size from interface read buffer
-      const size_t if_read_packet_size = read_packet_size(if_read_buf);
+    if (nframes == 0)
+      break;
 
-      // brake if the packet content cannot read from interface read buffer
-      if (if_read_buf_pos < IF_FRAME_SIZE_LEN + if_read_packet_size)
-        break;
+    // wait for more frames until the oldest one reached the flush latency
+    if (!full && block_size + hdr_size <= batch_size &&
+        fw->optsp->batch_latency > 0 &&
+        now < fw->batch_since + fw->optsp->batch_latency) {
+      fw->batch_deadline = fw->batch_since + fw->optsp->batch_latency;
+      break;
+    }
 
-      // calculate writing capacity of transfer send buffer
-      const size_t tr_send_buf_writable_size =
-          tr_send_buf_size - tr_send_buf_pos;
+    // a single frame goes out as it is, without the block around it
+    int r;
+    if (nframes == 1) {
+      r = forward_packet_to_tr(fw, if_read_frame, now / 1000);
+    } else {
+      r = put_tr_frame(fw, if_read_frame, block_size, NULL, FRAME_FLAG_BATCH,
+                       1, 0, 0);
+    }
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break;
 
-      // calculate required size of transfer send buffer
-      size_t tr_send_buf_required_size =
-          IF_FRAME_SIZE_LEN + if_read_packet_size;
-      if (compflag == COMPFLAG_COMPRESS) {
-        // calculate MAX required size of transfer send buffer with compression
-        tr_send_buf_required_size =
-            IF_FRAME_SIZE_LEN +
-            snappy_max_compressed_length(if_read_packet_size);
-      }
+    // move the head of interface read buffer; frames left behind arrived
+    // after the oldest one, so its time still bounds their wait, and an
+    // empty buffer takes the time of the next frame read
+    ringbuf_consume(&fw->if_read_buf, block_size);
+  }
 
-      // brake if the transfer send buffer cannot store the packet
-      if (tr_send_buf_writable_size < tr_send_buf_required_size)
-        break;
+  return 0;
+}
 
-      if (compflag == COMPFLAG_COMPRESS) {
-        // read from interface read buffer, compress and write packet
+int forward_if_to_tr(struct forward_ctx *fw) {
+  const size_t hdr_size = fw->frame_hdr_size;
 
-        size_t compressed_size =
-            tr_send_buf_size - (IF_FRAME_SIZE_LEN + tr_send_buf_pos);
+  // the queues are served as the transfer write drains them, the
+  // frames of pass-through are written as they are
+  if (fw->prio || fw->aqm || fw->passthrough) {
+    return 0;
+  }
 
-        // compressing the packet
-        if (snappy_compress(&if_read_buf[IF_FRAME_SIZE_LEN],
-                            if_read_packet_size,
-                            &tr_send_buf[IF_FRAME_SIZE_LEN + tr_send_buf_pos],
-                            &compressed_size) != SNAPPY_OK) {
-          fprintf(stderr, "Fatal: snappy_compress failed\n");
-          return EXIT_FAILURE;
-        }
+  if (fw->batch_size > 0) {
+    return forward_batch_to_tr(fw);
+  }
 
-        // write compressed packet size
-        write_packet_size(&tr_send_buf[tr_send_buf_pos], compressed_size);
+  const uint64_t now = fw->incompressible != NULL ? now_msec() : 0;
 
-        // move the position of transfer send buffer
-        tr_send_buf_pos += IF_FRAME_SIZE_LEN + compressed_size;
+  while (1) {
+    const size_t if_read_buf_used = ringbuf_used(&fw->if_read_buf);
+    const char *if_read_frame = ringbuf_data(&fw->if_read_buf);
 
-      } else if (tr_send_buf_writable_size >= tr_send_buf_required_size) {
+    // brake if the packet size cannot read from interface read buffer
+    if (if_read_buf_used < hdr_size)
+      break;
 
-        // copy packet from interface read buffer to transfer send buffer
-        memcpy(&tr_send_buf[tr_send_buf_pos], if_read_buf,
-               IF_FRAME_SIZE_LEN + if_read_packet_size);
+    // read packet size from interface read buffer
+    const size_t if_read_packet_size = read_packet_size(if_read_frame);
 
-        // move the position of transfer send buffer
-        tr_send_buf_pos += IF_FRAME_SIZE_LEN + if_read_packet_size;
-      }
+    // brake if the packet content cannot read from interface read buffer
+    if (if_read_buf_used < hdr_size + if_read_packet_size)
+      break;
 
-      // move the following data of interface read buffer
-      memmove(if_read_buf,
-              &if_read_buf[IF_FRAME_SIZE_LEN + if_read_packet_size],
-              if_read_buf_pos - (IF_FRAME_SIZE_LEN + if_read_packet_size));
-      // ^ TODO: should be minimize buffer move
+    const int r = forward_packet_to_tr(fw, if_read_frame, now);
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break;
 
-      // move the position of interface read buffer
-      if_read_buf_pos -= IF_FRAME_SIZE_LEN + if_read_packet_size;
-    }
+    // move the head of interface read buffer
+    ringbuf_consume(&fw->if_read_buf, hdr_size + if_read_packet_size);
+  }
 
-    // ---------------------------------------------------
-    // Transfer Recv Buffer -> Interface Write Buffer
-    // ---------------------------------------------------
-    while (1) {
+  return 0;
+}
 
-      // brake if the packet size cannot read from transfer receive buffer
-      if (tr_recv_buf_pos < IF_FRAME_SIZE_LEN)
-        break;
+// ---------------------------------------------------
+// Priority Queues -> Transfer Send Buffer
+// ---------------------------------------------------
 
-      // read packet size from transfer receive buffer
-      const size_t tr_recv_packet_size = read_packet_size(tr_recv_buf);
+static const char *const prio_class_names[FLOW_CLASSES] = {
+    "interactive",
+    "default",
+    "bulk",
+};
 
-      // operate information packet
-      if (tr_recv_packet_size == 0) {
-        // 4 byte of transfer information
-        if (tr_recv_buf_pos < IF_FRAME_SIZE_LEN + 4)
-          break;
-        const enum ifmode received_ifmode = tr_recv_buf[IF_FRAME_SIZE_LEN];
-        const enum compflag received_compflag =
-            tr_recv_buf[IF_FRAME_SIZE_LEN + 1];
-        const size_t received_max_frame_size =
-            read_packet_size(&tr_recv_buf[IF_FRAME_SIZE_LEN + 2]);
-        memmove(tr_recv_buf, &tr_recv_buf[IF_FRAME_SIZE_LEN + 4],
-                tr_recv_buf_pos - (IF_FRAME_SIZE_LEN + 4));
-        tr_recv_buf_pos -= IF_FRAME_SIZE_LEN + 4;
-
-        // TODO: check received information
-        (void)received_ifmode;
-        (void)received_compflag;
-        (void)received_max_frame_size;
+// size of the complete frame at the head of a class queue, 0 if none
+static size_t prio_head(const struct forward_ctx *fw, int q) {
+  const struct ringbuf *rb = fw->prio_queue[q];
+  const size_t used = ringbuf_used(rb);
 
-        continue;
-      }
+  if (used < fw->frame_hdr_size)
+    return 0;
+  const size_t size = fw->frame_hdr_size + read_packet_size(ringbuf_data(rb));
+  return used >= size ? size : 0;
+}
 
-      // brake if the packet content cannot read from transfer receive buffer
-      if (tr_recv_buf_pos < IF_FRAME_SIZE_LEN + tr_recv_packet_size)
-        break;
+static int prio_pending(const struct forward_ctx *fw) {
+  int q;
 
-      // calculate writing capacity of interface write buffer
-      const size_t if_write_buf_writable_size =
-          if_write_buf_size - if_write_buf_pos;
-
-      // calculate required size of interface write buffer
-      size_t if_write_buf_required_size =
-          IF_FRAME_SIZE_LEN + tr_recv_packet_size;
-
-      if (compflag == COMPFLAG_COMPRESS) {
-        // calculate required size of interface write buffer with compression
-        size_t uncompressed_size;
-        if (snappy_uncompressed_length(&tr_recv_buf[IF_FRAME_SIZE_LEN],
-                                       tr_recv_packet_size,
-                                       &uncompressed_size) != SNAPPY_OK) {
-          fprintf(stderr, "Warn: Invalid transfer input stream\n");
-          tr_recv_buf_pos -= IF_FRAME_SIZE_LEN + tr_recv_packet_size;
-          continue;
-        }
-        if_write_buf_required_size = IF_FRAME_SIZE_LEN + uncompressed_size;
+  for (q = 0; q < FLOW_CLASSES; q++) {
+    if (prio_head(fw, q) > 0)
+      return 1;
+  }
+  return 0;
+}
 
-        // brake if the interface write buffer cannot store the packet
-        if (if_write_buf_writable_size < if_write_buf_required_size)
-          break;
+// the class to send from next, or -1 if all are empty
+static int prio_pick(struct forward_ctx *fw) {
+  int q, empty = 0;
 
-        // decompress the packet
-        if (snappy_uncompress(
-                &tr_recv_buf[IF_FRAME_SIZE_LEN], tr_recv_packet_size,
-                &if_write_buf[IF_FRAME_SIZE_LEN + if_write_buf_pos],
-                &uncompressed_size) != SNAPPY_OK) {
-          fprintf(stderr, "Warn: Invalid transfer input stream\n");
+  if (fw->prio == PRIOMODE_STRICT) {
+    for (q = 0; q < FLOW_CLASSES; q++) {
+      if (prio_head(fw, q) > 0)
+        return q;
+    }
+    return -1;
+  }
 
-          // waste the packet
-          tr_recv_buf_pos -= IF_FRAME_SIZE_LEN + tr_recv_packet_size;
-          continue;
-        }
+  // deficit round robin: a class sends while its deficit covers the head
+  // frame, then the next class gets its turn and its quantum
+  for (;;) {
+    q = fw->prio_next;
+    const size_t head = prio_head(fw, q);
+    if (head == 0) {
+      fw->prio_deficit[q] = 0;
+      if (++empty == FLOW_CLASSES)
+        return -1;
+    } else if (fw->prio_deficit[q] >= (long)head) {
+      return q;
+    } else {
+      empty = 0;
+    }
+    fw->prio_next = (q + 1) % FLOW_CLASSES;
+    fw->prio_deficit[fw->prio_next] +=
+        (long)fw->optsp->prio_weights[fw->prio_next] * PRIO_QUANTUM;
+  }
+}
 
-        // write uncompressed packet size
-        write_packet_size(&if_write_buf[if_write_buf_pos], uncompressed_size);
+// top up the transfer send buffer from the class queues; a shallow send
+// buffer is what lets a later interactive packet overtake queued bulk
+static int forward_prio_to_tr(struct forward_ctx *fw) {
+  const uint64_t now = fw->incompressible != NULL ? now_msec() : 0;
 
-        // move the position of interface write buffer
-        if_write_buf_pos += IF_FRAME_SIZE_LEN + uncompressed_size;
-      } else {
+  while (ringbuf_used(&fw->tr_send_buf) < QUEUE_SEND_BACKLOG) {
+    const int q = prio_pick(fw);
+    if (q == -1)
+      break;
 
-        // write packet from transfer receive buffer to interface write buffer
-        memcpy(&if_write_buf[if_write_buf_pos], tr_recv_buf,
-               IF_FRAME_SIZE_LEN + tr_recv_packet_size);
+    struct ringbuf *rb = fw->prio_queue[q];
+    const char *frame = ringbuf_data(rb);
+    const size_t packet_size = read_packet_size(frame);
+    const int r = forward_packet_to_tr(fw, frame, now);
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break;
 
-        // move the position of interface write buffer
-        if_write_buf_pos += IF_FRAME_SIZE_LEN + tr_recv_packet_size;
-      }
+    ringbuf_consume(rb, fw->frame_hdr_size + packet_size);
+    fw->prio_deficit[q] -= fw->frame_hdr_size + packet_size;
+    fw->prio_stats[q].packets++;
+    fw->prio_stats[q].bytes += packet_size;
+  }
+  return 0;
+}
+
+// store the frame just read to the tail of the interface read buffer in
+// the queue of its class; the default class stays where it is
+static void prio_enqueue(struct forward_ctx *fw, const char *frame) {
+  const size_t hdr_size = fw->frame_hdr_size;
+  const size_t packet_size = read_packet_size(frame);
+  const size_t size = hdr_size + packet_size;
+  const enum flow_class q =
+      flow_classify(fw->optsp->ifmode, &frame[hdr_size], packet_size);
+  struct ringbuf *rb = fw->prio_queue[q];
+
+  // the default class is the read buffer, the frame may be read into it
+  if (frame == ringbuf_tail(rb)) {
+    ringbuf_produce(rb, size);
+    return;
+  }
+  if (ringbuf_space(rb) < size) {
+    fw->prio_stats[q].drops++;
+    return;
+  }
+  memcpy(ringbuf_tail(rb), frame, size);
+  ringbuf_produce(rb, size);
+}
 
-      // move the following data of transfer receive buffer
-      memmove(tr_recv_buf,
-              &tr_recv_buf[IF_FRAME_SIZE_LEN + tr_recv_packet_size],
-              tr_recv_buf_pos - (IF_FRAME_SIZE_LEN + tr_recv_packet_size));
+// ---------------------------------------------------
+// AQM Queues -> Transfer Send Buffer
+// ---------------------------------------------------
 
-      // move the position of transfer receive buffer
-      tr_recv_buf_pos -= IF_FRAME_SIZE_LEN + tr_recv_packet_size;
-    }
+static int aqm_pending(const struct forward_ctx *fw) {
+  return fw->aqm_pending != NULL || fw->aqm_queue.backlog > 0;
+}
 
-    // ---------------------------------------------------
-    // Select and I/O
-    // ---------------------------------------------------
-    if (tr_recv_buf_pos < tr_send_buf_size) {
-      FD_SET(tr_ifd, &rfds);
-      if (nfds <= tr_ifd)
-        nfds = tr_ifd + 1;
-    }
+// the AQM drops a packet by marking it instead if it is ECN capable
+static int aqm_mark(void *arg, char *frame, size_t size) {
+  const struct forward_ctx *fw = arg;
+  const size_t hdr_size = fw->frame_hdr_size;
 
-    if (tr_send_buf_pos > 0) {
-      FD_SET(tr_ofd, &wfds);
-      if (nfds <= tr_ofd)
-        nfds = tr_ofd + 1;
-    }
+  return flow_set_ce(fw->optsp->ifmode, &frame[hdr_size], size - hdr_size);
+}
 
-    if (if_read_buf_pos + IF_FRAME_SIZE_LEN + max_frame_size <
-        if_read_buf_size) {
-      FD_SET(if_read_fd, &rfds);
-      if (nfds <= if_read_fd)
-        nfds = if_read_fd + 1;
-    }
+static int forward_aqm_to_tr(struct forward_ctx *fw) {
+  const uint64_t now = fw->incompressible != NULL ? now_msec() : 0;
 
-    if (if_write_buf_pos >= IF_FRAME_SIZE_LEN &&
-        if_write_buf_pos >=
-            IF_FRAME_SIZE_LEN + read_packet_size(if_write_buf)) {
-      FD_SET(if_write_fd, &wfds);
-      if (nfds <= if_write_fd)
-        nfds = if_write_fd + 1;
-    }
+  while (ringbuf_used(&fw->tr_send_buf) < QUEUE_SEND_BACKLOG) {
+    if (fw->aqm_pending == NULL &&
+        (fw->aqm_pending = aqm_dequeue(&fw->aqm_queue, now_usec())) == NULL)
+      break;
 
-    if (nfds == 0) {
-      fprintf(
-          stderr, "(tr_ipos: %zu, tr_opos: %zu, if_ipos: %zu, if_opos: %zu)\n",
-          tr_recv_buf_pos, tr_send_buf_pos, if_read_buf_pos, if_write_buf_pos);
-      return EXIT_SUCCESS;
-    }
+    const int r = forward_packet_to_tr(fw, fw->aqm_pending->frame, now);
+    if (r == -1)
+      return -1;
+    if (r == 0)
+      break;
 
-    if ((nfds = select(nfds, &rfds, &wfds, NULL, NULL)) == -1) {
-      perror("select");
-      return EXIT_FAILURE;
-    }
+    aqm_release(&fw->aqm_queue, fw->aqm_pending);
+    fw->aqm_pending = NULL;
+  }
+  return 0;
+}
 
-    // ---------------------------------------------------
-    // Transfer Recv from Channel -> Transfer Recv Buffer
-    // ---------------------------------------------------
-    if (FD_ISSET(tr_ifd, &rfds)) {
-      ssize_t rsiz = read(tr_ifd, tr_recv_buf + tr_recv_buf_pos,
-                          tr_recv_buf_size - tr_recv_buf_pos);
-      if (rsiz == -1) {
-        if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK ||
-            errno == EINPROGRESS) {
-          continue;
-        }
-        perror("read");
-        return EXIT_FAILURE;
-      }
-      if (rsiz == 0) {
-        return EXIT_SUCCESS;
-      }
-      tr_recv_buf_pos += rsiz;
-      continue;
-    }
+// queue the frame just read to the tail of the interface read buffer,
+// which is left as it is
+static void aqm_enqueue_frame(struct forward_ctx *fw, const char *frame) {
+  const size_t hdr_size = fw->frame_hdr_size;
+  const size_t packet_size = read_packet_size(frame);
 
-    // ---------------------------------------------------
-    // Interface Write Buffer -> Interface Write to Device
-    // ---------------------------------------------------
-    if (FD_ISSET(if_write_fd, &wfds)) {
-      size_t packet_size = read_packet_size(if_write_buf);
-
-      ssize_t wsiz =
-          write(if_write_fd, &if_write_buf[IF_FRAME_SIZE_LEN], packet_size);
-      if (wsiz == -1) {
-        if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK ||
-            errno == EINPROGRESS) {
-          continue;
-        }
-        perror("write");
-        return EXIT_FAILURE;
-      }
-      if_write_buf_pos -= IF_FRAME_SIZE_LEN + wsiz;
-      memmove(if_write_buf, &if_write_buf[IF_FRAME_SIZE_LEN + wsiz],
-              if_write_buf_pos);
-      continue;
-    }
+  aqm_enqueue(&fw->aqm_queue,
+              flow_hash(fw->optsp->ifmode, &frame[hdr_size], packet_size),
+              frame, hdr_size + packet_size, now_usec());
+}
 
-    // ---------------------------------------------------
-    // Interface Read from Device -> Interface Read Buffer
-    // ---------------------------------------------------
-    if (FD_ISSET(if_read_fd, &rfds)) {
-      ssize_t rsiz = read(if_read_fd, if_read_buf + IF_FRAME_SIZE_LEN,
-                          if_read_buf_size - IF_FRAME_SIZE_LEN);
-      if (rsiz == -1) {
-        if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK ||
-            errno == EINPROGRESS) {
-          continue;
-        }
-        perror("read");
-        return EXIT_FAILURE;
-      }
-      if (rsiz == 0) {
-        return EXIT_SUCCESS;
-      }
-      write_packet_size(if_read_buf, rsiz);
-      if_read_buf_pos += IF_FRAME_SIZE_LEN + rsiz;
-      continue;
-    }
+// ---------------------------------------------------
+// Queue Disciplines
+// ---------------------------------------------------
 
-    // ---------------------------------------------------
-    // Transfer Send Buffer -> Transfer Send to Channel
-    // ---------------------------------------------------
-    if (FD_ISSET(tr_ofd, &wfds)) {
-      ssize_t wsiz;
+// packets waiting in the priority or AQM queues
+int queue_pending(const struct forward_ctx *fw) {
+  return (fw->prio && prio_pending(fw)) || (fw->aqm && aqm_pending(fw));
+}
 
-      wsiz = write(tr_ofd, tr_send_buf, tr_send_buf_pos);
-      if (wsiz == -1) {
-        if (errno == EAGAIN || errno == EINTR || errno == EWOULDBLOCK ||
-            errno == EINPROGRESS) {
-          continue;
-        }
-        perror("write");
-        return EXIT_FAILURE;
-      }
-      tr_send_buf_pos -= wsiz;
-      if (tr_send_buf_pos > 0) {
-        memmove(tr_send_buf, tr_send_buf + wsiz, tr_send_buf_pos);
-      }
-      continue;
-    }
+// take the frame just read to the tail of the interface read buffer;
+// returns 0 if there is no queue discipline and it stays to be produced
+int queue_enqueue(struct forward_ctx *fw, const char *frame) {
+  if (fw->prio) {
+    prio_enqueue(fw, frame);
+    return 1;
   }
+  if (fw->aqm) {
+    aqm_enqueue_frame(fw, frame);
+    return 1;
+  }
+  return 0;
+}
+
+int forward_queue_to_tr(struct forward_ctx *fw) {
+  if (fw->prio)
+    return forward_prio_to_tr(fw);
+  if (fw->aqm)
+    return forward_aqm_to_tr(fw);
+  return 0;
+}
+
+static void print_prio_stats(const struct forward_ctx *fw, const char *name) {
+  int q;
+
+  fprintf(stderr, "%s priority queues:\n", name);
+  for (q = 0; q < FLOW_CLASSES; q++) {
+    fprintf(stderr, "  %-11s %lu packets, %lu bytes, %lu dropped, %zu "
+                    "bytes queued\n",
+            prio_class_names[q], fw->prio_stats[q].packets,
+            fw->prio_stats[q].bytes, fw->prio_stats[q].drops,
+            ringbuf_used(fw->prio_queue[q]));
+  }
+}
+
+// SIGUSR1 asks every forward context to print its counters once
+volatile sig_atomic_t stats_requests;
+
+static void request_stats(int sig) {
+  (void)sig;
+  stats_requests++;
+}
+
+static void print_aqm_stats(const struct forward_ctx *fw, const char *name) {
+  const struct aqm *aqm = &fw->aqm_queue;
+
+  fprintf(stderr, "%s AQM: %lu packets, %lu bytes, %lu dropped (%lu over "
+                  "limit), %lu marked, %zu bytes queued\n",
+          name, aqm->packets, aqm->bytes, aqm->drops, aqm->overlimits,
+          aqm->marks, aqm->backlog);
+}
+
+void forward_stats(struct forward_ctx *fw, const char *name) {
+  if ((fw->prio || fw->aqm) && fw->stats_seen != (unsigned)stats_requests) {
+    fw->stats_seen = stats_requests;
+    if (fw->prio)
+      print_prio_stats(fw, name);
+    if (fw->aqm)
+      print_aqm_stats(fw, name);
+  }
+}
+
+// raise a socket buffer to size; one that holds as much already, as the
+// kernel tuned it or -M/-W set it, is left alone, as setting it ends the
+// kernel's tuning
+static int set_sockbuf(int sock, int optname, size_t size) {
+  int cur;
+  socklen_t len = sizeof(cur);
+
+  if (getsockopt(sock, SOL_SOCKET, optname, &cur, &len) == -1)
+    return -1;
+  if ((size_t)cur >= size)
+    return 0;
+  const int v = size;
+  return setsockopt(sock, SOL_SOCKET, optname, &v, sizeof(v));
+}
+
+// size the transfer buffers after the bandwidth-delay product, and raise
+// the socket buffers to them. They grow at once, but only shrink to a
+// quarter or less, and the send side not on a rate the sender held back.
+static void forward_autosize(struct forward_ctx *fw) {
+  const int ring_flags = fw->optsp->hugepages ? RINGBUF_HUGEPAGES : 0;
+  const uint64_t now = now_usec();
+  struct bdp_sample bs;
+
+  if (!fw->autosize || now < fw->autosize_next)
+    return;
+  fw->autosize_next = now + TR_AUTO_INTERVAL;
+  if (bdp_sample(fw->tr_ofd, &bs) == -1) {
+    perror("Cannot read TCP_INFO, keeping the buffer sizes");
+    fw->autosize = 0;
+    return;
+  }
+
+  const size_t send_old = fw->tr_send_buf.size;
+  const size_t recv_old = fw->tr_recv_buf.size;
+  size_t send = bdp_buffer_size(bs.send, TR_AUTO_HEADROOM, fw->autosize_min,
+                                fw->autosize_max);
+  size_t recv = bdp_buffer_size(bs.recv, TR_AUTO_HEADROOM, fw->autosize_min,
+                                fw->autosize_max);
+
+  if (send < send_old && (send > send_old / 4 || bs.app_limited))
+    send = send_old;
+  if (recv < recv_old && recv > recv_old / 4)
+    recv = recv_old;
+  // zero copy sends may still own pages of the send buffer
+  if (fw->zc_head != fw->zc_tail)
+    send = send_old;
+
+  // what is queued has to fit, else the next sample tries again
+  if (send != send_old &&
+      ringbuf_resize(&fw->tr_send_buf, send, ring_flags) == 0 &&
+      set_sockbuf(fw->tr_ofd, SO_SNDBUF, fw->tr_send_buf.size) == -1)
+    perror("setsockopt SO_SNDBUF");
+  if (recv != recv_old &&
+      ringbuf_resize(&fw->tr_recv_buf, recv, ring_flags) == 0 &&
+      set_sockbuf(fw->tr_ifd, SO_RCVBUF, fw->tr_recv_buf.size) == -1)
+    perror("setsockopt SO_RCVBUF");
+  if (fw->tr_send_buf.size == send_old && fw->tr_recv_buf.size == recv_old)
+    return;
+
+  fprintf(stderr, "Transfer buffers: send %zu -> %zu, receive %zu -> %zu "
+                  "(rtt %u us, rate %llu B/s, cwnd %u x %u%s)\n",
+          send_old, fw->tr_send_buf.size, recv_old, fw->tr_recv_buf.size,
+          bs.rtt, (unsigned long long)bs.rate, bs.cwnd, bs.mss,
+          bs.app_limited ? ", app limited" : "");
+}
+
+// ---------------------------------------------------
+// Transfer Information Packet
+// ---------------------------------------------------
+static size_t put_trinfo_option(char *p, int id, const void *value,
+                                size_t len) {
+  write_packet_size(p, 0);
+  p[IF_FRAME_SIZE_LEN] = TRINFO_OPTION;
+  p[IF_FRAME_SIZE_LEN + 1] = id;
+  p[IF_FRAME_SIZE_LEN + 2] = len;
+  memcpy(&p[IF_FRAME_SIZE_LEN + 3], value, len);
+  return IF_FRAME_SIZE_LEN + 3 + len;
+}
+
+void put_trinfo(struct forward_ctx *fw) {
+  struct tuncat_commandline_options *optsp = fw->optsp;
+  char *p = ringbuf_tail(&fw->tr_send_buf);
+  size_t len = 0;
+
+  write_packet_size(p, 0);
+  p[IF_FRAME_SIZE_LEN] = optsp->ifmode;
+  p[IF_FRAME_SIZE_LEN + 1] = optsp->compflag;
+  write_packet_size(&p[IF_FRAME_SIZE_LEN + 2], optsp->max_frame_size);
+  len += IF_FRAME_SIZE_LEN + TRINFO_SIZE;
+
+  // options are only sent when enabled, so plain peers stay compatible
+  if (fw->vnet_hdr_len > 0) {
+    const unsigned char vnet_hdr_len = fw->vnet_hdr_len;
+    len += put_trinfo_option(&p[len], TRINFO_OPTION_VNET_HDR, &vnet_hdr_len,
+                             sizeof(vnet_hdr_len));
+  }
+  if (fw->tx_codec.ops != NULL && fw->tx_codec.ops->id != CODEC_SNAPPY) {
+    const unsigned char codec = fw->tx_codec.ops->id;
+    len += put_trinfo_option(&p[len], TRINFO_OPTION_CODEC, &codec,
+                             sizeof(codec));
+  }
+  int i;
+  for (i = 0; i < optsp->nroutes; i++) {
+    const struct route *r = &optsp->routes[i];
+    unsigned char route[1 + 16];
+    route[0] = r->plen;
+    memcpy(&route[1], r->addr, r->family == AF_INET6 ? 16 : 4);
+    len += put_trinfo_option(&p[len], TRINFO_OPTION_ROUTE, route,
+                             r->family == AF_INET6 ? 1 + 16 : 1 + 4);
+  }
+  if (optsp->dict_id != 0) {
+    const uint32_t dict_id = htonl(optsp->dict_id);
+    len += put_trinfo_option(&p[len], TRINFO_OPTION_DICT, &dict_id,
+                             sizeof(dict_id));
+  }
+  if (fw->batch_size > 0) {
+    char batch_size[2];
+    write_packet_size(batch_size, fw->batch_size);
+    len += put_trinfo_option(&p[len], TRINFO_OPTION_BATCH, batch_size,
+                             sizeof(batch_size));
+  }
+  if (optsp->streams > 1) {
+    char streams[2];
+    write_packet_size(streams, optsp->streams);
+    len += put_trinfo_option(&p[len], TRINFO_OPTION_STREAMS, streams,
+                             sizeof(streams));
+  }
+  // last, the server groups the stream once it has the other options
+  if (optsp->session != 0) {
+    unsigned char session[8];
+    for (i = 0; i < 8; i++)
+      session[i] = optsp->session >> (56 - 8 * i);
+    len += put_trinfo_option(&p[len], TRINFO_OPTION_SESSION, session,
+                             sizeof(session));
+  }
+
+  ringbuf_produce(&fw->tr_send_buf, len);
+}
+
+// returns the size of the consumed information packet, 0 if it is not
+// complete yet, or -1 if the peer is not compatible
+static ssize_t get_trinfo(struct forward_ctx *fw, const char *p, size_t len) {
+  if (len < IF_FRAME_SIZE_LEN + 1)
+    return 0;
+
+  if ((unsigned char)p[IF_FRAME_SIZE_LEN] == TRINFO_OPTION) {
+    if (len < IF_FRAME_SIZE_LEN + 3)
+      return 0;
+    const int id = (unsigned char)p[IF_FRAME_SIZE_LEN + 1];
+    const size_t optlen = (unsigned char)p[IF_FRAME_SIZE_LEN + 2];
+    const unsigned char *value = (const unsigned char *)&p[IF_FRAME_SIZE_LEN + 3];
+    if (len < IF_FRAME_SIZE_LEN + 3 + optlen)
+      return 0;
+
+    switch (id) {
+    case TRINFO_OPTION_VNET_HDR:
+      fw->peer.vnet_hdr_len = optlen > 0 ? value[0] : 0;
+      break;
+    case TRINFO_OPTION_CODEC:
+      fw->peer.codec = optlen > 0 ? value[0] : CODEC_UNSPEC;
+      break;
+    case TRINFO_OPTION_DICT:
+      fw->peer.dict_id = optlen >= 4 ? (unsigned)value[0] << 24 |
+                                           value[1] << 16 | value[2] << 8 |
+                                           value[3]
+                                     : 0;
+      break;
+    case TRINFO_OPTION_ROUTE:
+      // only a hub routes to its peers
+      if (fw->routes != NULL && (optlen == 1 + 4 || optlen == 1 + 16) &&
+          value[0] <= (optlen - 1) * 8) {
+        if (value[0] == 0 && !fw->optsp->default_route) {
+          fprintf(stderr, "Warn: Refused the default route of client %u\n",
+                  fw->route_id - 1);
+          break;
+        }
+        const int r = route_add(fw->routes,
+                                optlen == 1 + 4 ? AF_INET : AF_INET6,
+                                &value[1], value[0], fw->route_id, 0);
+        if (r == -1)
+          return -1;
+        if (r == 1) {
+          fprintf(stderr, "Warn: Refused a route of client %u held by "
+                          "another client\n",
+                  fw->route_id - 1);
+          break;
+        }
+        fw->routes_announced++;
+      }
+      break;
+    case TRINFO_OPTION_BATCH:
+      fw->peer.batch_size =
+          optlen >= 2 ? read_packet_size((const char *)value) : 0;
+      break;
+    case TRINFO_OPTION_STREAMS:
+      fw->peer.streams =
+          optlen >= 2 ? read_packet_size((const char *)value) : 0;
+      break;
+    case TRINFO_OPTION_SESSION:
+      if (optlen >= 8) {
+        int i;
+        fw->peer.session = 0;
+        for (i = 0; i < 8; i++)
+          fw->peer.session = fw->peer.session << 8 | value[i];
+      }
+      break;
+    default:
+      fprintf(stderr, "Warn: Unknown transfer option %d\n", id);
+      break;
+    }
+    return IF_FRAME_SIZE_LEN + 3 + optlen;
+  }
+
+  // 4 byte of transfer information
+  if (len < IF_FRAME_SIZE_LEN + TRINFO_SIZE)
+    return 0;
+  const enum ifmode received_ifmode = p[IF_FRAME_SIZE_LEN];
+  const enum compflag received_compflag = p[IF_FRAME_SIZE_LEN + 1];
+  const size_t received_max_frame_size =
+      read_packet_size(&p[IF_FRAME_SIZE_LEN + 2]);
+  (void)received_max_frame_size;
+
+  if (received_ifmode != fw->optsp->ifmode) {
+    fprintf(stderr, "Fatal: Tunnel mode differs from the peer\n");
+    return -1;
+  }
+  if ((received_compflag == COMPFLAG_UNSPEC ? COMPFLAG_NONE
+                                             : received_compflag) !=
+      (fw->compflag == COMPFLAG_UNSPEC ? COMPFLAG_NONE : fw->compflag)) {
+    fprintf(stderr, "Fatal: Compress mode differs from the peer\n");
+    return -1;
+  }
+
+  // options of the peer follow, reset them to the defaults
+  memset(&fw->peer, 0, sizeof(fw->peer));
+  fw->peer.received = 1;
+  fw->peer.codec = CODEC_DEFAULT;
+
+  return IF_FRAME_SIZE_LEN + TRINFO_SIZE;
+}
+
+// options are complete once the peer sends its first data frame
+static int check_trinfo(struct forward_ctx *fw) {
+  fw->peer.checked = 1;
+
+  // decode with the codec of the peer, or our own if its information was
+  // lost on a datagram transport
+  if (fw->tx_codec.ops != NULL) {
+    const enum codec_id codec =
+        fw->peer.received ? fw->peer.codec : fw->tx_codec.ops->id;
+    if (fw->rx_codec.ops == NULL || fw->rx_codec.ops->id != codec) {
+      codec_free(&fw->rx_codec);
+      if (codec_init(&fw->rx_codec, codec, 0) == -1)
+        return -1;
+    }
+  }
+
+  if (!fw->peer.received)
+    return 0;
+
+  if (fw->peer.vnet_hdr_len != fw->vnet_hdr_len) {
+    fprintf(stderr, "Fatal: Offload mode differs from the peer\n");
+    return -1;
+  }
+
+  if (fw->peer.dict_id != fw->optsp->dict_id) {
+    fprintf(stderr, "Fatal: Dictionary differs from the peer\n");
+    return -1;
+  }
+  // only once the peer is known to compress with the same dictionary
+  if (fw->optsp->dict != NULL && fw->rx_codec.ops != NULL &&
+      fw->rx_codec.ops->id == CODEC_ZSTD &&
+      codec_set_dictionary(&fw->rx_codec, fw->optsp->dict,
+                           fw->optsp->dict_size) == -1)
+    return -1;
+
+  // both ends have to agree on the flags byte that batch mode adds
+  if ((fw->peer.batch_size > 0) != (fw->batch_size > 0)) {
+    fprintf(stderr, "Fatal: Batch mode differs from the peer\n");
+    return -1;
+  }
+  if (fw->peer.batch_size > fw->if_write_buf.size) {
+    fprintf(stderr, "Fatal: Batch size of the peer exceeds the interface "
+                    "buffer size\n");
+    return -1;
+  }
+
+  // the streams of a tunnel are accepted as one group
+  if ((fw->peer.streams ?: 1) != (fw->optsp->streams ?: 1)) {
+    fprintf(stderr, "Fatal: Stream count differs from the peer\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+// size of the complete frame or information packet at p
+static size_t frame_size(const struct forward_ctx *fw, const char *p) {
+  const size_t packet_size = read_packet_size(p);
+
+  if (packet_size > 0)
+    return fw->tr_frame_hdr_size + packet_size;
+  if ((unsigned char)p[IF_FRAME_SIZE_LEN] == TRINFO_OPTION)
+    return IF_FRAME_SIZE_LEN + 3 + (unsigned char)p[IF_FRAME_SIZE_LEN + 2];
+  return IF_FRAME_SIZE_LEN + TRINFO_SIZE;
+}
+
+// ---------------------------------------------------
+// Transfer Recv Buffer -> Interface Write Buffer
+// ---------------------------------------------------
+
+// check that a decoded batch block holds whole, non-empty frames
+static int is_valid_block(const struct forward_ctx *fw, const char *p,
+                          size_t len) {
+  const size_t hdr_size = fw->frame_hdr_size;
+  size_t off = 0;
+
+  while (off < len) {
+    if (len - off < hdr_size)
+      return 0;
+    const size_t packet_size = read_packet_size(&p[off]);
+    if (packet_size == 0 || len - off - hdr_size < packet_size)
+      return 0;
+    off += hdr_size + packet_size;
+  }
+  return 1;
+}
+
+// decode one frame (or information packet) into the interface write buffer;
+// returns the consumed size, 0 if the frame is incomplete or does not fit
+// yet, or -1 on fatal errors
+static ssize_t forward_frame_to_if(struct forward_ctx *fw,
+                                   const char *tr_recv_frame,
+                                   size_t tr_recv_buf_used) {
+  const size_t hdr_size = fw->frame_hdr_size;
+  const size_t tr_hdr_size = fw->tr_frame_hdr_size;
+
+  // brake if the packet size cannot read from transfer receive buffer
+  if (tr_recv_buf_used < IF_FRAME_SIZE_LEN)
+    return 0;
+
+  // read packet size from transfer receive buffer
+  const size_t tr_recv_packet_size = read_packet_size(tr_recv_frame);
+
+  // operate information packet
+  if (tr_recv_packet_size == 0) {
+    return get_trinfo(fw, tr_recv_frame, tr_recv_buf_used);
+  }
+
+  if (!fw->peer.checked && check_trinfo(fw) == -1)
+    return -1;
+
+  // the interface writer takes the frame from the receive buffer
+  if (fw->passthrough)
+    return 0;
+
+  // brake if the packet content cannot read from transfer receive buffer
+  if (tr_recv_buf_used < tr_hdr_size + tr_recv_packet_size)
+    return 0;
+
+  // calculate writing capacity of interface write buffer
+  const size_t if_write_buf_writable_size = ringbuf_space(&fw->if_write_buf);
+  char *if_write_frame = ringbuf_tail(&fw->if_write_buf);
+  const char *tr_recv_packet = &tr_recv_frame[tr_hdr_size];
+
+  int compressed = fw->compflag == COMPFLAG_COMPRESS;
+  int batch = 0;
+  if (fw->frame_flags_len > 0) {
+    compressed = tr_recv_frame[IF_FRAME_SIZE_LEN] & FRAME_FLAG_COMPRESSED;
+    batch = tr_recv_frame[IF_FRAME_SIZE_LEN] & FRAME_FLAG_BATCH;
+  }
+
+  // a block of frames already has the framing of the interface write buffer
+  const size_t if_hdr_size = batch ? 0 : hdr_size;
+  size_t if_write_packet_size = tr_recv_packet_size;
+
+  if (compressed && !fw->peer.received && fw->rx_codec.ops != NULL &&
+      codec_frame_dictionary_id(&fw->rx_codec, tr_recv_packet,
+                                tr_recv_packet_size) != 0) {
+    // the dictionary of the peer was never verified
+    fprintf(stderr, "Fatal: Dictionary compressed frame without the transfer "
+                    "information of the peer\n");
+    return -1;
+  }
+
+  if (compressed) {
+    // calculate required size of interface write buffer with compression
+    if (codec_uncompressed_length(&fw->rx_codec, tr_recv_packet,
+                                  tr_recv_packet_size,
+                                  &if_write_packet_size) == -1 ||
+        if_write_packet_size > IF_MAX_FRAME_SIZE_MAX) {
+      fprintf(stderr, "Warn: Invalid transfer input stream\n");
+
+      // waste the packet
+      return tr_hdr_size + tr_recv_packet_size;
+    }
+  }
+
+  // brake if the interface write buffer cannot store the packet
+  if (if_write_buf_writable_size < if_hdr_size + if_write_packet_size)
+    return 0;
+
+  if (compressed) {
+    // decompress the packet
+    if (codec_uncompress(&fw->rx_codec, tr_recv_packet, tr_recv_packet_size,
+                         &if_write_frame[if_hdr_size],
+                         &if_write_packet_size) == -1) {
+      fprintf(stderr, "Warn: Invalid transfer input stream\n");
+
+      // waste the packet
+      return tr_hdr_size + tr_recv_packet_size;
+    }
+  } else {
+    // write packet from transfer receive buffer to interface write buffer
+    memcpy(&if_write_frame[if_hdr_size], tr_recv_packet, tr_recv_packet_size);
+  }
+
+  if (batch) {
+    // the frames become visible to the interface writer only once the
+    // whole block is known to be intact
+    if (!is_valid_block(fw, if_write_frame, if_write_packet_size)) {
+      fprintf(stderr, "Warn: Invalid transfer input stream\n");
+
+      // waste the packet
+      return tr_hdr_size + tr_recv_packet_size;
+    }
+    ringbuf_produce(&fw->if_write_buf, if_write_packet_size);
+    return tr_hdr_size + tr_recv_packet_size;
+  }
+
+  // write packet size and copy the virtio header as is
+  write_packet_size(if_write_frame, if_write_packet_size);
+  memcpy(&if_write_frame[IF_FRAME_SIZE_LEN],
+         &tr_recv_frame[IF_FRAME_SIZE_LEN + fw->frame_flags_len],
+         fw->vnet_hdr_len);
+
+  // move the tail of interface write buffer
+  ringbuf_produce(&fw->if_write_buf, hdr_size + if_write_packet_size);
+
+  return tr_hdr_size + tr_recv_packet_size;
+}
+
+int forward_tr_to_if(struct forward_ctx *fw) {
+  while (1) {
+    ssize_t consumed =
+        forward_frame_to_if(fw, ringbuf_data(&fw->tr_recv_buf),
+                            ringbuf_used(&fw->tr_recv_buf));
+    if (consumed == -1)
+      return -1;
+    if (consumed == 0)
+      break;
+
+    // move the head of transfer receive buffer
+    ringbuf_consume(&fw->tr_recv_buf, consumed);
+  }
+
+  return 0;
+}
+
+static int forward_process(struct forward_ctx *fw) {
+  if (forward_if_to_tr(fw) == -1) {
+    return -1;
+  }
+  if (forward_tr_to_if(fw) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+// ---------------------------------------------------
+// I/O readiness
+// ---------------------------------------------------
+int want_tr_read(const struct forward_ctx *fw) {
+  if (fw->datagram) {
+    // datagrams are decoded straight into the interface write buffer
+    return ringbuf_space(&fw->if_write_buf) >=
+           fw->frame_hdr_size + (fw->batch_size > fw->max_frame_size
+                                     ? fw->batch_size
+                                     : fw->max_frame_size);
+  }
+  return ringbuf_space(&fw->tr_recv_buf) > 0;
+}
+
+// ---------------------------------------------------
+// Transfer Pacing
+// ---------------------------------------------------
+
+void pace_init(struct pacer *pace, uint64_t rate, size_t burst) {
+  pace->rate = rate;
+  pace->burst = burst;
+  pace->fill_time = burst * 1000000 / rate + 1;
+  pace->tokens = pace->burst * 1000000;
+  pace->last = now_usec();
+  pace->deadline = 0;
+}
+
+// whether the pacer holds back the transfer write
+int pace_throttled(const struct pacer *pace) {
+  return pace != NULL && pace->deadline != 0 && now_usec() < pace->deadline;
+}
+
+// bytes the pacer lets out now; 0 and the time to try again if the bucket
+// has less than a quantum. The last write may overdraw the bucket.
+size_t pace_allowance(struct pacer *pace) {
+  const uint64_t now = now_usec();
+  uint64_t elapsed = now - pace->last;
+
+  // beyond the time to fill the bucket the tokens overflow anyway
+  if (elapsed > pace->fill_time)
+    elapsed = pace->fill_time;
+  pace->last = now;
+  pace->tokens += elapsed * pace->rate;
+  if (pace->tokens > pace->burst * 1000000)
+    pace->tokens = pace->burst * 1000000;
+
+  const int64_t quantum = (int64_t)PACE_QUANTUM * 1000000;
+  if (pace->tokens < quantum) {
+    pace->deadline =
+        now + (quantum - pace->tokens + pace->rate - 1) / pace->rate;
+    return 0;
+  }
+  pace->deadline = 0;
+  return pace->tokens / 1000000;
+}
+
+void pace_charge(struct pacer *pace, size_t len) {
+  pace->tokens -= (int64_t)len * 1000000;
+}
+
+int want_tr_write(const struct forward_ctx *fw) {
+  if (pace_throttled(fw->pace))
+    return 0;
+  return ringbuf_used(&fw->tr_send_buf) > fw->zc_off || queue_pending(fw) ||
+         (fw->passthrough && ringbuf_used(&fw->if_read_buf) > fw->pass_off) ||
+         fw->zc_head != fw->zc_tail;
+}
+
+int want_if_read(const struct forward_ctx *fw) {
+  return ringbuf_space(&fw->if_read_buf) >=
+         fw->frame_hdr_size + fw->max_frame_size;
+}
+
+// the size of the frame at off into the interface write source if it is
+// complete and goes to the device, else 0
+static size_t if_write_frame_size(const struct forward_ctx *fw, size_t off) {
+  const struct ringbuf *rb =
+      fw->passthrough ? &fw->tr_recv_buf : &fw->if_write_buf;
+  const size_t used = ringbuf_used(rb);
+
+  if (used < off + fw->frame_hdr_size)
+    return 0;
+  const size_t packet_size = read_packet_size(ringbuf_data(rb) + off);
+  // transfer information is left to forward_tr_to_if()
+  if (fw->passthrough && (packet_size == 0 || !fw->peer.checked))
+    return 0;
+  if (used < off + fw->frame_hdr_size + packet_size)
+    return 0;
+  return fw->frame_hdr_size + packet_size;
+}
+
+int want_if_write(const struct forward_ctx *fw) {
+  return if_write_frame_size(fw, 0) != 0;
+}
+
+// ---------------------------------------------------
+// Transfer Recv from Datagrams -> Interface Write Buffer
+// ---------------------------------------------------
+static int forward_datagram_to_if(struct forward_ctx *fw, const char *p,
+                                  size_t len) {
+  // anything that is incomplete or does not fit is dropped, as on a wire
+  while (len > 0) {
+    ssize_t consumed = forward_frame_to_if(fw, p, len);
+    if (consumed == -1)
+      return -1;
+    if (consumed == 0)
+      break;
+    p += consumed;
+    len -= consumed;
+  }
+
+  return 0;
+}
+
+static enum fwio do_tr_recvmmsg(struct forward_ctx *fw) {
+  struct mmsghdr msgs[UDP_BATCH_SIZE];
+  struct iovec iovs[UDP_BATCH_SIZE];
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } ctrls[UDP_BATCH_SIZE];
+  unsigned vlen, i;
+
+  // do not take more datagrams than the interface write buffer can hold;
+  // with GRO a datagram may carry up to 64 KiB of frames
+  vlen = ringbuf_space(&fw->if_write_buf) /
+         (fw->udp_gro ? IF_MAX_FRAME_SIZE_MAX
+                      : fw->frame_hdr_size + fw->max_frame_size);
+  if (vlen > UDP_BATCH_SIZE)
+    vlen = UDP_BATCH_SIZE;
+  if (vlen == 0)
+    vlen = 1;
+
+  memset(msgs, 0, sizeof(msgs[0]) * vlen);
+  for (i = 0; i < vlen; i++) {
+    iovs[i].iov_base = fw->dgram_buf + i * fw->dgram_slot_size;
+    iovs[i].iov_len = fw->dgram_slot_size;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    if (fw->udp_gro) {
+      msgs[i].msg_hdr.msg_control = ctrls[i].buf;
+      msgs[i].msg_hdr.msg_controllen = sizeof(ctrls[i].buf);
+    }
+  }
+
+  int n = recvmmsg(fw->tr_ifd, msgs, vlen, 0, NULL);
+  if (n == -1) {
+    if (is_temporary_error(errno)) {
+      return FWIO_AGAIN;
+    }
+    if (errno == ECONNREFUSED) {
+      // the peer is not (yet) listening
+      return FWIO_OK;
+    }
+    perror("recvmmsg");
+    return FWIO_ERROR;
+  }
+
+  for (i = 0; i < (unsigned)n; i++) {
+    const char *p = iovs[i].iov_base;
+    size_t len = msgs[i].msg_len;
+    size_t segment_size = len;
+
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      fprintf(stderr, "Warn: Truncated datagram\n");
+      continue;
+    }
+
+    // coalesced by GRO: every segment is a datagram of its own
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        int gso_size;
+        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+        if (gso_size > 0)
+          segment_size = gso_size;
+      }
+    }
+
+    while (len > 0) {
+      const size_t seglen = len < segment_size ? len : segment_size;
+      if (forward_datagram_to_if(fw, p, seglen) == -1)
+        return FWIO_ERROR;
+      p += seglen;
+      len -= seglen;
+    }
+  }
+
+  return FWIO_OK;
+}
+
+// ---------------------------------------------------
+// Transfer Recv from Channel -> Transfer Recv Buffer
+// ---------------------------------------------------
+enum fwio do_tr_read(struct forward_ctx *fw) {
+  if (fw->datagram) {
+    return do_tr_recvmmsg(fw);
+  }
+
+  ssize_t rsiz = read(fw->tr_ifd, ringbuf_tail(&fw->tr_recv_buf),
+                      ringbuf_space(&fw->tr_recv_buf));
+  if (rsiz == -1) {
+    if (is_temporary_error(errno)) {
+      return FWIO_AGAIN;
+    }
+    perror("read");
+    return FWIO_ERROR;
+  }
+  if (rsiz == 0) {
+    return FWIO_EOF;
+  }
+  ringbuf_produce(&fw->tr_recv_buf, rsiz);
+  return FWIO_OK;
+}
+
+// ---------------------------------------------------
+// Interface Write Buffer -> Interface Write to Device
+// ---------------------------------------------------
+enum fwio do_if_write(struct forward_ctx *fw) {
+  struct ringbuf *rb = fw->passthrough ? &fw->tr_recv_buf : &fw->if_write_buf;
+  const char *if_write_frame = ringbuf_data(rb);
+  size_t packet_size = read_packet_size(if_write_frame);
+
+  // the virtio header, if any, goes to the device in front of the packet
+  ssize_t wsiz = write(fw->if_write_fd, &if_write_frame[IF_FRAME_SIZE_LEN],
+                       fw->vnet_hdr_len + packet_size);
+  if (wsiz == -1) {
+    if (is_temporary_error(errno)) {
+      return FWIO_AGAIN;
+    }
+    perror("write");
+    return FWIO_ERROR;
+  }
+  ringbuf_consume(rb, fw->frame_hdr_size + packet_size);
+
+  // transfer information behind the frame is taken before the next one
+  if (fw->passthrough && forward_tr_to_if(fw) == -1) {
+    return FWIO_ERROR;
+  }
+  return FWIO_OK;
+}
+
+// ---------------------------------------------------
+// Interface Read from Device -> Interface Read Buffer
+// ---------------------------------------------------
+
+// whether rsiz bytes read from the device make a frame; room is what the
+// read could take, a longer frame was cut off (the device still reports
+// its whole length)
+static int if_read_check(const struct forward_ctx *fw, size_t rsiz,
+                         size_t room) {
+  if (rsiz < fw->vnet_hdr_len) {
+    fprintf(stderr, "Warn: Short read from interface\n");
+    return 0;
+  }
+  if (rsiz > room) {
+    // a tap GSO frame or an IPv6 USO packet may not fit the 16 bit size
+    fprintf(stderr, "Warn: Dropped an oversize frame from interface (%zu "
+                    "bytes)\n",
+            rsiz - fw->vnet_hdr_len);
+    return 0;
+  }
+  return 1;
+}
+
+// rsiz bytes were read from the device behind the size of the frame, which
+// is at the read buffer's tail or else copied there
+static void if_read_put(struct forward_ctx *fw, char *frame, size_t rsiz) {
+  if (fw->batch_size > 0 && ringbuf_used(&fw->if_read_buf) == 0) {
+    fw->batch_since = now_usec();
+  }
+  write_packet_size(frame, rsiz - fw->vnet_hdr_len);
+  if (queue_enqueue(fw, frame)) {
+    return;
+  }
+  if (frame != ringbuf_tail(&fw->if_read_buf)) {
+    memcpy(ringbuf_tail(&fw->if_read_buf), frame, IF_FRAME_SIZE_LEN + rsiz);
+  }
+  ringbuf_produce(&fw->if_read_buf, IF_FRAME_SIZE_LEN + rsiz);
+}
+
+enum fwio do_if_read(struct forward_ctx *fw) {
+  char *if_read_frame = ringbuf_tail(&fw->if_read_buf);
+  size_t room = ringbuf_space(&fw->if_read_buf) - IF_FRAME_SIZE_LEN;
+  if (room > fw->vnet_hdr_len + IF_MAX_FRAME_SIZE_MAX) {
+    room = fw->vnet_hdr_len + IF_MAX_FRAME_SIZE_MAX;
+  }
+  ssize_t rsiz = read(fw->if_read_fd, &if_read_frame[IF_FRAME_SIZE_LEN], room);
+  if (rsiz == -1) {
+    if (is_temporary_error(errno)) {
+      return FWIO_AGAIN;
+    }
+    perror("read");
+    return FWIO_ERROR;
+  }
+  if (rsiz == 0) {
+    return FWIO_EOF;
+  }
+  if (if_read_check(fw, rsiz, room)) {
+    if_read_put(fw, if_read_frame, rsiz);
+  }
+  return FWIO_OK;
+}
+
+// ---------------------------------------------------
+// Transfer Send Buffer -> Transfer Send as Datagrams
+// ---------------------------------------------------
+static enum fwio do_tr_sendmmsg(struct forward_ctx *fw) {
+  struct mmsghdr msgs[UDP_BATCH_SIZE];
+  struct iovec iovs[UDP_BATCH_SIZE];
+  union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } ctrls[UDP_BATCH_SIZE];
+  const char *p = ringbuf_data(&fw->tr_send_buf);
+  size_t used = ringbuf_used(&fw->tr_send_buf);
+  size_t off;
+  unsigned n;
+
+  // the datagram starting below the allowance goes out whole
+  if (fw->pace != NULL) {
+    const size_t allowance = pace_allowance(fw->pace);
+    if (allowance == 0)
+      return FWIO_OK;
+    if (used > allowance)
+      used = allowance;
+  }
+
+  // the send buffer only holds complete frames, each becomes a datagram
+  memset(msgs, 0, sizeof(msgs));
+  for (n = 0, off = 0; n < UDP_BATCH_SIZE && off < used; n++) {
+    const size_t segment_size = frame_size(fw, &p[off]);
+    size_t len = segment_size;
+    unsigned nsegs = 1;
+
+    // with GSO a run of equal sized frames, which lie back to back in the
+    // ring, goes out as one send; only the last segment may be shorter
+    if (segment_size <= fw->udp_gso_size_max) {
+      while (off + len < used && nsegs < UDP_GSO_MAX_SEGMENTS) {
+        const size_t next_size = frame_size(fw, &p[off + len]);
+        if (next_size > segment_size || len + next_size > UDP_GSO_MAX_BYTES)
+          break;
+        len += next_size;
+        nsegs++;
+        if (next_size < segment_size)
+          break;
+      }
+    }
+
+    iovs[n].iov_base = (char *)&p[off];
+    iovs[n].iov_len = len;
+    msgs[n].msg_hdr.msg_iov = &iovs[n];
+    msgs[n].msg_hdr.msg_iovlen = 1;
+    if (nsegs > 1) {
+      const uint16_t gso_size = segment_size;
+      msgs[n].msg_hdr.msg_control = ctrls[n].buf;
+      msgs[n].msg_hdr.msg_controllen = sizeof(ctrls[n].buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[n].msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+      memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+    }
+    off += len;
+  }
+
+  int sent = sendmmsg(fw->tr_ofd, msgs, n, 0);
+  if (sent == -1) {
+    if (is_temporary_error(errno)) {
+      return FWIO_AGAIN;
+    }
+    if (errno == ECONNREFUSED) {
+      // reported for an earlier datagram, the next send goes out again
+      return FWIO_OK;
+    }
+    if ((errno == EINVAL || errno == EIO) && fw->udp_gso_size_max > 0) {
+      // e.g. no checksum offload on the egress device
+      fprintf(stderr, "Warn: UDP segmentation offload disabled\n");
+      fw->udp_gso_size_max = 0;
+      return FWIO_OK;
+    }
+    perror("sendmmsg");
+    return FWIO_ERROR;
+  }
+
+  int i;
+  for (i = 0; i < sent; i++) {
+    ringbuf_consume(&fw->tr_send_buf, iovs[i].iov_len);
+    if (fw->pace != NULL)
+      pace_charge(fw->pace, iovs[i].iov_len);
+  }
+  return FWIO_OK;
+}
+
+// largest datagram payload that fits the path MTU, which is known once
+// connected; GSO segments and batch blocks have to fit it
+static size_t udp_payload_max(int sock) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  int mtu;
+  socklen_t mtulen = sizeof(mtu);
+
+  if (getsockname(sock, (struct sockaddr *)&addr, &addrlen) == -1) {
+    perror("getsockname");
+    return 0;
+  }
+  if (addr.ss_family == AF_INET6) {
+    if (getsockopt(sock, IPPROTO_IPV6, IPV6_MTU, &mtu, &mtulen) == -1) {
+      perror("getsockopt");
+      return 0;
+    }
+    return mtu - sizeof(struct ip6_hdr) - sizeof(struct udphdr);
+  }
+  if (getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &mtulen) == -1) {
+    perror("getsockopt");
+    return 0;
+  }
+  return mtu - sizeof(struct iphdr) - sizeof(struct udphdr);
+}
+
+// ---------------------------------------------------
+// Transfer Send Buffer -> Transfer Send to Channel
+// ---------------------------------------------------
+
+// consume the written bytes of the interface read buffer, keeping track
+// of a frame cut by a short write; frames sent zero copy leave it once the
+// kernel let go
+static void pass_advance(struct forward_ctx *fw, size_t len) {
+  while (len > 0) {
+    if (fw->pass_left == 0) {
+      fw->pass_left =
+          fw->frame_hdr_size +
+          read_packet_size(ringbuf_data(&fw->if_read_buf) + fw->pass_off);
+    }
+    const size_t chunk = len < fw->pass_left ? len : fw->pass_left;
+    fw->pass_off += chunk;
+    fw->pass_left -= chunk;
+    len -= chunk;
+  }
+  if (!fw->zerocopy) {
+    ringbuf_consume(&fw->if_read_buf, fw->pass_off);
+    fw->pass_off = 0;
+  }
+}
+
+// release the sends from the head on that the kernel is done with
+static void zc_release(struct forward_ctx *fw) {
+  while (fw->zc_head != fw->zc_tail) {
+    struct zc_send *zs = &fw->zc_sends[fw->zc_head % ZEROCOPY_SENDS_MAX];
+    if (!zs->done)
+      break;
+    ringbuf_consume(&fw->tr_send_buf, zs->info);
+    fw->zc_off -= zs->info;
+    ringbuf_consume(&fw->if_read_buf, zs->frames);
+    fw->pass_off -= zs->frames;
+    fw->zc_head++;
+  }
+}
+
+static struct zc_send *zc_last(struct forward_ctx *fw) {
+  if (fw->zc_head == fw->zc_tail)
+    return NULL;
+  return &fw->zc_sends[(fw->zc_tail - 1) % ZEROCOPY_SENDS_MAX];
+}
+
+// whether another send can be tracked, a copied one possibly with the last
+static int zc_room(struct forward_ctx *fw, int zerocopy) {
+  const struct zc_send *last = zc_last(fw);
+  return (!zerocopy && last != NULL && last->done) ||
+         fw->zc_tail - fw->zc_head < ZEROCOPY_SENDS_MAX;
+}
+
+static void zc_push(struct forward_ctx *fw, size_t info, size_t frames,
+                    int zerocopy) {
+  struct zc_send *zs = zc_last(fw);
+
+  if (zerocopy || zs == NULL || !zs->done) {
+    zs = &fw->zc_sends[fw->zc_tail++ % ZEROCOPY_SENDS_MAX];
+    zs->id = zerocopy ? fw->zc_next++ : 0;
+    zs->zerocopy = zerocopy;
+    zs->done = !zerocopy;
+    zs->info = 0;
+    zs->frames = 0;
+  }
+  zs->info += info;
+  zs->frames += frames;
+  zc_release(fw);
+}
+
+// take the kernel's reports of done zero copy sends, each a range of send
+// ids, from the error queue; returns 0 or -1
+static int zc_reap(struct forward_ctx *fw) {
+  for (;;) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                 CMSG_SPACE(sizeof(struct sockaddr_in6))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fw->tr_ofd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (is_temporary_error(errno)) {
+        break;
+      }
+      perror("recvmsg");
+      return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        continue;
+      const struct sock_extended_err *serr = (void *)CMSG_DATA(cmsg);
+      if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+        continue;
+      // the kernel copied after all (e.g. to a local peer), so stop asking
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        fw->zc_copied = 1;
+
+      unsigned i;
+      for (i = fw->zc_head; i != fw->zc_tail; i++) {
+        struct zc_send *zs = &fw->zc_sends[i % ZEROCOPY_SENDS_MAX];
+        if (zs->zerocopy &&
+            zs->id - serr->ee_info <= serr->ee_data - serr->ee_info)
+          zs->done = 1;
+      }
+    }
+  }
+  zc_release(fw);
+  return 0;
+}
+
+// the transfer write: the transfer send buffer, or in pass-through the
+// transfer information, which may only go in between frames, and the
+// frames gathered from the interface read buffer. Returns the number of
+// iovecs, 0 if there is nothing to write now; info is what of them is from
+// the transfer send buffer.
+static int tr_write_iov(struct forward_ctx *fw, struct iovec iov[2],
+                        size_t *info) {
+  int n = 0;
+
+  *info = 0;
+  if (!fw->passthrough || fw->pass_left == 0) {
+    *info = ringbuf_used(&fw->tr_send_buf) - fw->zc_off;
+    if (*info > 0) {
+      iov[n].iov_base = ringbuf_data(&fw->tr_send_buf) + fw->zc_off;
+      iov[n].iov_len = *info;
+      n++;
+    }
+  }
+  if (fw->passthrough && ringbuf_used(&fw->if_read_buf) > fw->pass_off) {
+    iov[n].iov_base = ringbuf_data(&fw->if_read_buf) + fw->pass_off;
+    iov[n].iov_len = ringbuf_used(&fw->if_read_buf) - fw->pass_off;
+    n++;
+  }
+  if (n == 0)
+    return 0;
+
+  if (fw->pace != NULL) {
+    size_t allowance = pace_allowance(fw->pace);
+    int k;
+    if (allowance == 0)
+      return 0;
+    for (k = 0; k < n && allowance > 0; k++) {
+      if (iov[k].iov_len > allowance)
+        iov[k].iov_len = allowance;
+      allowance -= iov[k].iov_len;
+    }
+    n = k;
+    if (*info > iov[0].iov_len)
+      *info = iov[0].iov_len;
+  }
+  return n;
+}
+
+static void tr_write_done(struct forward_ctx *fw, size_t info, size_t wsiz,
+                          int zerocopy) {
+  if (fw->pace != NULL)
+    pace_charge(fw->pace, wsiz);
+
+  const size_t info_sent = wsiz < info ? wsiz : info;
+  if (fw->zerocopy) {
+    fw->zc_off += info_sent;
+  } else {
+    ringbuf_consume(&fw->tr_send_buf, info_sent);
+  }
+  if (fw->passthrough)
+    pass_advance(fw, wsiz - info_sent);
+  if (fw->zerocopy)
+    zc_push(fw, info_sent, wsiz - info_sent, zerocopy);
+  if (fw->cork)
+    fw->cork_pending = 1;
+}
+
+// send what the corked socket holds, the loop has no more to write now
+void forward_uncork(struct forward_ctx *fw) {
+  int off = 0, on = 1;
+
+  if (!fw->cork_pending)
+    return;
+  fw->cork_pending = 0;
+  if (setsockopt(fw->tr_ofd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) ==
+          -1 ||
+      setsockopt(fw->tr_ofd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == -1) {
+    perror("Cannot pull the cork, sending uncorked");
+    fw->cork = 0;
+  }
+}
+
+static ssize_t send_zerocopy(int fd, struct iovec *iov, int n) {
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  return sendmsg(fd, &msg, MSG_ZEROCOPY);
+}
+
+static enum fwio do_tr_write(struct forward_ctx *fw) {
+  struct iovec iov[2];
+  size_t info;
+
+  if (forward_queue_to_tr(fw) == -1) {
+    return FWIO_ERROR;
+  }
+
+  if (fw->datagram) {
+    return do_tr_sendmmsg(fw);
+  }
+  if (fw->zerocopy && fw->zc_head != fw->zc_tail && zc_reap(fw) == -1) {
+    return FWIO_ERROR;
+  }
+
+  const int n = tr_write_iov(fw, iov, &info);
+  // sends waiting for the kernel: it reports them done on the error queue,
+  // which wakes the loop
+  if (n == 0 || (fw->zerocopy && !zc_room(fw, 0))) {
+    return fw->zc_head != fw->zc_tail && !pace_throttled(fw->pace)
+               ? FWIO_AGAIN
+               : FWIO_OK;
+  }
+
+  size_t len = 0;
+  int k;
+  for (k = 0; k < n; k++)
+    len += iov[k].iov_len;
+  int zerocopy = fw->zerocopy && !fw->zc_copied && len >= fw->zerocopy &&
+                 zc_room(fw, 1);
+
+  ssize_t wsiz = zerocopy ? send_zerocopy(fw->tr_ofd, iov, n)
+                          : writev(fw->tr_ofd, iov, n);
+  // out of option memory for the notifications, copy this one
+  if (wsiz == -1 && zerocopy && errno == ENOBUFS) {
+    zerocopy = 0;
+    wsiz = writev(fw->tr_ofd, iov, n);
+  }
+  if (wsiz == -1) {
+    if (is_temporary_error(errno)) {
+      return FWIO_AGAIN;
+    }
+    perror(zerocopy ? "sendmsg" : "writev");
+    return FWIO_ERROR;
+  }
+  tr_write_done(fw, info, wsiz, zerocopy);
+  return FWIO_OK;
+}
+
+static void print_idle_state(const struct forward_ctx *fw) {
+  fprintf(stderr, "(tr_ipos: %zu, tr_opos: %zu, if_ipos: %zu, if_opos: %zu)\n",
+          ringbuf_used(&fw->tr_recv_buf), ringbuf_used(&fw->tr_send_buf),
+          ringbuf_used(&fw->if_read_buf), ringbuf_used(&fw->if_write_buf));
+}
+
+// the next point in time the forwarding has to run without any I/O, 0 if
+// there is none
+uint64_t forward_deadline(const struct forward_ctx *fw) {
+  uint64_t deadline = fw->batch_deadline;
+
+  if (pace_throttled(fw->pace) &&
+      (deadline == 0 || fw->pace->deadline < deadline))
+    deadline = fw->pace->deadline;
+  return deadline;
+}
+
+static int forward_loop_select(struct forward_ctx *fw) {
+  for (;;) {
+    int nfds;
+    fd_set rfds, wfds;
+    struct timeval tv, *tvp = NULL;
+    nfds = 0;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+
+    forward_stats(fw, "Tunnel");
+    forward_autosize(fw);
+
+    if (forward_process(fw) == -1) {
+      return EXIT_FAILURE;
+    }
+
+    // ---------------------------------------------------
+    // Select and I/O
+    // ---------------------------------------------------
+    if (want_tr_read(fw)) {
+      FD_SET(fw->tr_ifd, &rfds);
+      if (nfds <= fw->tr_ifd)
+        nfds = fw->tr_ifd + 1;
+    }
+
+    if (want_tr_write(fw)) {
+      FD_SET(fw->tr_ofd, &wfds);
+      if (nfds <= fw->tr_ofd)
+        nfds = fw->tr_ofd + 1;
+    }
+
+    if (want_if_read(fw)) {
+      FD_SET(fw->if_read_fd, &rfds);
+      if (nfds <= fw->if_read_fd)
+        nfds = fw->if_read_fd + 1;
+    }
+
+    if (want_if_write(fw)) {
+      FD_SET(fw->if_write_fd, &wfds);
+      if (nfds <= fw->if_write_fd)
+        nfds = fw->if_write_fd + 1;
+    }
+
+    const uint64_t deadline = forward_deadline(fw);
+    if (nfds == 0 && deadline == 0) {
+      print_idle_state(fw);
+      return EXIT_SUCCESS;
+    }
+    if (deadline != 0) {
+      const uint64_t now = now_usec();
+      const uint64_t left = deadline > now ? deadline - now : 0;
+      tv.tv_sec = left / 1000000;
+      tv.tv_usec = left % 1000000;
+      tvp = &tv;
+    }
+
+    forward_uncork(fw);
+
+    if ((nfds = select(nfds, &rfds, &wfds, NULL, tvp)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("select");
+      return EXIT_FAILURE;
+    }
+
+    enum fwio r = FWIO_OK;
+
+    if (nfds == 0) {
+      // timed out, the deadline is handled by forward_process()
+    } else if (FD_ISSET(fw->tr_ifd, &rfds)) {
+      r = do_tr_read(fw);
+    } else if (FD_ISSET(fw->if_write_fd, &wfds)) {
+      r = do_if_write(fw);
+    } else if (FD_ISSET(fw->if_read_fd, &rfds)) {
+      r = do_if_read(fw);
+    } else if (FD_ISSET(fw->tr_ofd, &wfds)) {
+      r = do_tr_write(fw);
+    }
+
+    if (r == FWIO_ERROR) {
+      return EXIT_FAILURE;
+    }
+    if (r == FWIO_EOF) {
+      return EXIT_SUCCESS;
+    }
+  }
+}
+
+int epoll_add(int epfd, int fd, uint32_t events, uint32_t ready) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events | EPOLLET;
+  ev.data.u32 = ready;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int epoll_setup(struct forward_ctx *fw) {
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    return -1;
+  }
+
+  if (epoll_add(epfd, fw->if_read_fd, EPOLLIN | EPOLLOUT,
+                FWREADY_IF_IN | FWREADY_IF_OUT) == -1) {
+    goto fail;
+  }
+  if (fw->tr_ifd == fw->tr_ofd) {
+    if (epoll_add(epfd, fw->tr_ifd, EPOLLIN | EPOLLOUT,
+                  FWREADY_TR_IN | FWREADY_TR_OUT) == -1) {
+      goto fail;
+    }
+  } else {
+    if (epoll_add(epfd, fw->tr_ifd, EPOLLIN, FWREADY_TR_IN) == -1 ||
+        epoll_add(epfd, fw->tr_ofd, EPOLLOUT, FWREADY_TR_OUT) == -1) {
+      goto fail;
+    }
+  }
+
+  return epfd;
+
+fail:
+  close(epfd);
+  return -1;
+}
+
+// epoll_wait() until the deadline (0: none), with microsecond precision
+// where the kernel supports epoll_pwait2()
+int epoll_wait_until(int epfd, struct epoll_event *events, int maxevents,
+                     uint64_t deadline) {
+  if (deadline == 0) {
+    return epoll_wait(epfd, events, maxevents, -1);
+  }
+
+  const uint64_t now = now_usec();
+  const uint64_t left = deadline > now ? deadline - now : 0;
+#ifdef HAVE_EPOLL_PWAIT2
+  struct timespec ts;
+  ts.tv_sec = left / 1000000;
+  ts.tv_nsec = left % 1000000 * 1000;
+  int n = epoll_pwait2(epfd, events, maxevents, &ts, NULL);
+  if (n != -1 || errno != ENOSYS) {
+    return n;
+  }
+#endif
+  return epoll_wait(epfd, events, maxevents, (left + 999) / 1000);
+}
+
+// run one direction until it would block, its buffer is exhausted or the
+// per wakeup budget is spent
+enum fwio forward_drain(struct forward_ctx *fw, unsigned *ready, unsigned bit,
+                        int (*want)(const struct forward_ctx *),
+                        enum fwio (*io)(struct forward_ctx *)) {
+  int budget;
+
+  for (budget = EPOLL_IO_BUDGET; budget > 0 && (*ready & bit) && want(fw);
+       budget--) {
+    enum fwio r = io(fw);
+    if (r == FWIO_AGAIN) {
+      *ready &= ~bit;
+      break;
+    }
+    if (r != FWIO_OK) {
+      return r;
+    }
+  }
+
+  return FWIO_OK;
+}
+
+static int forward_loop_epoll(struct forward_ctx *fw, int epfd) {
+  struct epoll_event events[4];
+  unsigned ready = FWREADY_TR_IN | FWREADY_TR_OUT | FWREADY_IF_IN |
+                   FWREADY_IF_OUT;
+
+  for (;;) {
+    enum fwio r;
+
+    forward_stats(fw, "Tunnel");
+    forward_autosize(fw);
+
+    // transport -> interface
+    if ((r = forward_drain(fw, &ready, FWREADY_TR_IN, want_tr_read,
+                           do_tr_read)) != FWIO_OK) {
+      return r == FWIO_EOF ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (forward_tr_to_if(fw) == -1) {
+      return EXIT_FAILURE;
+    }
+    if ((r = forward_drain(fw, &ready, FWREADY_IF_OUT, want_if_write,
+                           do_if_write)) != FWIO_OK) {
+      return r == FWIO_EOF ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // interface -> transport
+    if ((r = forward_drain(fw, &ready, FWREADY_IF_IN, want_if_read,
+                           do_if_read)) != FWIO_OK) {
+      return r == FWIO_EOF ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (forward_if_to_tr(fw) == -1) {
+      return EXIT_FAILURE;
+    }
+    if ((r = forward_drain(fw, &ready, FWREADY_TR_OUT, want_tr_write,
+                           do_tr_write)) != FWIO_OK) {
+      return r == FWIO_EOF ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // a direction that is ready and still has work goes round again
+    // without waiting for the kernel
+    unsigned wanted = 0;
+    if (want_tr_read(fw))
+      wanted |= FWREADY_TR_IN;
+    if (want_tr_write(fw))
+      wanted |= FWREADY_TR_OUT;
+    if (want_if_read(fw))
+      wanted |= FWREADY_IF_IN;
+    if (want_if_write(fw))
+      wanted |= FWREADY_IF_OUT;
+
+    const uint64_t deadline = forward_deadline(fw);
+    if (wanted == 0 && deadline == 0) {
+      print_idle_state(fw);
+      return EXIT_SUCCESS;
+    }
+    if (ready & wanted) {
+      continue;
+    }
+
+    forward_uncork(fw);
+    int n = epoll_wait_until(epfd, events,
+                             sizeof(events) / sizeof(events[0]), deadline);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return EXIT_FAILURE;
+    }
+
+    int i;
+    for (i = 0; i < n; i++) {
+      unsigned bits = events[i].data.u32;
+      uint32_t ev = events[i].events;
+
+      // errors and hangups are reported by the next read or write
+      if (ev & (EPOLLERR | EPOLLHUP)) {
+        ready |= bits;
+        continue;
+      }
+      if (ev & EPOLLIN)
+        ready |= bits & (FWREADY_TR_IN | FWREADY_IF_IN);
+      if (ev & EPOLLOUT)
+        ready |= bits & (FWREADY_TR_OUT | FWREADY_IF_OUT);
+    }
+  }
+}
+
+// ---------------------------------------------------
+// io_uring backend
+// ---------------------------------------------------
+
+// what a completion is for, in the upper half of its user data
+#define URING_OP_IF_READ 1
+#define URING_OP_IF_WRITE 2
+#define URING_OP_TR_READ 3
+#define URING_OP_TR_WRITE 4
+
+#define URING_SLOT_FREE 0
+#define URING_SLOT_BUSY 1
+#define URING_SLOT_DONE 2
+
+// interface reads go to slots of their own and are framed from there in
+// the order they completed, straight into the transfer send buffer if
+// nothing waits ahead of them, else copied into the read buffer (or the
+// queues) as it has room; writes to the device
+// go from the head of the interface write source, which is consumed as
+// the oldest completes. The transfer is one write and one read (or a
+// multishot receive into provided buffers) in flight.
+struct forward_uring {
+  struct uring ring;
+
+  char *if_slots;
+  size_t if_slot_size;
+  int if_slot_state[URING_IF_READS];
+  ssize_t if_slot_len[URING_IF_READS];
+  unsigned if_done[URING_IF_READS];
+  unsigned if_done_head;
+  unsigned if_done_tail;
+
+  struct {
+    size_t len;
+    int done;
+  } if_writes[URING_IF_WRITES];
+  unsigned if_write_head;
+  unsigned if_write_tail;
+  size_t if_write_off;
+
+  int tr_writing;
+  struct iovec tr_iov[2];
+  int tr_iovcnt;
+  size_t tr_info;
+
+  int tr_reading;
+  int multishot;
+  struct uring_bufs recv_bufs;
+  struct uring_recv {
+    int buf_id;
+    size_t len;
+    size_t off;
+  } recv_done[URING_RECV_BUFS];
+  unsigned recv_head;
+  unsigned recv_tail;
+};
+
+static uint64_t uring_tag(int op, unsigned index) {
+  return (uint64_t)op << 32 | index;
+}
+
+static void forward_uring_free(struct forward_uring *u) {
+  uring_bufs_free(&u->ring, &u->recv_bufs);
+  uring_free(&u->ring);
+  free(u->if_slots);
+}
+
+static int is_socket(int fd) {
+  struct stat st;
+  return fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+static int set_nonblock(int fd, int on) {
+  const int flags = fcntl(fd, F_GETFL);
+  if (flags == -1) {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+static int forward_uring_init(struct forward_ctx *fw,
+                              struct forward_uring *u) {
+  memset(u, 0, sizeof(*u));
+  if (uring_init(&u->ring, URING_ENTRIES) == -1) {
+    return -1;
+  }
+  u->if_slot_size = fw->frame_hdr_size + fw->max_frame_size;
+  u->if_slots = malloc(URING_IF_READS * u->if_slot_size);
+  if (u->if_slots == NULL) {
+    goto fail;
+  }
+
+  // best effort: without them the operations go by descriptor and address
+  const int fds[] = {fw->if_read_fd, fw->if_write_fd, fw->tr_ifd, fw->tr_ofd};
+  uring_register_files(&u->ring, fds, sizeof(fds) / sizeof(fds[0]));
+  const struct iovec bufs[] = {
+      {u->if_slots, URING_IF_READS * u->if_slot_size},
+      {fw->if_read_buf.base, 2 * fw->if_read_buf.size},
+      {fw->if_write_buf.base, 2 * fw->if_write_buf.size},
+      {fw->tr_recv_buf.base, 2 * fw->tr_recv_buf.size},
+      {fw->tr_send_buf.base, 2 * fw->tr_send_buf.size},
+  };
+  if (uring_register_buffers(&u->ring, bufs, sizeof(bufs) / sizeof(bufs[0])) ==
+      -1) {
+    uring_register_buffers(&u->ring, bufs, 1);
+  }
+
+  if (is_socket(fw->tr_ifd) &&
+      uring_bufs_init(&u->ring, &u->recv_bufs, 0, URING_RECV_BUFS,
+                      URING_RECV_BUF_SIZE) == 0) {
+    u->multishot = 1;
+  }
+
+  // operations wait in the ring for the descriptors to become ready
+  // rather than fail with EAGAIN; the epoll fallback needs them back
+  if (set_nonblock(fw->if_read_fd, 0) == -1 ||
+      set_nonblock(fw->tr_ifd, 0) == -1 || set_nonblock(fw->tr_ofd, 0) == -1) {
+    const int err = errno;
+    set_nonblock(fw->if_read_fd, 1);
+    set_nonblock(fw->tr_ifd, 1);
+    set_nonblock(fw->tr_ofd, 1);
+    errno = err;
+    goto fail;
+  }
+  return 0;
+
+fail:;
+  const int err = errno;
+  forward_uring_free(u);
+  errno = err;
+  return -1;
+}
+
+// completed interface reads, in order, as the transfer send buffer or the
+// read buffer has room; returns 1 if any was taken, 0 if none, or -1 on
+// fatal errors
+static int uring_if_read_deliver(struct forward_ctx *fw,
+                                 struct forward_uring *u) {
+  // the queues, batch mode and pass-through take frames from the buffers
+  const int direct = !fw->prio && !fw->aqm && !fw->passthrough &&
+                     fw->batch_size == 0;
+  const uint64_t now = fw->incompressible != NULL ? now_msec() : 0;
+  int delivered = 0;
+
+  while (u->if_done_head != u->if_done_tail) {
+    const unsigned i = u->if_done[u->if_done_head % URING_IF_READS];
+    char *slot = u->if_slots + i * u->if_slot_size;
+    const size_t rsiz = u->if_slot_len[i];
+
+    if (!if_read_check(fw, rsiz, u->if_slot_size - IF_FRAME_SIZE_LEN)) {
+      // dropped
+    } else if (direct && ringbuf_used(&fw->if_read_buf) == 0) {
+      write_packet_size(slot, rsiz - fw->vnet_hdr_len);
+      const int r = forward_packet_to_tr(fw, slot, now);
+      if (r == -1)
+        return -1;
+      if (r == 0) {
+        if (!want_if_read(fw))
+          break;
+        if_read_put(fw, slot, rsiz);
+      }
+    } else {
+      if (!want_if_read(fw))
+        break;
+      if_read_put(fw, slot, rsiz);
+    }
+    u->if_done_head++;
+    u->if_slot_state[i] = URING_SLOT_FREE;
+    delivered = 1;
+  }
+  return delivered;
+}
+
+// received data, in order, as the transfer receive buffer has room
+static int uring_tr_read_deliver(struct forward_ctx *fw,
+                                 struct forward_uring *u) {
+  int delivered = 0;
+
+  while (u->recv_head != u->recv_tail &&
+         ringbuf_space(&fw->tr_recv_buf) > 0) {
+    struct uring_recv *r = &u->recv_done[u->recv_head % URING_RECV_BUFS];
+    size_t len = r->len - r->off;
+    if (len > ringbuf_space(&fw->tr_recv_buf))
+      len = ringbuf_space(&fw->tr_recv_buf);
+    memcpy(ringbuf_tail(&fw->tr_recv_buf),
+           uring_bufs_get(&u->recv_bufs, r->buf_id) + r->off, len);
+    ringbuf_produce(&fw->tr_recv_buf, len);
+    r->off += len;
+    if (r->off == r->len) {
+      uring_bufs_recycle(&u->recv_bufs, r->buf_id);
+      u->recv_head++;
+    }
+    delivered = 1;
+  }
+  return delivered;
+}
+
+// queue what can go in flight now
+static void uring_queue(struct forward_ctx *fw, struct forward_uring *u) {
+  struct ringbuf *if_src =
+      fw->passthrough ? &fw->tr_recv_buf : &fw->if_write_buf;
+  unsigned i;
+  size_t len;
+
+  for (i = 0; i < URING_IF_READS; i++) {
+    if (u->if_slot_state[i] != URING_SLOT_FREE)
+      continue;
+    char *slot = u->if_slots + i * u->if_slot_size;
+    if (uring_read(&u->ring, fw->if_read_fd, &slot[IF_FRAME_SIZE_LEN],
+                   u->if_slot_size - IF_FRAME_SIZE_LEN,
+                   uring_tag(URING_OP_IF_READ, i)) == -1)
+      return;
+    u->if_slot_state[i] = URING_SLOT_BUSY;
+  }
+
+  while (u->if_write_tail - u->if_write_head < URING_IF_WRITES &&
+         (len = if_write_frame_size(fw, u->if_write_off)) != 0) {
+    const unsigned index = u->if_write_tail % URING_IF_WRITES;
+    const char *frame = ringbuf_data(if_src) + u->if_write_off;
+    if (uring_write(&u->ring, fw->if_write_fd, &frame[IF_FRAME_SIZE_LEN],
+                    len - IF_FRAME_SIZE_LEN,
+                    uring_tag(URING_OP_IF_WRITE, index)) == -1)
+      return;
+    u->if_writes[index].len = len;
+    u->if_writes[index].done = 0;
+    u->if_write_tail++;
+    u->if_write_off += len;
+  }
+
+  if (!u->tr_writing && forward_queue_to_tr(fw) == 0 &&
+      (u->tr_iovcnt = tr_write_iov(fw, u->tr_iov, &u->tr_info)) > 0) {
+    const int r =
+        u->tr_iovcnt == 1
+            ? uring_write(&u->ring, fw->tr_ofd, u->tr_iov[0].iov_base,
+                          u->tr_iov[0].iov_len,
+                          uring_tag(URING_OP_TR_WRITE, 0))
+            : uring_writev(&u->ring, fw->tr_ofd, u->tr_iov, u->tr_iovcnt,
+                           uring_tag(URING_OP_TR_WRITE, 0));
+    if (r == -1)
+      return;
+    u->tr_writing = 1;
+  }
+
+  if (!u->tr_reading) {
+    if (u->multishot) {
+      // once the held back data has been taken and the buffers are back
+      if (u->recv_head == u->recv_tail &&
+          uring_recv_multishot(&u->ring, fw->tr_ifd, &u->recv_bufs,
+                               uring_tag(URING_OP_TR_READ, 0)) == 0)
+        u->tr_reading = 1;
+    } else if (ringbuf_space(&fw->tr_recv_buf) > 0 &&
+               uring_read(&u->ring, fw->tr_ifd, ringbuf_tail(&fw->tr_recv_buf),
+                          ringbuf_space(&fw->tr_recv_buf),
+                          uring_tag(URING_OP_TR_READ, 0)) == 0) {
+      u->tr_reading = 1;
+    }
+  }
+}
+
+static enum fwio uring_complete(struct forward_ctx *fw,
+                                struct forward_uring *u,
+                                const struct uring_completion *c) {
+  const unsigned index = (uint32_t)c->user_data;
+
+  switch (c->user_data >> 32) {
+  case URING_OP_IF_READ:
+    if (c->res < 0) {
+      fprintf(stderr, "read: %s\n", strerror(-c->res));
+      return FWIO_ERROR;
+    }
+    if (c->res == 0) {
+      return FWIO_EOF;
+    }
+    u->if_slot_state[index] = URING_SLOT_DONE;
+    u->if_slot_len[index] = c->res;
+    u->if_done[u->if_done_tail++ % URING_IF_READS] = index;
+    break;
+
+  case URING_OP_IF_WRITE: {
+    struct ringbuf *rb =
+        fw->passthrough ? &fw->tr_recv_buf : &fw->if_write_buf;
+    if (c->res < 0) {
+      fprintf(stderr, "write: %s\n", strerror(-c->res));
+      return FWIO_ERROR;
+    }
+    u->if_writes[index].done = 1;
+    while (u->if_write_head != u->if_write_tail &&
+           u->if_writes[u->if_write_head % URING_IF_WRITES].done) {
+      const size_t len = u->if_writes[u->if_write_head++ % URING_IF_WRITES].len;
+      ringbuf_consume(rb, len);
+      u->if_write_off -= len;
+    }
+    break;
+  }
+
+  case URING_OP_TR_WRITE:
+    u->tr_writing = 0;
+    if (c->res < 0) {
+      fprintf(stderr, "write: %s\n", strerror(-c->res));
+      return FWIO_ERROR;
+    }
+    tr_write_done(fw, u->tr_info, c->res, 0);
+    break;
+
+  case URING_OP_TR_READ:
+    if (!c->more)
+      u->tr_reading = 0;
+    // the buffers ran out, the receive is rearmed once they are back
+    if (c->res == -ENOBUFS)
+      break;
+    // no multishot receive in this kernel, reads then
+    if (c->res == -EINVAL && u->multishot) {
+      u->multishot = 0;
+      break;
+    }
+    if (c->res < 0) {
+      fprintf(stderr, "read: %s\n", strerror(-c->res));
+      return FWIO_ERROR;
+    }
+    if (c->res == 0) {
+      return FWIO_EOF;
+    }
+    if (c->buf_id == -1) {
+      ringbuf_produce(&fw->tr_recv_buf, c->res);
+      break;
+    }
+    u->recv_done[u->recv_tail % URING_RECV_BUFS].buf_id = c->buf_id;
+    u->recv_done[u->recv_tail % URING_RECV_BUFS].len = c->res;
+    u->recv_done[u->recv_tail % URING_RECV_BUFS].off = 0;
+    u->recv_tail++;
+    break;
+  }
+  return FWIO_OK;
+}
+
+static int forward_loop_uring(struct forward_ctx *fw, struct forward_uring *u) {
+  for (;;) {
+    struct uring_completion c;
+    int delivered;
+
+    forward_stats(fw, "Tunnel");
+
+    // transport -> interface, and interface -> transport, as far as the
+    // buffers let completed reads in
+    do {
+      if (forward_tr_to_if(fw) == -1) {
+        return EXIT_FAILURE;
+      }
+    } while (uring_tr_read_deliver(fw, u));
+    do {
+      if (forward_if_to_tr(fw) == -1) {
+        return EXIT_FAILURE;
+      }
+    } while ((delivered = uring_if_read_deliver(fw, u)) == 1);
+    if (delivered == -1) {
+      return EXIT_FAILURE;
+    }
+
+    uring_queue(fw, u);
+    if (!u->tr_writing) {
+      forward_uncork(fw);
+    }
+
+    // submit and reap in one go, until the next deadline if any
+    const uint64_t deadline = forward_deadline(fw);
+    int64_t timeout = -1;
+    if (deadline != 0) {
+      const uint64_t now = now_usec();
+      timeout = deadline > now ? deadline - now : 0;
+    }
+    if (uring_submit_and_wait(&u->ring, 1, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("io_uring_enter");
+      return EXIT_FAILURE;
+    }
+
+    while (uring_reap(&u->ring, &c)) {
+      enum fwio r = uring_complete(fw, u, &c);
+      if (r != FWIO_OK) {
+        return r == FWIO_EOF ? EXIT_SUCCESS : EXIT_FAILURE;
+      }
+    }
+  }
+}
+
+// the token bucket size for a rate in bytes per second
+size_t pace_burst(const struct forward_ctx *fw, uint64_t rate) {
+  const size_t frame = fw->tr_frame_hdr_size + fw->max_frame_size;
+  size_t burst = fw->optsp->burst;
+
+  if (burst == 0) {
+    burst = rate * PACE_BURST_DEF_USEC / 1000000;
+    if (burst < frame)
+      burst = frame;
+  }
+  return burst;
+}
+
+// the interface framing is the transfer framing when nothing is encoded;
+// the hub keeps encoding, its clients share encoded frames
+static int forward_can_pass_through(const struct forward_ctx *fw) {
+  return (fw->compflag == COMPFLAG_UNSPEC || fw->compflag == COMPFLAG_NONE) &&
+         fw->frame_flags_len == 0 && fw->batch_size == 0 && !fw->datagram &&
+         !fw->prio && !fw->aqm;
+}
+
+// grow a pipe towards size, halving it while that is more than an
+// unprivileged process may have; returns the capacity, or -1 if fd is no pipe
+static int set_pipe_size(int fd, size_t size) {
+  const int cur = fcntl(fd, F_GETPIPE_SZ);
+
+  if (cur == -1)
+    return -1;
+  for (; size > (size_t)cur; size /= 2) {
+    if (fcntl(fd, F_SETPIPE_SZ, (int)size) != -1 || errno != EPERM)
+      break;
+  }
+  return fcntl(fd, F_GETPIPE_SZ);
+}
+
+// stdio over pipes (e.g. under ssh): size them like the transfer buffers.
+// Frames are not vmspliced out: a reader that splices them on would keep
+// the ring's pages after they left the pipe, while the ring reuses them.
+static void forward_pipe_init(struct forward_ctx *fw) {
+  const struct {
+    int fd;
+    size_t size;
+    const char *name;
+  } pipes[] = {
+      {fw->tr_ifd, fw->tr_recv_buf.size, "stdin"},
+      {fw->tr_ofd, fw->tr_send_buf.size, "stdout"},
+  };
+  unsigned i;
+
+  for (i = 0; i < sizeof(pipes) / sizeof(pipes[0]); i++) {
+    const int size = set_pipe_size(pipes[i].fd, pipes[i].size);
+    // no pipe, nothing to grow
+    if (size == -1 && (errno == EBADF || errno == EINVAL))
+      continue;
+    if (size == -1) {
+      perror("fcntl F_SETPIPE_SZ");
+    } else if ((size_t)size < pipes[i].size) {
+      fprintf(stderr, "Warn: The %s pipe holds %d of %zu bytes (see "
+                      "/proc/sys/fs/pipe-max-size)\n",
+              pipes[i].name, size, pipes[i].size);
+    }
+  }
+}
+
+// zero copy sends, if the socket takes them
+static void forward_zerocopy_init(struct forward_ctx *fw) {
+  const int on = 1;
+
+  if (setsockopt(fw->tr_ofd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) ==
+      -1) {
+    perror("Cannot set SO_ZEROCOPY, copying");
+    return;
+  }
+  fw->zerocopy = fw->optsp->zerocopy;
+}
+
+// cap the transfer at the rate, split between the queue workers: TCP paces
+// in the kernel, other transports or kernels in userspace
+static void forward_pace_init(struct forward_ctx *fw) {
+  const struct tuncat_commandline_options *optsp = fw->optsp;
+  const unsigned long rate = optsp->rate / 8 / (optsp->queues ?: 1);
+
+  if (optsp->trmode == TRMODE_SERVER || optsp->trmode == TRMODE_CLIENT) {
+    if (setsockopt(fw->tr_ofd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                   sizeof(rate)) == 0) {
+      return;
+    }
+    perror("Cannot set SO_MAX_PACING_RATE, pacing in userspace");
+  }
+
+  pace_init(&fw->pacer, rate, pace_burst(fw, rate));
+  fw->pace = &fw->pacer;
+}
+
+void forward_free(struct forward_ctx *fw) {
+  int q;
+
+  for (q = 0; q < FLOW_CLASSES; q++) {
+    if (q != FLOW_CLASS_DEFAULT)
+      ringbuf_free(&fw->prio_bufs[q]);
+  }
+  if (fw->aqm) {
+    if (fw->aqm_pending != NULL)
+      aqm_release(&fw->aqm_queue, fw->aqm_pending);
+    aqm_free(&fw->aqm_queue);
+  }
+  ringbuf_free(&fw->if_read_buf);
+  ringbuf_free(&fw->if_write_buf);
+  ringbuf_free(&fw->tr_recv_buf);
+  ringbuf_free(&fw->tr_send_buf);
+  free(fw->dgram_buf);
+  flow_cache_free(fw->incompressible);
+  codec_free(&fw->tx_codec);
+  codec_free(&fw->rx_codec);
+}
+
+int forward_init(struct forward_ctx *fw,
+                 struct tuncat_commandline_options *optsp, int tunfd,
+                 int tr_ifd, int tr_ofd) {
+  memset(fw, 0, sizeof(*fw));
+  fw->optsp = optsp;
+  fw->compflag = optsp->compflag;
+  fw->max_frame_size = optsp->max_frame_size ?: IF_MAX_FRAME_SIZE_DEF;
+  fw->vnet_hdr_len = optsp->offload ? sizeof(struct virtio_net_hdr) : 0;
+  fw->frame_hdr_size = IF_FRAME_SIZE_LEN + fw->vnet_hdr_len;
+  fw->batch_size = optsp->batch_size;
+  fw->frame_flags_len =
+      fw->compflag == COMPFLAG_ADAPTIVE || fw->batch_size > 0 ? FRAME_FLAGS_LEN
+                                                              : 0;
+  fw->tr_frame_hdr_size = fw->frame_hdr_size + fw->frame_flags_len;
+  fw->if_read_fd = tunfd;
+  fw->if_write_fd = tunfd;
+  fw->tr_ifd = tr_ifd;
+  fw->tr_ofd = tr_ofd;
+  fw->datagram = optsp->trmode == TRMODE_UDP_SERVER ||
+                 optsp->trmode == TRMODE_UDP_CLIENT;
+  fw->cork = optsp->sockopts.cork == 1 && !fw->datagram;
+
+  const size_t if_read_buf_size =
+      optsp->ifbuffer_size ?: 2 * fw->max_frame_size;
+  const size_t if_write_buf_size =
+      optsp->ifbuffer_size ?: 2 * fw->max_frame_size;
+  const size_t tr_recv_buf_size =
+      optsp->trbuffer_size ?: optsp->trbuffer_min ?: if_write_buf_size;
+  const size_t tr_send_buf_size =
+      optsp->trbuffer_size ?: optsp->trbuffer_min ?: if_read_buf_size;
+
+  const int ring_flags = optsp->hugepages ? RINGBUF_HUGEPAGES : 0;
+
+  if (ringbuf_init(&fw->if_read_buf, if_read_buf_size, ring_flags) == -1 ||
+      ringbuf_init(&fw->if_write_buf, if_write_buf_size, ring_flags) == -1 ||
+      ringbuf_init(&fw->tr_recv_buf, tr_recv_buf_size, ring_flags) == -1 ||
+      ringbuf_init(&fw->tr_send_buf, tr_send_buf_size, ring_flags) == -1) {
+    goto fail;
+  }
+
+  // the first sample once the connection had time to measure
+  if (optsp->trbuffer_auto && tr_ofd != -1 && !fw->datagram) {
+    fw->autosize = 1;
+    fw->autosize_next = now_usec() + TR_AUTO_INTERVAL;
+    fw->autosize_min = fw->tr_send_buf.size < fw->tr_recv_buf.size
+                           ? fw->tr_send_buf.size
+                           : fw->tr_recv_buf.size;
+    fw->autosize_max = optsp->trbuffer_max ?: TR_BUFFER_AUTO_MAX_DEF;
+    if (fw->autosize_max < fw->autosize_min)
+      fw->autosize_max = fw->autosize_min;
+  }
+
+  if (fw->datagram && optsp->udp_offload) {
+    int optval = 1;
+
+    fw->udp_gso_size_max = udp_payload_max(tr_ofd);
+    if (setsockopt(tr_ifd, SOL_UDP, UDP_GRO, &optval, sizeof(optval)) == 0) {
+      fw->udp_gro = 1;
+    } else {
+      perror("Cannot enable UDP GRO");
+    }
+  }
+
+  // the hub's interface reader only stages packets for its clients
+  if (optsp->prio && tr_ofd != -1) {
+    int q;
+    fw->prio = optsp->prio;
+    for (q = 0; q < FLOW_CLASSES; q++) {
+      if (q == FLOW_CLASS_DEFAULT) {
+        fw->prio_queue[q] = &fw->if_read_buf;
+      } else if (ringbuf_init(&fw->prio_bufs[q], if_read_buf_size,
+                              ring_flags) == -1) {
+        goto fail;
+      } else {
+        fw->prio_queue[q] = &fw->prio_bufs[q];
+      }
+    }
+  }
+
+  // striped streams are paced together by the hub
+  if (optsp->rate > 0 && optsp->streams == 0 && tr_ofd != -1) {
+    forward_pace_init(fw);
+  }
+
+  // the interface read buffer size bounds the AQM backlog
+  if (optsp->aqm && tr_ofd != -1) {
+    if (aqm_init(&fw->aqm_queue,
+                 optsp->aqm == AQMMODE_FQ_CODEL ? AQM_FLOWS_DEF : 1,
+                 if_read_buf_size, optsp->aqm_target,
+                 optsp->aqm_interval) == -1) {
+      goto fail;
+    }
+    fw->aqm = optsp->aqm;
+    fw->aqm_queue.mark = aqm_mark;
+    fw->aqm_queue.mark_arg = fw;
+  }
+
+  if ((fw->compflag == COMPFLAG_COMPRESS ||
+       fw->compflag == COMPFLAG_ADAPTIVE) &&
+      codec_init(&fw->tx_codec, optsp->codec ?: CODEC_DEFAULT,
+                 optsp->codec_level) == -1) {
+    goto fail;
+  }
+  if (optsp->dict != NULL &&
+      codec_set_dictionary(&fw->tx_codec, optsp->dict, optsp->dict_size) ==
+          -1) {
+    goto fail;
+  }
+
+  if (fw->compflag == COMPFLAG_ADAPTIVE && optsp->incompressible_hold > 0) {
+    fw->incompressible = flow_cache_new();
+    if (fw->incompressible == NULL) {
+      goto fail;
+    }
+  }
+
+  if (fw->datagram && fw->batch_size > 0) {
+    // a block is sent as one datagram, keep it within the path MTU
+    const size_t mtu_payload = udp_payload_max(tr_ofd);
+    if (mtu_payload > fw->tr_frame_hdr_size &&
+        fw->batch_size > mtu_payload - fw->tr_frame_hdr_size) {
+      fw->batch_size = mtu_payload - fw->tr_frame_hdr_size;
+    }
+  }
+
+  if (fw->datagram) {
+    fw->dgram_slot_size = fw->tr_frame_hdr_size + IF_MAX_FRAME_SIZE_MAX;
+    fw->dgram_buf = malloc(UDP_BATCH_SIZE * fw->dgram_slot_size);
+    if (fw->dgram_buf == NULL) {
+      perror("malloc");
+      goto fail;
+    }
+  }
+
+  if (fcntl(tunfd, F_SETFL, O_NONBLOCK) == -1) {
+    perror("fcntl");
+    goto fail;
+  }
+  if (tr_ifd != -1 && fcntl(tr_ifd, F_SETFL, O_NONBLOCK) == -1) {
+    perror("fcntl");
+    goto fail;
+  }
+  if (tr_ofd != -1 && tr_ifd != tr_ofd &&
+      fcntl(tr_ofd, F_SETFL, O_NONBLOCK) == -1) {
+    perror("fcntl");
+    goto fail;
+  }
+
+  return 0;
+
+fail:
+  forward_free(fw);
+  return -1;
+}
+
+int forward_packets(int argc, char *const argv[],
+                    struct tuncat_commandline_options *optsp, int tunfd,
+                    int tr_ifd, int tr_ofd) {
+  (void)argc;
+  (void)argv;
+
+  struct forward_ctx fw;
+  int ret = EXIT_FAILURE;
+
+  // after the handshake the kernel does the records, the rest sees the
+  // plain stream
+  if (optsp->tls_ctx != NULL &&
+      tls_start(optsp->tls_ctx, tr_ifd,
+                optsp->trmode == TRMODE_CLIENT ? optsp->node : NULL) == -1) {
+    return EXIT_FAILURE;
+  }
+
+  if (forward_init(&fw, optsp, tunfd, tr_ifd, tr_ofd) == -1) {
+    return EXIT_FAILURE;
+  }
+
+  fw.passthrough = forward_can_pass_through(&fw);
+  if (optsp->trmode == TRMODE_STDIO) {
+    forward_pipe_init(&fw);
+  }
+  if (optsp->zerocopy && !fw.datagram) {
+    forward_zerocopy_init(&fw);
+  }
+
+  // Transfer Information
+  put_trinfo(&fw);
+
+  // datagrams are batched by recvmmsg() and sendmmsg() already
+  if (optsp->evmode == EVMODE_URING && !fw.datagram) {
+    struct forward_uring u;
+    if (forward_uring_init(&fw, &u) == 0) {
+      ret = forward_loop_uring(&fw, &u);
+      forward_uring_free(&u);
+      goto end;
+    }
+    perror("Cannot set up io_uring, using epoll");
+  }
+  if (optsp->evmode == EVMODE_EPOLL || optsp->evmode == EVMODE_URING) {
+    int epfd = epoll_setup(&fw);
+    if (epfd != -1) {
+      ret = forward_loop_epoll(&fw, epfd);
+      close(epfd);
+      goto end;
+    }
+    // e.g. stdio redirected from a regular file, which epoll refuses
+    if (errno != EPERM) {
+      perror("epoll");
+      goto end;
+    }
+  }
+  ret = forward_loop_select(&fw);
+
+end:
+  forward_free(&fw);
+  return ret;
+}
+
+struct forward_worker {
+  int argc;
+  char *const *argv;
+  struct tuncat_commandline_options *optsp;
+  int index;
+  int tunfd;
+  int sock;
+  int busy;
+  int ret;
+};
+
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_cond = PTHREAD_COND_INITIALIZER;
+
+// pin the calling thread to the index-th CPU it is allowed to run on
+static void pin_worker(int index) {
+  cpu_set_t allowed, set;
+  int cpu, n;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    perror("sched_getaffinity");
+    return;
+  }
+  n = index % CPU_COUNT(&allowed);
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+      break;
+  }
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0) {
+    fprintf(stderr, "Cannot pin worker %d to CPU %d: %s\n", index, cpu,
+            strerror(err));
+  }
+}
+
+static int run_worker(struct forward_worker *w) {
+  if (w->optsp->cpu_affinity) {
+    pin_worker(w->index);
+  }
+  return forward_packets(w->argc, w->argv, w->optsp, w->tunfd, w->sock,
+                         w->sock);
+}
+
+static void *client_worker_main(void *arg) {
+  struct forward_worker *w = arg;
+  const int ret = run_worker(w);
+
+  pthread_mutex_lock(&workers_lock);
+  w->ret = ret;
+  w->busy = 0;
+  pthread_cond_signal(&workers_cond);
+  pthread_mutex_unlock(&workers_lock);
+  return NULL;
+}
+
+static void *server_worker_main(void *arg) {
+  struct forward_worker *w = arg;
+
+  run_worker(w);
+  close(w->sock);
+  set_tunqueue(w->tunfd, 0);
+
+  pthread_mutex_lock(&workers_lock);
+  w->busy = 0;
+  pthread_cond_signal(&workers_cond);
+  pthread_mutex_unlock(&workers_lock);
+  return NULL;
+}
+
+// client mode: queue i is forwarded over connection i
+static int run_queues(int argc, char *const argv[],
+                      struct tuncat_commandline_options *optsp,
+                      const int *socks, const int *tunfds) {
+  const int nqueues = optsp->queues;
+  struct forward_worker workers[nqueues];
+  int i;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < nqueues; i++) {
+    workers[i].argc = argc;
+    workers[i].argv = argv;
+    workers[i].optsp = optsp;
+    workers[i].index = i;
+    workers[i].tunfd = tunfds[i];
+    workers[i].sock = socks[i];
+    workers[i].busy = 1;
+  }
+
+  for (i = 0; i < nqueues; i++) {
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, client_worker_main, &workers[i]);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      return EXIT_FAILURE;
+    }
+  }
+
+  // the tunnel is only complete with every queue, so one ending ends all
+  pthread_mutex_lock(&workers_lock);
+  for (;;) {
+    for (i = 0; i < nqueues; i++) {
+      if (!workers[i].busy) {
+        const int ret = workers[i].ret;
+        pthread_mutex_unlock(&workers_lock);
+        return ret;
+      }
+    }
+    pthread_cond_wait(&workers_cond, &workers_lock);
+  }
+}
+
+// whether two socket addresses have the same host, ports aside
+static int same_host(const struct sockaddr_storage *a,
+                     const struct sockaddr_storage *b) {
+  if (a->ss_family != b->ss_family)
+    return 0;
+  if (a->ss_family == AF_INET)
+    return ((const struct sockaddr_in *)a)->sin_addr.s_addr ==
+           ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+  if (a->ss_family == AF_INET6)
+    return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+                  &((const struct sockaddr_in6 *)b)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+  return 0;
+}
+
+// server mode: every accepted connection is bound to an idle queue, and
+// only queues that are being served stay attached to the device. The
+// kernel spreads the packets of the device over the queues by flow, so
+// they serve one peer: connections from another host are refused until
+// all queues are idle again.
+static int serve_queues(int argc, char *const argv[],
+                        struct tuncat_commandline_options *optsp, int sock,
+                        const int *tunfds) {
+  const int nqueues = optsp->queues;
+  struct forward_worker workers[nqueues];
+  struct sockaddr_storage peer;
+  pthread_attr_t attr;
+  int i;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&peer, 0, sizeof(peer));
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (i = 0; i < nqueues; i++) {
+    workers[i].argc = argc;
+    workers[i].argv = argv;
+    workers[i].optsp = optsp;
+    workers[i].index = i;
+    workers[i].tunfd = tunfds[i];
+    workers[i].sock = -1;
+    workers[i].busy = 0;
+    if (set_tunqueue(tunfds[i], 0) == -1) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  for (;;) {
+    struct forward_worker *w = NULL;
+
+    pthread_mutex_lock(&workers_lock);
+    for (;;) {
+      for (i = 0; i < nqueues; i++) {
+        if (!workers[i].busy) {
+          w = &workers[i];
+          break;
+        }
+      }
+      if (w != NULL)
+        break;
+      pthread_cond_wait(&workers_cond, &workers_lock);
+    }
+    pthread_mutex_unlock(&workers_lock);
+
+    struct sockaddr_storage caddr;
+    socklen_t clen = sizeof(caddr);
+    int csock = accept(sock, (struct sockaddr *)&caddr, &clen);
+    if (csock == -1) {
+      perror("accept");
+      return EXIT_FAILURE;
+    }
+
+    pthread_mutex_lock(&workers_lock);
+    int nbusy = 0;
+    for (i = 0; i < nqueues; i++) {
+      nbusy += workers[i].busy;
+    }
+    if (nbusy > 0 && !same_host(&caddr, &peer)) {
+      pthread_mutex_unlock(&workers_lock);
+      fprintf(stderr, "Warn: Refused a connection from a second peer\n");
+      close(csock);
+      continue;
+    }
+    peer = caddr;
+    w->busy = 1;
+    pthread_mutex_unlock(&workers_lock);
+
+    if (set_tunqueue(w->tunfd, 1) == -1) {
+      close(csock);
+      pthread_mutex_lock(&workers_lock);
+      w->busy = 0;
+      pthread_mutex_unlock(&workers_lock);
+      continue;
+    }
+
+    pthread_t thread;
+    w->sock = csock;
+    int err = pthread_create(&thread, &attr, server_worker_main, w);
+    if (err != 0) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      return EXIT_FAILURE;
+    }
+  }
+}
+
+static void *read_file(const char *path, size_t *len) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror(path);
+    return NULL;
+  }
+
+  char *buf = NULL;
+  long size;
+  if (fseek(fp, 0, SEEK_END) == -1 || (size = ftell(fp)) == -1 ||
+      fseek(fp, 0, SEEK_SET) == -1) {
+    perror(path);
+    goto end;
+  }
+  buf = malloc(size ?: 1);
+  if (buf == NULL) {
+    perror("malloc");
+    goto end;
+  }
+  if (fread(buf, 1, size, fp) != (size_t)size) {
+    fprintf(stderr, "%s: Short read\n", path);
+    free(buf);
+    buf = NULL;
+    goto end;
+  }
+  *len = size;
+end:
+  fclose(fp);
+  return buf;
+}
+
+// sample the packets sent to the interface, each cut to
+// DICT_SAMPLE_SIZE_MAX, and train a dictionary for -D from them
+static int train_dictionary(struct tuncat_commandline_options *optsp,
+                            int tunfd) {
+  const unsigned nsamples = optsp->train_samples ?: DICT_SAMPLES_DEF;
+  char *samples = malloc((size_t)nsamples * DICT_SAMPLE_SIZE_MAX);
+  size_t *sizes = malloc(nsamples * sizeof(*sizes));
+  char *dict = malloc(DICT_SIZE);
+  size_t total = 0, dict_size;
+  unsigned n = 0;
+  int ret = EXIT_FAILURE;
+
+  if (samples == NULL || sizes == NULL || dict == NULL) {
+    perror("malloc");
+    goto end;
+  }
+
+  fprintf(stderr, "Sampling %u packets\n", nsamples);
+  while (n < nsamples) {
+    // a longer packet is truncated by the read, which still returns its
+    // whole length
+    ssize_t rsiz = read(tunfd, &samples[total], DICT_SAMPLE_SIZE_MAX);
+    if (rsiz == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("read");
+      goto end;
+    }
+    if (rsiz == 0) {
+      break;
+    }
+    if (rsiz > DICT_SAMPLE_SIZE_MAX) {
+      rsiz = DICT_SAMPLE_SIZE_MAX;
+    }
+    sizes[n++] = rsiz;
+    total += rsiz;
+  }
+
+  if (codec_train_dictionary(CODEC_ZSTD, dict, DICT_SIZE, samples, sizes, n,
+                             &dict_size) == -1) {
+    goto end;
+  }
+
+  FILE *fp = fopen(optsp->train_dict_file, "wb");
+  if (fp == NULL) {
+    perror(optsp->train_dict_file);
+    goto end;
+  }
+  if (fwrite(dict, 1, dict_size, fp) != dict_size || fclose(fp) == EOF) {
+    perror(optsp->train_dict_file);
+    goto end;
+  }
+  fprintf(stderr, "Dictionary %u (%zu bytes) written to %s\n",
+          codec_dictionary_id(CODEC_ZSTD, dict, dict_size), dict_size,
+          optsp->train_dict_file);
+  ret = EXIT_SUCCESS;
+
+end:
+  free(samples);
+  free(sizes);
+  free(dict);
+  return ret;
+}
+
+// ---------------------------------------------------
+// Transfer socket settings
+// ---------------------------------------------------
+
+static const struct sockopt_desc {
+  const char *name;
+  size_t offset;
+  // a switch (0 or 1), else a size
+  int flag;
+  // TCP only
+  int stream;
+  int level;
+  int optname;
+} sockopt_descs[] = {
+    {SOCKOPT_NODELAY_OPT, offsetof(struct sockopts, nodelay), 1, 1,
+     IPPROTO_TCP, TCP_NODELAY},
+    {SOCKOPT_CORK_OPT, offsetof(struct sockopts, cork), 1, 1, IPPROTO_TCP,
+     TCP_CORK},
+    {SOCKOPT_NOTSENT_LOWAT_OPT, offsetof(struct sockopts, notsent_lowat), 0,
+     1, IPPROTO_TCP, TCP_NOTSENT_LOWAT},
+    {SOCKOPT_SNDBUF_OPT, offsetof(struct sockopts, sndbuf), 0, 0, SOL_SOCKET,
+     SO_SNDBUF},
+    {SOCKOPT_RCVBUF_OPT, offsetof(struct sockopts, rcvbuf), 0, 0, SOL_SOCKET,
+     SO_RCVBUF},
+    {SOCKOPT_RCVLOWAT_OPT, offsetof(struct sockopts, rcvlowat), 0, 1,
+     SOL_SOCKET, SO_RCVLOWAT},
+};
+
+#define SOCKOPT_DESCS (sizeof(sockopt_descs) / sizeof(sockopt_descs[0]))
+
+static int *sockopt_field(struct sockopts *so, const struct sockopt_desc *d) {
+  return (int *)((char *)so + d->offset);
+}
+
+static int sockopt_get(const struct sockopts *so,
+                       const struct sockopt_desc *d) {
+  return *(const int *)((const char *)so + d->offset);
+}
+
+static void sockopts_init(struct sockopts *so) {
+  size_t i;
+  for (i = 0; i < SOCKOPT_DESCS; i++)
+    *sockopt_field(so, &sockopt_descs[i]) = -1;
+}
+
+// <name>=<value>[,...], sizes may end in k or m; returns 0 or -1
+static int parse_sockopts(struct sockopts *so, const char *arg) {
+  while (*arg != '\0') {
+    const size_t len = strcspn(arg, "=,");
+    const struct sockopt_desc *d = NULL;
+    size_t i;
+    char *e;
+
+    for (i = 0; i < SOCKOPT_DESCS; i++) {
+      if (strlen(sockopt_descs[i].name) == len &&
+          strncmp(sockopt_descs[i].name, arg, len) == 0)
+        d = &sockopt_descs[i];
+    }
+    if (d == NULL || arg[len] != '=')
+      return -1;
+
+    errno = 0;
+    long value = strtol(&arg[len + 1], &e, 0);
+    long unit = 1;
+    if (e == &arg[len + 1] || errno == ERANGE)
+      return -1;
+    if (!d->flag && *e == 'k') {
+      unit = 1024;
+      e++;
+    } else if (!d->flag && *e == 'm') {
+      unit = 1048576;
+      e++;
+    }
+    // checked before scaling, which could overflow
+    if (value < (d->flag ? 0 : 1) ||
+        value > (d->flag ? 1 : SOCK_BUFFER_MAX / unit) ||
+        (*e != ',' && *e != '\0'))
+      return -1;
+    value *= unit;
+    *sockopt_field(so, d) = value;
+    arg = *e == ',' ? e + 1 : e;
+  }
+  return 0;
+}
+
+// the settings of the profile, and over them those given on their own
+static void sockopts_resolve(struct sockopts *so, enum sockprofile profile,
+                             const struct sockopts *set) {
+  size_t i;
+
+  sockopts_init(so);
+  switch (profile) {
+  case SOCKPROFILE_NONE:
+    break;
+  case SOCKPROFILE_LATENCY:
+    so->nodelay = 1;
+    so->cork = 0;
+    so->notsent_lowat = SOCK_NOTSENT_LOWAT_LATENCY;
+    so->rcvlowat = 1;
+    break;
+  case SOCKPROFILE_THROUGHPUT:
+    // the cork is pulled at the end of each batch of writes, Nagle would
+    // only hold the last segment back then
+    so->nodelay = 1;
+    so->cork = 1;
+    so->sndbuf = SOCK_BUFFER_THROUGHPUT;
+    so->rcvbuf = SOCK_BUFFER_THROUGHPUT;
+    break;
+  }
+
+  for (i = 0; i < SOCKOPT_DESCS; i++) {
+    const int v = sockopt_get(set, &sockopt_descs[i]);
+    if (v != -1)
+      *sockopt_field(so, &sockopt_descs[i]) = v;
+  }
+}
+
+// applied before the socket connects or listens, so that the window scale
+// fits the receive buffer; accepted connections inherit the settings
+static int set_sockopts(int sock, const struct sockopts *so, int stream) {
+  size_t i;
+
+  for (i = 0; i < SOCKOPT_DESCS; i++) {
+    const struct sockopt_desc *d = &sockopt_descs[i];
+    const int v = sockopt_get(so, d);
+    if (v == -1 || (d->stream && !stream))
+      continue;
+    if (setsockopt(sock, d->level, d->optname, &v, sizeof(v)) == -1) {
+      fprintf(stderr, "Cannot set %s: %s\n", d->name, strerror(errno));
+      return -1;
+    }
+
+    // the kernel doubles buffer sizes for its bookkeeping, and caps them
+    // at net.core.wmem_max and rmem_max
+    if (d->level == SOL_SOCKET && d->optname != SO_RCVLOWAT) {
+      int got;
+      socklen_t len = sizeof(got);
+      if (getsockopt(sock, d->level, d->optname, &got, &len) == 0 &&
+          got / 2 < v) {
+        fprintf(stderr, "Warn: %s is limited to %d by the system\n",
+                d->name, got / 2);
+      }
+    }
+  }
+  return 0;
 }
 
 int main(int argc, char *const argv[]) {
@@ -962,9 +3915,38 @@ int main(int argc, char *const argv[]) {
       {"ipv4", no_argument, NULL, '4'},
       {"ipv6", no_argument, NULL, '6'},
       {"compress", no_argument, NULL, 'c'},
+      {"adaptive-compress", optional_argument, NULL, 'C'},
+      {"incompressible-hold", required_argument, NULL, 'H'},
+      {"codec", required_argument, NULL, 'Z'},
+      {"dictionary", required_argument, NULL, 'D'},
+      {"train-dictionary", required_argument, NULL, 'Y'},
+      {"train-samples", required_argument, NULL, 'S'},
+      {"batch-size", required_argument, NULL, 'B'},
+      {"batch-latency", required_argument, NULL, 'L'},
+      {"priority", optional_argument, NULL, 'P'},
+      {"aqm", required_argument, NULL, 'Q'},
+      {"rate", required_argument, NULL, 'r'},
+      {"burst", required_argument, NULL, 'k'},
+      {"event-backend", required_argument, NULL, 'E'},
+      {"queues", required_argument, NULL, 'q'},
+      {"streams", required_argument, NULL, 's'},
+      {"hub", no_argument, NULL, 'x'},
+      {"route", required_argument, NULL, 'R'},
+      {"default-route", no_argument, NULL, 'd'},
+      {"cpu-affinity", no_argument, NULL, 'A'},
+      {"offload", no_argument, NULL, 'O'},
+      {"udp-offload", no_argument, NULL, 'U'},
       {"max-frame-size", required_argument, NULL, 'F'},
       {"ifbuffer-size", required_argument, NULL, 'I'},
       {"trbuffer-size", required_argument, NULL, 'T'},
+      {"hugepages", no_argument, NULL, 'g'},
+      {"zerocopy", optional_argument, NULL, 'z'},
+      {"profile", required_argument, NULL, 'M'},
+      {"sockopt", required_argument, NULL, 'W'},
+      {"tls", no_argument, NULL, 'e'},
+      {"tls-cert", required_argument, NULL, 'K'},
+      {"tls-key", required_argument, NULL, 'J'},
+      {"tls-ca", required_argument, NULL, 'V'},
       {"version", no_argument, NULL, 'v'},
       {"help", no_argument, NULL, 'h'},
       {0, 0, 0, 0},
@@ -972,8 +3954,13 @@ int main(int argc, char *const argv[]) {
 
   memset(&opts, 0, sizeof(opts));
 
+  // -W settings, laid over the -M profile once all options are in
+  struct sockopts sockopts;
+  int sockopts_given = 0;
+  sockopts_init(&sockopts);
+
   int optindex = 0;
-  while ((opt = getopt_long(argc, argv, "m:n:b:i:a:t:l:p:46cI:T:F:vh", longopts,
+  while ((opt = getopt_long(argc, argv, "m:n:b:i:a:t:l:p:46M:W:eK:J:V:cC::H:Z:D:Y:S:B:L:P::Q:r:k:gz::E:q:s:xR:dAOUI:T:F:vh", longopts,
                             &optindex)) != -1) {
     switch (opt) {
     case 'm':
@@ -1036,6 +4023,10 @@ int main(int argc, char *const argv[]) {
         opts.trmode = TRMODE_SERVER;
       } else if (strcmp(optarg, TRMODE_CLIENT_OPT) == 0) {
         opts.trmode = TRMODE_CLIENT;
+      } else if (strcmp(optarg, TRMODE_UDP_SERVER_OPT) == 0) {
+        opts.trmode = TRMODE_UDP_SERVER;
+      } else if (strcmp(optarg, TRMODE_UDP_CLIENT_OPT) == 0) {
+        opts.trmode = TRMODE_UDP_CLIENT;
       } else {
         fprintf(stderr, "Invalid transfer mode \"%s\"\n", optarg);
         print_usage(stderr, argc, argv);
@@ -1064,23 +4055,437 @@ int main(int argc, char *const argv[]) {
         print_usage(stderr, argc, argv);
         return EXIT_FAILURE;
       }
-      opts.ipmode = IPMODE_IPV4;
+      opts.ipmode = IPMODE_IPV4;
+      break;
+    case '6':
+      if (opts.ipmode != IPMODE_UNSPEC) {
+        fprintf(stderr, "Duplicated option -4 or -6\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.ipmode = IPMODE_IPV6;
+      break;
+    case 'c':
+      if (opts.compflag != COMPFLAG_UNSPEC) {
+        fprintf(stderr, opts.compflag == COMPFLAG_COMPRESS
+                            ? "Duplicated option -c\n"
+                            : "-c and -C are exclusive\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.compflag = COMPFLAG_COMPRESS;
+      break;
+    case 'C':
+      if (opts.compflag != COMPFLAG_UNSPEC) {
+        fprintf(stderr, opts.compflag == COMPFLAG_ADAPTIVE
+                            ? "Duplicated option -C\n"
+                            : "-c and -C are exclusive\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.compflag = COMPFLAG_ADAPTIVE;
+      opts.compress_ratio = COMPRESS_RATIO_DEF;
+      if (optarg != NULL) {
+        char *p;
+        opts.compress_ratio = strtol(optarg, &p, 0);
+        if (p == optarg || *p != '\0') {
+          fprintf(stderr, "Invalid option value -C\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+        if (opts.compress_ratio < COMPRESS_RATIO_MIN ||
+            opts.compress_ratio > COMPRESS_RATIO_MAX) {
+          fprintf(stderr, "Invalid option value -C\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 'Z':
+      if (opts.codec != CODEC_UNSPEC) {
+        fprintf(stderr, "Duplicated option -Z\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      if (codec_parse(optarg, &opts.codec, &opts.codec_level) == -1) {
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'H':
+      if (opts.incompressible_hold != 0) {
+        fprintf(stderr, "Duplicated option -H\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        char *p;
+        opts.incompressible_hold = strtol(optarg, &p, 0);
+        if (p == optarg || *p != '\0') {
+          fprintf(stderr, "Invalid option value -H\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+        if (opts.incompressible_hold < 0 ||
+            opts.incompressible_hold > INCOMPRESSIBLE_HOLD_MAX) {
+          fprintf(stderr, "Invalid option value -H\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 'M':
+      if (opts.profile != SOCKPROFILE_NONE) {
+        fprintf(stderr, "Duplicated option -M\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      if (strcmp(optarg, SOCKPROFILE_LATENCY_OPT) == 0) {
+        opts.profile = SOCKPROFILE_LATENCY;
+      } else if (strcmp(optarg, SOCKPROFILE_THROUGHPUT_OPT) == 0) {
+        opts.profile = SOCKPROFILE_THROUGHPUT;
+      } else {
+        fprintf(stderr, "Invalid option value -M\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'W':
+      if (parse_sockopts(&sockopts, optarg) == -1) {
+        fprintf(stderr, "Invalid option value -W\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      sockopts_given = 1;
+      break;
+    case 'e':
+      opts.tls = 1;
+      break;
+    case 'K':
+      if (opts.tls_cert != NULL) {
+        fprintf(stderr, "Duplicated option -K\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.tls_cert = optarg;
+      break;
+    case 'J':
+      if (opts.tls_key != NULL) {
+        fprintf(stderr, "Duplicated option -J\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.tls_key = optarg;
+      break;
+    case 'V':
+      if (opts.tls_ca != NULL) {
+        fprintf(stderr, "Duplicated option -V\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.tls_ca = optarg;
+      break;
+    case 'D':
+      if (opts.dict_file != NULL) {
+        fprintf(stderr, "Duplicated option -D\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.dict_file = optarg;
+      break;
+    case 'Y':
+      if (opts.train_dict_file != NULL) {
+        fprintf(stderr, "Duplicated option -Y\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.train_dict_file = optarg;
+      break;
+    case 'S':
+      if (opts.train_samples != 0) {
+        fprintf(stderr, "Duplicated option -S\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        char *p;
+        opts.train_samples = strtol(optarg, &p, 0);
+        if (p == optarg || *p != '\0') {
+          fprintf(stderr, "Invalid option value -S\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+        if (opts.train_samples < DICT_SAMPLES_MIN ||
+            opts.train_samples > DICT_SAMPLES_MAX) {
+          fprintf(stderr, "Invalid option value -S\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 'B':
+      if (opts.batch_size != 0) {
+        fprintf(stderr, "Duplicated option -B\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        char *p;
+        opts.batch_size = strtoul(optarg, &p, 0);
+        if (p == optarg || *p != '\0') {
+          fprintf(stderr, "Invalid option value -B\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+        if (opts.batch_size < BATCH_SIZE_MIN ||
+            opts.batch_size > BATCH_SIZE_MAX) {
+          fprintf(stderr, "Invalid option value -B\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 'L':
+      if (opts.batch_latency != 0) {
+        fprintf(stderr, "Duplicated option -L\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        char *p;
+        opts.batch_latency = strtol(optarg, &p, 0);
+        if (p == optarg || *p != '\0') {
+          fprintf(stderr, "Invalid option value -L\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+        if (opts.batch_latency < 0 ||
+            opts.batch_latency > BATCH_LATENCY_MAX) {
+          fprintf(stderr, "Invalid option value -L\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 'P':
+      if (opts.prio != PRIOMODE_NONE) {
+        fprintf(stderr, "Duplicated option -P\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.prio_weights[FLOW_CLASS_INTERACTIVE] = PRIO_WEIGHT_INTERACTIVE_DEF;
+      opts.prio_weights[FLOW_CLASS_DEFAULT] = PRIO_WEIGHT_DEFAULT_DEF;
+      opts.prio_weights[FLOW_CLASS_BULK] = PRIO_WEIGHT_BULK_DEF;
+      if (optarg == NULL || strcmp(optarg, PRIOMODE_STRICT_OPT) == 0) {
+        opts.prio = PRIOMODE_STRICT;
+      } else if (strncmp(optarg, PRIOMODE_WEIGHTED_OPT,
+                         strlen(PRIOMODE_WEIGHTED_OPT)) == 0) {
+        const char *p = optarg + strlen(PRIOMODE_WEIGHTED_OPT);
+        int q;
+        opts.prio = PRIOMODE_WEIGHTED;
+        if (*p == ':') {
+          // <interactive>,<default>,<bulk>
+          for (q = 0; q < FLOW_CLASSES; q++) {
+            char *e;
+            opts.prio_weights[q] = strtol(p + 1, &e, 0);
+            if (e == p + 1 || opts.prio_weights[q] < 1 ||
+                opts.prio_weights[q] > PRIO_WEIGHT_MAX ||
+                *e != (q < FLOW_CLASSES - 1 ? ',' : '\0')) {
+              fprintf(stderr, "Invalid option value -P\n");
+              print_usage(stderr, argc, argv);
+              return EXIT_FAILURE;
+            }
+            p = e;
+          }
+        } else if (*p != '\0') {
+          fprintf(stderr, "Invalid option value -P\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      } else {
+        fprintf(stderr, "Invalid option value -P\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'Q': {
+      size_t len = strcspn(optarg, ":");
+      if (opts.aqm != AQMMODE_NONE) {
+        fprintf(stderr, "Duplicated option -Q\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      if (len == strlen(AQMMODE_CODEL_OPT) &&
+          strncmp(optarg, AQMMODE_CODEL_OPT, len) == 0) {
+        opts.aqm = AQMMODE_CODEL;
+      } else if (len == strlen(AQMMODE_FQ_CODEL_OPT) &&
+                 strncmp(optarg, AQMMODE_FQ_CODEL_OPT, len) == 0) {
+        opts.aqm = AQMMODE_FQ_CODEL;
+      } else {
+        fprintf(stderr, "Invalid option value -Q\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.aqm_target = AQM_TARGET_DEF;
+      opts.aqm_interval = AQM_INTERVAL_DEF;
+      if (optarg[len] == ':') {
+        // <target>[,<interval>]
+        char *p = &optarg[len + 1], *e;
+        opts.aqm_target = strtol(p, &e, 0);
+        if (e != p && *e == ',') {
+          p = e + 1;
+          opts.aqm_interval = strtol(p, &e, 0);
+        }
+        if (e == p || *e != '\0' || opts.aqm_target <= 0 ||
+            opts.aqm_interval <= 0) {
+          fprintf(stderr, "Invalid option value -Q\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    }
+    case 'E':
+      if (opts.evmode != EVMODE_UNSPEC) {
+        fprintf(stderr, "Duplicated option -E\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      if (strcmp(optarg, EVMODE_EPOLL_OPT) == 0) {
+        opts.evmode = EVMODE_EPOLL;
+      } else if (strcmp(optarg, EVMODE_SELECT_OPT) == 0) {
+        opts.evmode = EVMODE_SELECT;
+      } else if (strcmp(optarg, EVMODE_URING_OPT) == 0) {
+        opts.evmode = EVMODE_URING;
+      } else {
+        fprintf(stderr, "Invalid event backend \"%s\"\n", optarg);
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'q':
+      if (opts.queues != 0) {
+        fprintf(stderr, "Duplicated option -q\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        char *p;
+        opts.queues = strtol(optarg, &p, 0);
+        if (p == optarg || *p != '\0') {
+          fprintf(stderr, "Invalid option value -q\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+        if (opts.queues < 1 || opts.queues > IF_QUEUES_MAX) {
+          fprintf(stderr, "Invalid option value -q\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 's':
+      if (opts.streams != 0) {
+        fprintf(stderr, "Duplicated option -s\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        char *p;
+        opts.streams = strtol(optarg, &p, 0);
+        if (p == optarg || *p != '\0') {
+          fprintf(stderr, "Invalid option value -s\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+        if (opts.streams < 1 || opts.streams > STREAMS_MAX) {
+          fprintf(stderr, "Invalid option value -s\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 'x':
+      if (opts.hub != 0) {
+        fprintf(stderr, "Duplicated option -x\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.hub = 1;
+      break;
+    case 'R':
+      if (opts.nroutes == ROUTES_MAX) {
+        fprintf(stderr, "Too many routes\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        struct route *r = &opts.routes[opts.nroutes];
+        if (route_parse(optarg, &r->family, r->addr, &r->plen) == -1) {
+          fprintf(stderr, "Invalid option value -R\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+        opts.nroutes++;
+      }
+      break;
+    case 'd':
+      if (opts.default_route != 0) {
+        fprintf(stderr, "Duplicated option -d\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.default_route = 1;
+      break;
+    case 'A':
+      if (opts.cpu_affinity != 0) {
+        fprintf(stderr, "Duplicated option -A\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.cpu_affinity = 1;
+      break;
+    case 'O':
+      if (opts.offload != 0) {
+        fprintf(stderr, "Duplicated option -O\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.offload = 1;
+      break;
+    case 'g':
+      if (opts.hugepages != 0) {
+        fprintf(stderr, "Duplicated option -g\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      opts.hugepages = 1;
       break;
-    case '6':
-      if (opts.ipmode != IPMODE_UNSPEC) {
-        fprintf(stderr, "Duplicated option -4 or -6\n");
+    case 'z':
+      if (opts.zerocopy != 0) {
+        fprintf(stderr, "Duplicated option -z\n");
         print_usage(stderr, argc, argv);
         return EXIT_FAILURE;
       }
-      opts.ipmode = IPMODE_IPV6;
+      opts.zerocopy = ZEROCOPY_SIZE_DEF;
+      if (optarg != NULL) {
+        char *p;
+        opts.zerocopy = strtoul(optarg, &p, 0);
+        if (p == optarg || *p != '\0' || opts.zerocopy < ZEROCOPY_SIZE_MIN ||
+            opts.zerocopy > TR_BUFFER_SIZE_MAX) {
+          fprintf(stderr, "Invalid option value -z\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
       break;
-    case 'c':
-      if (opts.compflag != COMPFLAG_UNSPEC) {
-        fprintf(stderr, "Duplicated option -c\n");
+    case 'U':
+      if (opts.udp_offload != 0) {
+        fprintf(stderr, "Duplicated option -U\n");
         print_usage(stderr, argc, argv);
         return EXIT_FAILURE;
       }
-      opts.compflag = COMPFLAG_COMPRESS;
+      opts.udp_offload = 1;
       break;
     case 'F':
       if (opts.max_frame_size != 0) {
@@ -1104,6 +4509,53 @@ int main(int argc, char *const argv[]) {
         }
       }
       break;
+    case 'r':
+      if (opts.rate != 0) {
+        fprintf(stderr, "Duplicated option -r\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        char *p;
+        opts.rate = strtoull(optarg, &p, 0);
+        switch (*p) {
+        case 'k':
+          opts.rate *= 1000;
+          p++;
+          break;
+        case 'm':
+          opts.rate *= 1000000;
+          p++;
+          break;
+        case 'g':
+          opts.rate *= 1000000000;
+          p++;
+          break;
+        }
+        if (p == optarg || *p != '\0' || opts.rate < PACE_RATE_MIN) {
+          fprintf(stderr, "Invalid option value -r\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
+    case 'k':
+      if (opts.burst != 0) {
+        fprintf(stderr, "Duplicated option -k\n");
+        print_usage(stderr, argc, argv);
+        return EXIT_FAILURE;
+      }
+      {
+        char *p;
+        opts.burst = strtoul(optarg, &p, 0);
+        if (p == optarg || *p != '\0' || opts.burst < PACE_QUANTUM ||
+            opts.burst > TR_BUFFER_SIZE_MAX) {
+          fprintf(stderr, "Invalid option value -k\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      }
+      break;
     case 'I':
       if (opts.ifbuffer_size != 0) {
         fprintf(stderr, "Duplicated option -I\n");
@@ -1127,12 +4579,40 @@ int main(int argc, char *const argv[]) {
       }
       break;
     case 'T':
-      if (opts.trbuffer_size != 0) {
+      if (opts.trbuffer_size != 0 || opts.trbuffer_auto) {
         fprintf(stderr, "Duplicated option -T\n");
         print_usage(stderr, argc, argv);
         return EXIT_FAILURE;
       }
-      {
+      if (strncmp(optarg, TR_BUFFER_AUTO_OPT, strlen(TR_BUFFER_AUTO_OPT)) ==
+          0) {
+        const char *p = optarg + strlen(TR_BUFFER_AUTO_OPT);
+        opts.trbuffer_auto = 1;
+        if (*p == ':') {
+          // <min>,<max>
+          char *e;
+          opts.trbuffer_min = strtoul(p + 1, &e, 0);
+          if (e == p + 1 || *e != ',') {
+            fprintf(stderr, "Invalid option value -T\n");
+            print_usage(stderr, argc, argv);
+            return EXIT_FAILURE;
+          }
+          p = e;
+          opts.trbuffer_max = strtoul(p + 1, &e, 0);
+          if (e == p + 1 || *e != '\0' ||
+              opts.trbuffer_min < TR_BUFFER_SIZE_MIN ||
+              opts.trbuffer_max > TR_BUFFER_SIZE_MAX ||
+              opts.trbuffer_min > opts.trbuffer_max) {
+            fprintf(stderr, "Invalid option value -T\n");
+            print_usage(stderr, argc, argv);
+            return EXIT_FAILURE;
+          }
+        } else if (*p != '\0') {
+          fprintf(stderr, "Invalid option value -T\n");
+          print_usage(stderr, argc, argv);
+          return EXIT_FAILURE;
+        }
+      } else {
         char *p;
         opts.trbuffer_size = strtoul(optarg, &p, 0);
         if (p == optarg || *p != '\0') {
@@ -1166,6 +4646,111 @@ int main(int argc, char *const argv[]) {
     opts.ifmode = IFMODE_DEFAULT;
   }
 
+  if (opts.evmode == EVMODE_UNSPEC) {
+    opts.evmode = EVMODE_DEFAULT;
+  }
+
+  if (opts.offload && opts.max_frame_size != 0 &&
+      opts.max_frame_size != IF_MAX_FRAME_SIZE_MAX) {
+    // offloaded super frames are only bounded by the 16 bit frame size
+    fprintf(stderr, "-F is not supported for offload mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.codec != CODEC_UNSPEC && opts.compflag == COMPFLAG_UNSPEC) {
+    // a codec alone means compressing every packet with it
+    opts.compflag = COMPFLAG_COMPRESS;
+  }
+
+  if (opts.offload && opts.compflag == COMPFLAG_COMPRESS) {
+    // a compressed 64 KiB super frame may not fit the 16 bit frame size;
+    // adaptive mode sends such frames raw instead
+    fprintf(stderr, "-c or -Z without -C is not supported for offload mode, "
+                    "use -C\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.dict_file != NULL && opts.codec != CODEC_ZSTD) {
+    fprintf(stderr, "-D is only supported with -Z %s\n", CODEC_ZSTD_OPT);
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.train_samples != 0 && opts.train_dict_file == NULL) {
+    fprintf(stderr, "-S is only supported with -Y\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.train_dict_file != NULL &&
+      (opts.offload || opts.queues > 1 || opts.dict_file != NULL)) {
+    fprintf(stderr, "-O, -q or -D is not supported with -Y\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.train_dict_file != NULL && codec_lookup(CODEC_ZSTD) == NULL) {
+    fprintf(stderr, "-Y needs the %s codec, which is not supported by this "
+                    "build\n",
+            CODEC_ZSTD_OPT);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.batch_size != 0 && opts.compflag != COMPFLAG_COMPRESS &&
+      opts.compflag != COMPFLAG_ADAPTIVE) {
+    fprintf(stderr, "-B is only supported with -c or -C\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.prio != PRIOMODE_NONE && opts.batch_size != 0) {
+    // a block would put packets of all classes back into one queue
+    fprintf(stderr, "-B is not supported with -P\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.aqm != AQMMODE_NONE && opts.prio != PRIOMODE_NONE) {
+    fprintf(stderr, "-Q is not supported with -P\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.aqm != AQMMODE_NONE && opts.batch_size != 0) {
+    // blocks are encoded from the interface read buffer, which AQM bypasses
+    fprintf(stderr, "-B is not supported with -Q\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.burst != 0 && opts.rate == 0) {
+    fprintf(stderr, "-k is only supported with -r\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.batch_latency != 0 && opts.batch_size == 0) {
+    fprintf(stderr, "-L is only supported with -B\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.incompressible_hold != 0 && opts.compflag != COMPFLAG_ADAPTIVE) {
+    fprintf(stderr, "-H is only supported with -C\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  // a super frame does not fit a datagram
+  if (opts.offload &&
+      (opts.trmode == TRMODE_UDP_SERVER || opts.trmode == TRMODE_UDP_CLIENT)) {
+    fprintf(stderr, "-O is not supported for UDP mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
   if (opts.brname != NULL && opts.ifmode == IFMODE_L3) {
     fprintf(stderr, "-b is not supported for L3 mode\n");
     print_usage(stderr, argc, argv);
@@ -1192,9 +4777,24 @@ int main(int argc, char *const argv[]) {
     if (opts.ipmode != 0) {
       fprintf(stderr, "-4 or -6 is not supported for stdio mode\n");
     }
+    if (opts.queues > 1) {
+      fprintf(stderr, "-q is not supported for stdio mode\n");
+      print_usage(stderr, argc, argv);
+      return EXIT_FAILURE;
+    }
     break;
 
   case TRMODE_SERVER:
+    if (opts.hub && opts.queues > 1) {
+      fprintf(stderr, "-q is not supported for hub mode\n");
+      print_usage(stderr, argc, argv);
+      return EXIT_FAILURE;
+    }
+    if (opts.hub && opts.evmode != EVMODE_EPOLL) {
+      fprintf(stderr, "-x is only supported with -E %s\n", EVMODE_EPOLL_OPT);
+      print_usage(stderr, argc, argv);
+      return EXIT_FAILURE;
+    }
     break;
 
   case TRMODE_CLIENT:
@@ -1204,8 +4804,168 @@ int main(int argc, char *const argv[]) {
       return EXIT_FAILURE;
     }
     break;
+
+  case TRMODE_UDP_CLIENT:
+    if (opts.node == NULL) {
+      fprintf(stderr, "-l is required for client mode\n");
+      print_usage(stderr, argc, argv);
+      return EXIT_FAILURE;
+    }
+    // fall through
+  case TRMODE_UDP_SERVER:
+    if (opts.queues > 1) {
+      fprintf(stderr, "-q is not supported for UDP mode\n");
+      print_usage(stderr, argc, argv);
+      return EXIT_FAILURE;
+    }
+    break;
+  }
+
+  if (opts.streams == 1) {
+    opts.streams = 0;
+  }
+
+  if (opts.streams > 0 &&
+      (opts.trmode != TRMODE_SERVER && opts.trmode != TRMODE_CLIENT)) {
+    fprintf(stderr, "-s is only supported for TCP server or TCP client "
+                    "mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.streams > 0 && (opts.queues > 1 || opts.hub)) {
+    fprintf(stderr, "-q or -x is not supported with -s\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.streams > 0 && opts.evmode != EVMODE_EPOLL) {
+    fprintf(stderr, "-s is only supported with -E %s\n", EVMODE_EPOLL_OPT);
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.zerocopy &&
+      (opts.trmode != TRMODE_SERVER && opts.trmode != TRMODE_CLIENT)) {
+    fprintf(stderr, "-z is only supported for TCP server or TCP client "
+                    "mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.zerocopy && (opts.streams > 0 || opts.hub)) {
+    fprintf(stderr, "-s or -x is not supported with -z\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  // the error queue wakes the epoll loop only
+  if (opts.zerocopy && opts.evmode != EVMODE_EPOLL) {
+    fprintf(stderr, "-z is only supported with -E %s\n", EVMODE_EPOLL_OPT);
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.tls &&
+      (opts.trmode != TRMODE_SERVER && opts.trmode != TRMODE_CLIENT)) {
+    fprintf(stderr, "-e is only supported for TCP server or TCP client "
+                    "mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (!opts.tls &&
+      (opts.tls_cert != NULL || opts.tls_key != NULL || opts.tls_ca != NULL)) {
+    fprintf(stderr, "-K, -J or -V is only supported with -e\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.tls_key != NULL && opts.tls_cert == NULL) {
+    fprintf(stderr, "-J is not supported without -K\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.tls && opts.trmode == TRMODE_SERVER && opts.tls_cert == NULL) {
+    fprintf(stderr, "-K is required for -e in server mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  // kernel TLS takes no MSG_ZEROCOPY sends
+  if (opts.tls && opts.zerocopy) {
+    fprintf(stderr, "-z is not supported with -e\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.tls && opts.trmode == TRMODE_CLIENT && opts.tls_ca == NULL) {
+    fprintf(stderr, "Warn: The server is not verified without -V\n");
+  }
+
+  if (opts.trbuffer_auto &&
+      (opts.trmode != TRMODE_SERVER && opts.trmode != TRMODE_CLIENT)) {
+    fprintf(stderr, "-T %s is only supported for TCP server or TCP client "
+                    "mode\n",
+            TR_BUFFER_AUTO_OPT);
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.trbuffer_auto && (opts.streams > 0 || opts.hub)) {
+    fprintf(stderr, "-s or -x is not supported with -T %s\n",
+            TR_BUFFER_AUTO_OPT);
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  // io_uring has the buffers registered
+  if (opts.trbuffer_auto && opts.evmode == EVMODE_URING) {
+    fprintf(stderr, "-T %s is not supported with -E %s\n", TR_BUFFER_AUTO_OPT,
+            EVMODE_URING_OPT);
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.hub && opts.trmode != TRMODE_SERVER) {
+    fprintf(stderr, "-x is only supported for TCP server mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.default_route && !opts.hub) {
+    fprintf(stderr, "-d is only supported with -x\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (opts.udp_offload && opts.trmode != TRMODE_UDP_SERVER &&
+      opts.trmode != TRMODE_UDP_CLIENT) {
+    fprintf(stderr, "-U is only supported for UDP mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if ((opts.profile != SOCKPROFILE_NONE || sockopts_given) &&
+      opts.trmode == TRMODE_STDIO) {
+    fprintf(stderr, "-M or -W is not supported for stdio mode\n");
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if ((opts.trmode == TRMODE_UDP_SERVER || opts.trmode == TRMODE_UDP_CLIENT) &&
+      (sockopts.nodelay != -1 || sockopts.cork != -1 ||
+       sockopts.notsent_lowat != -1 || sockopts.rcvlowat != -1)) {
+    fprintf(stderr, "-W %s, %s, %s or %s is only supported for TCP mode\n",
+            SOCKOPT_NODELAY_OPT, SOCKOPT_CORK_OPT, SOCKOPT_NOTSENT_LOWAT_OPT,
+            SOCKOPT_RCVLOWAT_OPT);
+    print_usage(stderr, argc, argv);
+    return EXIT_FAILURE;
   }
 
+  sockopts_resolve(&opts.sockopts, opts.profile, &sockopts);
+
   if (opts.port == NULL) {
     opts.port = PORT_DEFAULT;
   }
@@ -1216,15 +4976,57 @@ int main(int argc, char *const argv[]) {
     return EXIT_FAILURE;
   }
 
+  if (opts.prio != PRIOMODE_NONE || opts.aqm != AQMMODE_NONE || opts.hub ||
+      opts.streams > 0) {
+    signal(SIGUSR1, request_stats);
+  }
+
+  if (opts.tls) {
+    struct tls_config tls = {
+        .server = opts.trmode == TRMODE_SERVER,
+        .cert = opts.tls_cert,
+        .key = opts.tls_key,
+        .ca = opts.tls_ca,
+    };
+    opts.tls_ctx = tls_context_new(&tls);
+    if (opts.tls_ctx == NULL) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (opts.dict_file != NULL) {
+    opts.dict = read_file(opts.dict_file, &opts.dict_size);
+    if (opts.dict == NULL) {
+      return EXIT_FAILURE;
+    }
+    opts.dict_id = codec_dictionary_id(CODEC_ZSTD, opts.dict, opts.dict_size);
+    if (opts.dict_id == 0) {
+      fprintf(stderr, "%s: Invalid dictionary\n", opts.dict_file);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (opts.train_dict_file != NULL) {
+    int tunfd;
+    if (init_if(&opts, &tunfd) == -1) {
+      return EXIT_FAILURE;
+    }
+    return train_dictionary(&opts, tunfd);
+  }
+
   if (opts.trmode == TRMODE_STDIO) {
-    int tunfd = init_if(&opts);
-    if (tunfd == -1) {
+    int tunfd;
+    if (init_if(&opts, &tunfd) == -1) {
       return EXIT_FAILURE;
     }
     return forward_packets(argc, argv, &opts, tunfd, STDIN_FILENO,
                            STDOUT_FILENO);
   }
 
+  const int nqueues = opts.queues ?: 1;
+  const int nsocks = opts.streams ?: nqueues;
+  int socks[nsocks];
+
   {
     struct addrinfo aih, *airp, *rp;
     int s;
@@ -1241,9 +5043,12 @@ int main(int argc, char *const argv[]) {
       aih.ai_family = AF_INET6;
       break;
     }
-    if (opts.trmode == TRMODE_SERVER)
+    if (opts.trmode == TRMODE_SERVER || opts.trmode == TRMODE_UDP_SERVER)
       aih.ai_flags = AI_PASSIVE;
-    aih.ai_socktype = SOCK_STREAM;
+    aih.ai_socktype = opts.trmode == TRMODE_UDP_SERVER ||
+                              opts.trmode == TRMODE_UDP_CLIENT
+                          ? SOCK_DGRAM
+                          : SOCK_STREAM;
     aih.ai_protocol = 0;
     aih.ai_canonname = NULL;
     aih.ai_addr = NULL;
@@ -1258,7 +5063,12 @@ int main(int argc, char *const argv[]) {
       sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
       if (sock == -1)
         continue;
-      if (opts.trmode == TRMODE_SERVER) {
+      if (set_sockopts(sock, &opts.sockopts,
+                       rp->ai_socktype == SOCK_STREAM) == -1) {
+        close(sock);
+        return EXIT_FAILURE;
+      }
+      if (opts.trmode == TRMODE_SERVER || opts.trmode == TRMODE_UDP_SERVER) {
         int optval = 1;
         if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &optval,
                        sizeof(optval)) == -1) {
@@ -1280,22 +5090,102 @@ int main(int argc, char *const argv[]) {
       return EXIT_FAILURE;
     }
 
+    // one more connection per additional queue or stream, to the same peer
+    socks[0] = sock;
+    if (opts.trmode == TRMODE_CLIENT) {
+      int i;
+      for (i = 1; i < nsocks; i++) {
+        socks[i] = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (socks[i] == -1) {
+          perror("socket");
+          return EXIT_FAILURE;
+        }
+        if (set_sockopts(socks[i], &opts.sockopts, 1) == -1) {
+          return EXIT_FAILURE;
+        }
+        if (connect(socks[i], rp->ai_addr, rp->ai_addrlen) == -1) {
+          perror("connect");
+          return EXIT_FAILURE;
+        }
+      }
+    }
+
     freeaddrinfo(airp);
   }
 
-  int tunfd = init_if(&opts);
-  if (tunfd == -1) {
+  int tunfds[nqueues];
+  if (init_if(&opts, tunfds) == -1) {
     return EXIT_FAILURE;
   }
 
+  if (opts.trmode == TRMODE_UDP_SERVER) {
+    struct sockaddr_storage caddr;
+    socklen_t clen;
+    char info[IF_FRAME_SIZE_LEN + TRINFO_SIZE];
+    int dropped = 0;
+    const size_t hdr_size =
+        IF_FRAME_SIZE_LEN +
+        (opts.offload ? sizeof(struct virtio_net_hdr) : 0) +
+        (opts.compflag == COMPFLAG_ADAPTIVE || opts.batch_size > 0
+             ? FRAME_FLAGS_LEN
+             : 0);
+
+    // the peer is the sender of the first transfer information or, if that
+    // was lost or the server restarted, of the first well-formed frame,
+    // which is then decoded with our own settings; its datagram stays
+    // queued, datagrams before it are dropped
+    for (;;) {
+      clen = sizeof(caddr);
+      const ssize_t n = recvfrom(sock, info, sizeof(info), MSG_PEEK | MSG_TRUNC,
+                                 (struct sockaddr *)&caddr, &clen);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        perror("recvfrom");
+        return EXIT_FAILURE;
+      }
+      if (n == sizeof(info) && read_packet_size(info) == 0 &&
+          (unsigned char)info[IF_FRAME_SIZE_LEN] != TRINFO_OPTION) {
+        break;
+      }
+      if (n >= IF_FRAME_SIZE_LEN && read_packet_size(info) > 0 &&
+          (size_t)n == hdr_size + read_packet_size(info)) {
+        break;
+      }
+      if (!dropped) {
+        fprintf(stderr, "Warn: Dropped datagrams before the first frame of "
+                        "the peer\n");
+        dropped = 1;
+      }
+      recv(sock, info, sizeof(info), 0);
+    }
+    if (connect(sock, (struct sockaddr *)&caddr, clen) == -1) {
+      perror("connect");
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (opts.trmode == TRMODE_UDP_SERVER || opts.trmode == TRMODE_UDP_CLIENT) {
+    return forward_packets(argc, argv, &opts, tunfds[0], sock, sock);
+  }
+
   if (opts.trmode == TRMODE_SERVER) {
 
-    if (listen(sock, 5) == -1) {
+    // a set of streams connects at once
+    if (listen(sock, opts.streams > 5 ? opts.streams : 5) == -1) {
       perror("listen");
       close(sock);
       return EXIT_FAILURE;
     }
 
+    if (nqueues > 1) {
+      return serve_queues(argc, argv, &opts, sock, tunfds);
+    }
+
+    if (opts.hub || opts.streams > 0) {
+      return serve_hub(&opts, sock, tunfds[0], NULL);
+    }
+
     for (;;) {
       int csock;
       struct sockaddr caddr;
@@ -1319,12 +5209,26 @@ int main(int argc, char *const argv[]) {
 
       if (pid == 0) {
         close(sock);
-        return forward_packets(argc, argv, &opts, tunfd, csock, csock);
+        return forward_packets(argc, argv, &opts, tunfds[0], csock, csock);
       }
 
       close(csock);
     }
   } else {
-    return forward_packets(argc, argv, &opts, tunfd, sock, sock);
+    if (nqueues > 1) {
+      return run_queues(argc, argv, &opts, socks, tunfds);
+    }
+    if (opts.streams > 0) {
+      // lets the server tell the streams of this tunnel from others
+      if (getrandom(&opts.session, sizeof(opts.session), 0) !=
+          sizeof(opts.session)) {
+        opts.session = now_usec() ^ (uint64_t)getpid() << 32;
+      }
+      if (opts.session == 0) {
+        opts.session = 1;
+      }
+      return serve_hub(&opts, -1, tunfds[0], socks);
+    }
+    return forward_packets(argc, argv, &opts, tunfds[0], sock, sock);
   }
 }
@@ -11,6 +11,9 @@
 
 #include <stdio.h>
 
+#include "codec.h"
+#include "route.h"
+
 #define IF_MAX_FRAME_SIZE_DEF 65535
 #define IF_MAX_FRAME_SIZE_MIN 128
 #define IF_MAX_FRAME_SIZE_MAX 65535
@@ -21,8 +24,126 @@
 #define TR_BUFFER_SIZE_MIN IF_BUFFER_SIZE_MIN
 #define TR_BUFFER_SIZE_MAX IF_BUFFER_SIZE_MAX
 
+// adaptive transfer buffers: TCP_INFO is sampled every TR_AUTO_INTERVAL
+// usec while there is traffic, and the transfer and socket buffers follow
+// TR_AUTO_HEADROOM times the bandwidth-delay product
+#define TR_BUFFER_AUTO_OPT "auto"
+#define TR_BUFFER_AUTO_MAX_DEF 8388608
+#define TR_AUTO_INTERVAL 1000000
+#define TR_AUTO_HEADROOM 2
+
 #define IF_FRAME_SIZE_LEN 2
 
+// adaptive compression: a flags byte follows the frame size on the wire
+#define FRAME_FLAGS_LEN 1
+#define FRAME_FLAG_COMPRESSED 0x01
+#define FRAME_FLAG_BATCH 0x02
+
+#define BATCH_SIZE_MIN 256
+#define BATCH_SIZE_MAX 65535
+#define BATCH_LATENCY_MAX 1000000
+
+// store a packet raw unless it compresses to this percentage or less
+#define COMPRESS_RATIO_DEF 90
+#define COMPRESS_RATIO_MIN 1
+#define COMPRESS_RATIO_MAX 100
+
+#define INCOMPRESSIBLE_HOLD_MAX 3600000
+
+// transfer information follows a zero frame size: ifmode, compflag and
+// max frame size, or an option record (TRINFO_OPTION, id, length, value)
+#define TRINFO_SIZE 4
+#define TRINFO_OPTION 0xff
+#define TRINFO_OPTION_VNET_HDR 1
+#define TRINFO_OPTION_CODEC 2
+#define TRINFO_OPTION_BATCH 3
+#define TRINFO_OPTION_DICT 4
+
+#define TRINFO_OPTION_ROUTE 5
+#define TRINFO_OPTION_STREAMS 6
+#define TRINFO_OPTION_SESSION 7
+
+#define IF_QUEUES_MAX 256
+
+#define STREAMS_MAX 64
+
+// priority and AQM modes: the transfer send buffer is only filled up to
+// the backlog, so that packets wait where they can be scheduled or dropped
+#define QUEUE_SEND_BACKLOG 65536
+
+// priority mode: weighted classes get <weight> * quantum bytes per round
+#define PRIO_QUANTUM 1514
+#define PRIO_WEIGHT_INTERACTIVE_DEF 4
+#define PRIO_WEIGHT_DEFAULT_DEF 2
+#define PRIO_WEIGHT_BULK_DEF 1
+#define PRIO_WEIGHT_MAX 100
+
+// pacing: the rate is in bits per second; the userspace pacer's token
+// bucket holds the burst (default: that many microseconds of the rate, at
+// least a frame) and lets writes go when it has a quantum
+#define PACE_RATE_MIN 8000
+#define PACE_BURST_DEF_USEC 10000
+#define PACE_QUANTUM 1514
+
+// zero copy sends: writes of at least the threshold go with MSG_ZEROCOPY;
+// up to ZEROCOPY_SENDS_MAX sends wait for the kernel to release them
+#define ZEROCOPY_SIZE_DEF 16384
+#define ZEROCOPY_SIZE_MIN 1024
+#define ZEROCOPY_SENDS_MAX 256
+
+// socket profiles: latency keeps the unsent queue in the kernel short,
+// throughput gives the socket large fixed buffers
+#define SOCK_NOTSENT_LOWAT_LATENCY 16384
+#define SOCK_BUFFER_THROUGHPUT 4194304
+#define SOCK_BUFFER_MAX 1073741824
+
+// hub server: clients, routes a client announces, and host routes learned
+// from a client that announces none
+#define HUB_CLIENTS_MAX 4096
+#define ROUTES_MAX 64
+#define HUB_HANDSHAKES_MAX 64
+#define HUB_LEARN_MAX 16
+
+// hub server in L3 mode: a learned source address is forgotten after
+// 300 s, and learned again from the next packet of the client using it;
+// traffic from it in the last 75 s before that keeps it, checked at most
+// once a second per client
+#define HUB_ROUTE_AGING 300000
+#define HUB_ROUTE_REFRESH 75000
+
+// hub server in L2 mode: addresses of the switch, forgotten after 300 s
+// without a frame from them like a kernel bridge does
+#define HUB_FDB_SIZE 16384
+#define HUB_FDB_AGING 300000
+
+// shared frames a client can have queued, and the iovecs of one writev
+#define HUB_FANOUT_MAX 256
+#define HUB_IOV_MAX 64
+
+// dictionary training: packets sampled from the interface, each cut to
+// DICT_SAMPLE_SIZE_MAX, and the size of the resulting dictionary
+#define DICT_SAMPLES_DEF 4096
+#define DICT_SAMPLES_MIN 16
+#define DICT_SAMPLES_MAX 1048576
+#define DICT_SAMPLE_SIZE_MAX 2048
+#define DICT_SIZE 16384
+
+#define EPOLL_IO_BUDGET 64
+
+// io_uring backend: interface reads and writes kept in flight, and the
+// provided buffers of the transfer receive
+#define URING_ENTRIES 256
+#define URING_IF_READS 32
+#define URING_IF_WRITES 32
+#define URING_RECV_BUFS 32
+#define URING_RECV_BUF_SIZE 65536
+
+// largest UDP payload, an IPv4 datagram of 65535 bytes
+#define UDP_PAYLOAD_MAX 65507
+#define UDP_BATCH_SIZE 64
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_BYTES UDP_PAYLOAD_MAX
+
 enum ifmode {
   IFMODE_UNSPEC = 0,
   IFMODE_L3 = 1,
@@ -39,12 +160,16 @@ enum trmode {
   TRMODE_STDIO = 1,
   TRMODE_SERVER = 2,
   TRMODE_CLIENT = 3,
+  TRMODE_UDP_SERVER = 4,
+  TRMODE_UDP_CLIENT = 5,
   TRMODE_DEFAULT = TRMODE_STDIO,
 };
 
 #define TRMODE_STDIO_OPT "stdio"
 #define TRMODE_SERVER_OPT "server"
 #define TRMODE_CLIENT_OPT "client"
+#define TRMODE_UDP_SERVER_OPT "udp-server"
+#define TRMODE_UDP_CLIENT_OPT "udp-client"
 #define TRMODE_DEFAULT_OPT TRMODE_STDIO_OPT
 
 enum ipmode {
@@ -55,10 +180,77 @@ enum ipmode {
 
 #define PORT_DEFAULT "19876"
 
+enum evmode {
+  EVMODE_UNSPEC = 0,
+  EVMODE_SELECT = 1,
+  EVMODE_EPOLL = 2,
+  EVMODE_URING = 3,
+  EVMODE_DEFAULT = EVMODE_EPOLL,
+};
+
+#define EVMODE_SELECT_OPT "select"
+#define EVMODE_EPOLL_OPT "epoll"
+#define EVMODE_URING_OPT "uring"
+#define EVMODE_DEFAULT_OPT EVMODE_EPOLL_OPT
+
+enum sockprofile {
+  SOCKPROFILE_NONE = 0,
+  SOCKPROFILE_LATENCY = 1,
+  SOCKPROFILE_THROUGHPUT = 2,
+};
+
+#define SOCKPROFILE_LATENCY_OPT "latency"
+#define SOCKPROFILE_THROUGHPUT_OPT "throughput"
+
+// transfer socket settings, -1 leaves the kernel's default
+struct sockopts {
+  int nodelay;
+  int cork;
+  int notsent_lowat;
+  int sndbuf;
+  int rcvbuf;
+  int rcvlowat;
+};
+
+#define SOCKOPT_NODELAY_OPT "nodelay"
+#define SOCKOPT_CORK_OPT "cork"
+#define SOCKOPT_NOTSENT_LOWAT_OPT "notsent-lowat"
+#define SOCKOPT_SNDBUF_OPT "sndbuf"
+#define SOCKOPT_RCVBUF_OPT "rcvbuf"
+#define SOCKOPT_RCVLOWAT_OPT "rcvlowat"
+
+// priority classes, in the order strict priority serves them
+enum flow_class {
+  FLOW_CLASS_INTERACTIVE = 0,
+  FLOW_CLASS_DEFAULT = 1,
+  FLOW_CLASS_BULK = 2,
+};
+
+#define FLOW_CLASSES 3
+
+enum priomode {
+  PRIOMODE_NONE = 0,
+  PRIOMODE_STRICT = 1,
+  PRIOMODE_WEIGHTED = 2,
+};
+
+#define PRIOMODE_STRICT_OPT "strict"
+#define PRIOMODE_WEIGHTED_OPT "weighted"
+
+enum aqmmode {
+  AQMMODE_NONE = 0,
+  AQMMODE_CODEL = 1,
+  AQMMODE_FQ_CODEL = 2,
+};
+
+#define AQMMODE_CODEL_OPT "codel"
+#define AQMMODE_FQ_CODEL_OPT "fq_codel"
+
 enum compflag {
   COMPFLAG_UNSPEC = 0,
   COMPFLAG_NONE = 1,
   COMPFLAG_COMPRESS = 2,
+  COMPFLAG_ADAPTIVE = 3,
 };
 
 struct tuncat_commandline_options {
@@ -72,9 +264,56 @@ struct tuncat_commandline_options {
   char *port;
   enum ipmode ipmode;
   enum compflag compflag;
+  enum codec_id codec;
+  int codec_level;
+  int compress_ratio;
+  long incompressible_hold;
+  size_t batch_size;
+  long batch_latency;
+  char *dict_file;
+  char *train_dict_file;
+  int train_samples;
+
+  // the loaded dictionary, shared read only by all forward contexts
+  void *dict;
+  size_t dict_size;
+  unsigned dict_id;
+  enum evmode evmode;
+  int queues;
+  int cpu_affinity;
+  int streams;
+  // striped streams: the random id the client sends on each of them
+  uint64_t session;
+  enum priomode prio;
+  int prio_weights[FLOW_CLASSES];
+  enum aqmmode aqm;
+  long aqm_target;
+  long aqm_interval;
+  uint64_t rate;
+  size_t burst;
+  int hub;
+  int default_route;
+  struct route routes[ROUTES_MAX];
+  int nroutes;
+  int offload;
+  int udp_offload;
   size_t max_frame_size;
   size_t ifbuffer_size;
   size_t trbuffer_size;
+  int trbuffer_auto;
+  size_t trbuffer_min;
+  size_t trbuffer_max;
+  int hugepages;
+  size_t zerocopy;
+  enum sockprofile profile;
+  struct sockopts sockopts;
+  int tls;
+  char *tls_cert;
+  char *tls_key;
+  char *tls_ca;
+
+  // the TLS context, shared by all connections
+  void *tls_ctx;
 };
 
 void print_usage(FILE *, int, char *const[]);
@@ -0,0 +1,514 @@
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#if HAVE_DECL_IORING_REGISTER_PBUF_RING
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#ifndef IORING_SETUP_SINGLE_ISSUER
+#define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#endif
+
+#ifndef IORING_SETUP_DEFER_TASKRUN
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg,
+                 argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// completions are run in this thread when it waits for them, rather than
+// interrupting it; older kernels get the plainer setups
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  static const unsigned flags[] = {
+      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+      IORING_SETUP_COOP_TASKRUN,
+      0,
+  };
+  size_t i;
+  int fd = -1;
+
+  for (i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+    memset(p, 0, sizeof(*p));
+    // multishot receives can complete many times per submission
+    p->flags = flags[i] | IORING_SETUP_CQSIZE;
+    p->cq_entries = 4 * entries;
+    if ((fd = io_uring_setup(entries, p)) != -1 || errno != EINVAL)
+      break;
+  }
+  return fd;
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+  struct io_uring_params p;
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = uring_setup(entries, &p);
+  if (ring->fd == -1) {
+    return -1;
+  }
+  // timed waits and the fixed ring layout
+  if (!(p.features & IORING_FEAT_EXT_ARG) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    close(ring->fd);
+    ring->fd = -1;
+    errno = ENOSYS;
+    return -1;
+  }
+  ring->features = p.features;
+
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_map_size =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_size > ring->sq_map_size)
+      ring->sq_map_size = ring->cq_map_size;
+    ring->cq_map_size = ring->sq_map_size;
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_map = ring->sq_map;
+  } else {
+    ring->cq_map =
+        mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      ring->cq_map = NULL;
+      goto fail;
+    }
+  }
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  char *sq = ring->sq_map;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+
+  char *cq = ring->cq_map;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = cq + p.cq_off.cqes;
+  return 0;
+
+fail:;
+  const int err = errno;
+  if (ring->sq_map == MAP_FAILED)
+    ring->sq_map = NULL;
+  uring_free(ring);
+  errno = err;
+  return -1;
+}
+
+void uring_free(struct uring *ring) {
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+    munmap(ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map != NULL)
+    munmap(ring->sq_map, ring->sq_map_size);
+  if (ring->fd != -1)
+    close(ring->fd);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+int uring_register_files(struct uring *ring, const int *fds, unsigned n) {
+  if (n > URING_FILES_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (io_uring_register(ring->fd, IORING_REGISTER_FILES, (void *)fds, n) ==
+      -1) {
+    return -1;
+  }
+  memcpy(ring->files, fds, n * sizeof(*fds));
+  ring->nfiles = n;
+  return 0;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov,
+                           unsigned n) {
+  if (n > URING_BUFFERS_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, (void *)iov, n) ==
+      -1) {
+    return -1;
+  }
+  memcpy(ring->buffers, iov, n * sizeof(*iov));
+  ring->nbuffers = n;
+  return 0;
+}
+
+int uring_bufs_init(struct uring *ring, struct uring_bufs *bufs,
+                    unsigned short bgid, unsigned count, size_t size) {
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  memset(bufs, 0, sizeof(*bufs));
+  // the kernel wants a power of 2 of entries, page aligned
+  bufs->ring_size = count * sizeof(struct io_uring_buf);
+  bufs->ring = mmap(NULL, bufs->ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs->ring == MAP_FAILED) {
+    bufs->ring = NULL;
+    return -1;
+  }
+  bufs->bufs = mmap(NULL, count * size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs->bufs == MAP_FAILED) {
+    bufs->bufs = NULL;
+    goto fail;
+  }
+  bufs->size = size;
+  bufs->count = count;
+  bufs->bgid = bgid;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)bufs->ring;
+  reg.ring_entries = count;
+  reg.bgid = bgid;
+  if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    goto fail;
+  }
+  for (i = 0; i < count; i++) {
+    uring_bufs_recycle(bufs, i);
+  }
+  return 0;
+
+fail:;
+  const int err = errno;
+  if (bufs->bufs != NULL)
+    munmap(bufs->bufs, count * size);
+  munmap(bufs->ring, bufs->ring_size);
+  memset(bufs, 0, sizeof(*bufs));
+  errno = err;
+  return -1;
+}
+
+void uring_bufs_free(struct uring *ring, struct uring_bufs *bufs) {
+  struct io_uring_buf_reg reg;
+
+  if (bufs->ring == NULL)
+    return;
+  memset(&reg, 0, sizeof(reg));
+  reg.bgid = bufs->bgid;
+  if (ring->fd != -1)
+    io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  munmap(bufs->bufs, bufs->count * bufs->size);
+  munmap(bufs->ring, bufs->ring_size);
+  memset(bufs, 0, sizeof(*bufs));
+}
+
+void uring_bufs_recycle(struct uring_bufs *bufs, int buf_id) {
+  struct io_uring_buf_ring *br = bufs->ring;
+  struct io_uring_buf *buf = &br->bufs[bufs->tail & (bufs->count - 1)];
+
+  buf->addr = (uintptr_t)uring_bufs_get(bufs, buf_id);
+  buf->len = bufs->size;
+  buf->bid = buf_id;
+  bufs->tail++;
+  __atomic_store_n(&br->tail, bufs->tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+  const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (ring->sqe_tail - head >= ring->sq_entries) {
+    errno = EBUSY;
+    return NULL;
+  }
+  const unsigned index = ring->sqe_tail++ & ring->sq_mask;
+  struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  return sqe;
+}
+
+// the registered file for fd, if any
+static void uring_set_file(struct uring *ring, struct io_uring_sqe *sqe,
+                           int fd) {
+  unsigned i;
+
+  for (i = 0; i < ring->nfiles; i++) {
+    if (ring->files[i] == fd) {
+      sqe->fd = i;
+      sqe->flags |= IOSQE_FIXED_FILE;
+      return;
+    }
+  }
+  sqe->fd = fd;
+}
+
+// the registered buffer that holds [buf, buf + len), or -1
+static int uring_find_buffer(const struct uring *ring, const void *buf,
+                             size_t len) {
+  const char *p = buf;
+  unsigned i;
+
+  for (i = 0; i < ring->nbuffers; i++) {
+    const char *base = ring->buffers[i].iov_base;
+    if (p >= base && p + len <= base + ring->buffers[i].iov_len)
+      return i;
+  }
+  return -1;
+}
+
+static int uring_rw(struct uring *ring, int op, int fixed_op, int fd,
+                    const void *buf, size_t len, uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  const int index = uring_find_buffer(ring, buf, len);
+
+  sqe->opcode = index == -1 ? op : fixed_op;
+  uring_set_file(ring, sqe, fd);
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  // the current file position, for pipes and the like
+  sqe->off = (uint64_t)-1;
+  if (index != -1)
+    sqe->buf_index = index;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int uring_read(struct uring *ring, int fd, void *buf, size_t len,
+               uint64_t user_data) {
+  return uring_rw(ring, IORING_OP_READ, IORING_OP_READ_FIXED, fd, buf, len,
+                  user_data);
+}
+
+int uring_write(struct uring *ring, int fd, const void *buf, size_t len,
+                uint64_t user_data) {
+  return uring_rw(ring, IORING_OP_WRITE, IORING_OP_WRITE_FIXED, fd, buf, len,
+                  user_data);
+}
+
+int uring_writev(struct uring *ring, int fd, const struct iovec *iov, int n,
+                 uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_WRITEV;
+  uring_set_file(ring, sqe, fd);
+  sqe->addr = (uintptr_t)iov;
+  sqe->len = n;
+  sqe->off = (uint64_t)-1;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int uring_recv_multishot(struct uring *ring, int fd, struct uring_bufs *bufs,
+                         uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  uring_set_file(ring, sqe, fd);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = bufs->bgid;
+  sqe->user_data = user_data;
+  return 0;
+}
+
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr,
+                          int64_t timeout) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  const unsigned to_submit =
+      ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000000;
+    ts.tv_nsec = timeout % 1000000 * 1000;
+    arg.ts = (uintptr_t)&ts;
+  }
+  if (io_uring_enter(ring->fd, to_submit, wait_nr,
+                     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                     sizeof(arg)) == -1) {
+    // a timeout, or completions that could not be posted yet
+    if (errno == ETIME || errno == EBUSY)
+      return 0;
+    return -1;
+  }
+  return 0;
+}
+
+int uring_reap(struct uring *ring, struct uring_completion *c) {
+  const unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  const struct io_uring_cqe *cqe =
+      &((struct io_uring_cqe *)ring->cqes)[head & ring->cq_mask];
+  c->user_data = cqe->user_data;
+  c->res = cqe->res;
+  c->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  c->buf_id = cqe->flags & IORING_CQE_F_BUFFER
+                  ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT)
+                  : -1;
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+#else
+
+int uring_init(struct uring *ring, unsigned entries) {
+  (void)entries;
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  errno = ENOSYS;
+  return -1;
+}
+
+void uring_free(struct uring *ring) { (void)ring; }
+
+int uring_register_files(struct uring *ring, const int *fds, unsigned n) {
+  (void)ring;
+  (void)fds;
+  (void)n;
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov,
+                           unsigned n) {
+  (void)ring;
+  (void)iov;
+  (void)n;
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_bufs_init(struct uring *ring, struct uring_bufs *bufs,
+                    unsigned short bgid, unsigned count, size_t size) {
+  (void)ring;
+  (void)bgid;
+  (void)count;
+  (void)size;
+  memset(bufs, 0, sizeof(*bufs));
+  errno = ENOSYS;
+  return -1;
+}
+
+void uring_bufs_free(struct uring *ring, struct uring_bufs *bufs) {
+  (void)ring;
+  (void)bufs;
+}
+
+void uring_bufs_recycle(struct uring_bufs *bufs, int buf_id) {
+  (void)bufs;
+  (void)buf_id;
+}
+
+int uring_read(struct uring *ring, int fd, void *buf, size_t len,
+               uint64_t user_data) {
+  (void)ring;
+  (void)fd;
+  (void)buf;
+  (void)len;
+  (void)user_data;
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_write(struct uring *ring, int fd, const void *buf, size_t len,
+                uint64_t user_data) {
+  (void)ring;
+  (void)fd;
+  (void)buf;
+  (void)len;
+  (void)user_data;
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_writev(struct uring *ring, int fd, const struct iovec *iov, int n,
+                 uint64_t user_data) {
+  (void)ring;
+  (void)fd;
+  (void)iov;
+  (void)n;
+  (void)user_data;
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_recv_multishot(struct uring *ring, int fd, struct uring_bufs *bufs,
+                         uint64_t user_data) {
+  (void)ring;
+  (void)fd;
+  (void)bufs;
+  (void)user_data;
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr,
+                          int64_t timeout) {
+  (void)ring;
+  (void)wait_nr;
+  (void)timeout;
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_reap(struct uring *ring, struct uring_completion *c) {
+  (void)ring;
+  (void)c;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring on the raw system calls: a submission and completion
+ * queue pair mapped from the kernel. Operations are queued locally and
+ * handed to the kernel together with the wait for completions, so one
+ * system call submits and reaps a whole batch.
+ *
+ * Files and buffers can be registered. Operations on a registered file or
+ * within a registered buffer use them without being told, which saves the
+ * kernel the file lookup and the page pinning per operation. Provided
+ * buffers let a multishot receive pick a buffer for each completion.
+ */
+
+#define URING_FILES_MAX 4
+#define URING_BUFFERS_MAX 8
+
+struct uring {
+  int fd;
+  unsigned features;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  void *sqes;
+  // tail of the locally queued entries, published on submit
+  unsigned sqe_tail;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  void *cqes;
+
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;
+  size_t cq_map_size;
+  size_t sqes_size;
+
+  int files[URING_FILES_MAX];
+  unsigned nfiles;
+  struct iovec buffers[URING_BUFFERS_MAX];
+  unsigned nbuffers;
+};
+
+// a group of <count> buffers of <size> bytes that receives pick from
+struct uring_bufs {
+  void *ring;
+  size_t ring_size;
+  char *bufs;
+  size_t size;
+  unsigned count;
+  unsigned short bgid;
+  unsigned short tail;
+};
+
+struct uring_completion {
+  uint64_t user_data;
+  int res;
+  // the operation goes on and completes again
+  int more;
+  // the provided buffer the data is in, or -1
+  int buf_id;
+};
+
+// returns 0, or -1 with errno set (ENOSYS: io_uring or a feature that is
+// needed, e.g. timed waits, is missing)
+int uring_init(struct uring *ring, unsigned entries);
+void uring_free(struct uring *ring);
+
+int uring_register_files(struct uring *ring, const int *fds, unsigned n);
+int uring_register_buffers(struct uring *ring, const struct iovec *iov,
+                           unsigned n);
+
+int uring_bufs_init(struct uring *ring, struct uring_bufs *bufs,
+                    unsigned short bgid, unsigned count, size_t size);
+void uring_bufs_free(struct uring *ring, struct uring_bufs *bufs);
+
+static inline char *uring_bufs_get(const struct uring_bufs *bufs,
+                                   int buf_id) {
+  return bufs->bufs + (size_t)buf_id * bufs->size;
+}
+
+// hand a buffer back for the receives to pick
+void uring_bufs_recycle(struct uring_bufs *bufs, int buf_id);
+
+// queue an operation; -1 with errno EBUSY if the submission queue is full
+int uring_read(struct uring *ring, int fd, void *buf, size_t len,
+               uint64_t user_data);
+int uring_write(struct uring *ring, int fd, const void *buf, size_t len,
+                uint64_t user_data);
+int uring_writev(struct uring *ring, int fd, const struct iovec *iov, int n,
+                 uint64_t user_data);
+int uring_recv_multishot(struct uring *ring, int fd, struct uring_bufs *bufs,
+                         uint64_t user_data);
+
+// submit what is queued and wait until there are wait_nr completions or
+// timeout microseconds passed (-1: no timeout); returns 0 or -1
+int uring_submit_and_wait(struct uring *ring, unsigned wait_nr,
+                          int64_t timeout);
+
+// take the next completion; returns 0 if there is none
+int uring_reap(struct uring *ring, struct uring_completion *c);
+
+#endif